@@ -0,0 +1,837 @@
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "jitterdebugger.h"
+
+/*
+ * Receives the -n streams of many jitterdebugger instances. Every
+ * receive thread has its own SO_REUSEPORT socket, the kernel hashes
+ * the senders onto the sockets, so a sender is normally handled by
+ * one thread only. Each sender, identified by its address and sender
+ * id, gets a directory DIR/HOST-ID with a samples.raw.
+ *
+ * The --stream-hist windows are added up per thread and written as
+ * DIR/HOST-ID/results.json every COLLECT_RESULTS_S and at the end.
+ * Their outliers go into samples.raw.
+ */
+
+#define COLLECT_BATCH		64
+#define COLLECT_TIMEOUT_MS	100
+#define COLLECT_RCVBUF		(8 * 1024 * 1024)
+/* Threads per sender which fit into the reserved samples.raw header */
+#define COLLECT_MAX_THREADS	CPU_SETSIZE
+#define COLLECT_RESULTS_S	10
+
+/*
+ * Sequence numbers of the last 64 packets of a thread, bit i of seen
+ * stands for next - 1 - i. See seq_window_add().
+ */
+struct seq_window {
+	uint64_t next;
+	uint64_t seen;
+};
+
+union collect_packet {
+	struct jd_packet samples;
+	struct jd_hist_header hist;
+	uint8_t data[JD_HIST_PACKET_SIZE];
+};
+
+/* Sum of the windows of one thread of a --stream-hist sender */
+struct hist_thread {
+	struct histogram *hist;
+	uint32_t cpu;
+	struct seq_window seq;
+	int last;		/* JD_HIST_LAST seen */
+	uint64_t count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	uint64_t windows;
+	uint64_t lost;
+	uint64_t outliers;
+	uint64_t outliers_dropped;
+	uint64_t start_ns;	/* sender's CLOCK_MONOTONIC */
+	uint64_t end_ns;
+};
+
+struct sender {
+	struct sender *next;
+	struct sockaddr_storage addr;
+	uint32_t id;
+	char *path;
+
+	pthread_mutex_t lock;
+	FILE *raw;
+	uint32_t resolution_ns;
+	uint64_t first_ts;
+	uint64_t realtime_offset;	/* CLOCK_REALTIME - CLOCK_MONOTONIC */
+	int have_realtime;		/* only sent with --stream-hist */
+	unsigned int nr_threads;
+	struct seq_window *seq;	/* per thread */
+	uint8_t *last;		/* JD_PACKET_LAST seen */
+	int finished;
+
+	uint64_t packets;
+	uint64_t lost;
+	uint64_t reordered;
+	uint64_t samples;
+	uint64_t bytes;
+	uint64_t first_ns;	/* receive time */
+	uint64_t last_ns;
+
+	/* --stream-hist */
+	struct hist_thread *hist;
+	unsigned int nr_hist;
+	uint64_t hist_packets;
+	uint64_t hist_invalid;
+	int hist_dirty;		/* results.json is outdated */
+};
+
+struct collector {
+	const char *dir;
+	const char *port;
+	unsigned int senders_expected;
+	int *stop;
+
+	pthread_mutex_t lock;
+	struct sender *senders;
+	unsigned int nr_finished;
+	uint64_t invalid;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int same_host(const struct sockaddr_storage *a,
+		     const struct sockaddr_storage *b)
+{
+	const struct sockaddr_in *a4 = (const void *)a, *b4 = (const void *)b;
+	const struct sockaddr_in6 *a6 = (const void *)a, *b6 = (const void *)b;
+
+	if (a->ss_family != b->ss_family)
+		return 0;
+	if (a->ss_family == AF_INET)
+		return a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+	if (a->ss_family == AF_INET6)
+		return !memcmp(&a6->sin6_addr, &b6->sin6_addr,
+			       sizeof(a6->sin6_addr));
+
+	return 0;
+}
+
+static struct sender *sender_create(struct collector *c,
+				    const struct sockaddr_storage *addr,
+				    socklen_t len, uint32_t id)
+{
+	char host[NI_MAXHOST], *name;
+	struct sender *s;
+	uint32_t hdr_size;
+	int err;
+
+	err = getnameinfo((const void *)addr, len, host,
+			  sizeof(host), NULL, 0, NI_NUMERICHOST);
+	if (err)
+		strcpy(host, "unknown");
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		err_handler(ENOMEM, "calloc()");
+	s->addr = *addr;
+	s->id = id;
+	pthread_mutex_init(&s->lock, NULL);
+
+	if (asprintf(&name, "%s-%u", host, id) < 0 ||
+	    asprintf(&s->path, "%s/%s", c->dir, name) < 0)
+		err_handler(errno, "asprintf()");
+	free(name);
+
+	if (mkdir(s->path, 0777) < 0 && errno != EEXIST)
+		err_handler(errno, "Could not create '%s'", s->path);
+
+	s->raw = jd_fopen(s->path, "samples.raw", "w");
+	if (!s->raw)
+		err_handler(errno, "Could not create '%s/samples.raw'",
+			    s->path);
+	setvbuf(s->raw, NULL, _IOFBF, 1024 * 1024);
+
+	/* The header is written when the sender is closed */
+	hdr_size = jd_samples_header_size(COLLECT_MAX_THREADS);
+	if (fseeko(s->raw, hdr_size, SEEK_SET) < 0)
+		err_handler(errno, "fseeko()");
+
+	return s;
+}
+
+static struct sender *sender_get(struct collector *c,
+				 const struct sockaddr_storage *addr,
+				 socklen_t len, uint32_t id)
+{
+	struct sender *s;
+
+	pthread_mutex_lock(&c->lock);
+	for (s = c->senders; s; s = s->next) {
+		if (s->id == id && same_host(&s->addr, addr))
+			break;
+	}
+	if (!s) {
+		s = sender_create(c, addr, len, id);
+		s->next = c->senders;
+		c->senders = s;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return s;
+}
+
+static void sender_grow(struct sender *s, unsigned int cpuid)
+{
+	unsigned int n = cpuid + 1;
+
+	s->seq = realloc(s->seq, n * sizeof(*s->seq));
+	s->last = realloc(s->last, n * sizeof(*s->last));
+	if (!s->seq || !s->last)
+		err_handler(ENOMEM, "realloc()");
+
+	memset(s->seq + s->nr_threads, 0,
+	       (n - s->nr_threads) * sizeof(*s->seq));
+	memset(s->last + s->nr_threads, 0,
+	       (n - s->nr_threads) * sizeof(*s->last));
+	s->nr_threads = n;
+}
+
+/* All threads of the sender have sent their last packet */
+static int sender_done(struct sender *s)
+{
+	unsigned int i;
+
+	if (s->finished || (!s->nr_threads && !s->nr_hist))
+		return 0;
+
+	for (i = 0; i < s->nr_threads; i++) {
+		if (!s->last[i])
+			return 0;
+	}
+	for (i = 0; i < s->nr_hist; i++) {
+		if (s->hist[i].hist && !s->hist[i].last)
+			return 0;
+	}
+
+	s->finished = 1;
+	return 1;
+}
+
+static void sender_received(struct sender *s, uint32_t resolution_ns,
+			    size_t len)
+{
+	if (!s->first_ns) {
+		s->first_ns = now_ns();
+		s->resolution_ns = resolution_ns;
+	}
+	s->last_ns = now_ns();
+	s->bytes += len;
+}
+
+/*
+ * A gap in the sequence numbers is counted as lost right away. If a
+ * packet of the gap arrives later it is taken back and the packet
+ * counts as reordered instead, duplicates within the window are
+ * ignored. Returns 1 for a reordered packet.
+ */
+static int seq_window_add(struct seq_window *w, uint64_t seq, uint64_t *lost)
+{
+	uint64_t shift, bit;
+
+	if (seq >= w->next) {
+		shift = seq - w->next + 1;
+		*lost += seq - w->next;
+		w->seen = shift < 64 ? w->seen << shift : 0;
+		w->seen |= 1;
+		w->next = seq + 1;
+		return 0;
+	}
+
+	/* Older than the window, assume it was still missing */
+	bit = w->next - 1 - seq;
+	if (bit < 64) {
+		if (w->seen & (1ULL << bit))
+			return 0;
+		w->seen |= 1ULL << bit;
+	}
+	if (*lost)
+		(*lost)--;
+
+	return 1;
+}
+
+/* Returns 1 if the packet completed the sender */
+static int sender_add(struct sender *s, struct jd_packet *p, size_t len)
+{
+	struct jd_packet_header *h = &p->hdr;
+	uint64_t ts;
+	int done = 0;
+
+	pthread_mutex_lock(&s->lock);
+
+	if (h->cpuid >= s->nr_threads)
+		sender_grow(s, h->cpuid);
+
+	if (seq_window_add(&s->seq[h->cpuid], h->seq, &s->lost))
+		s->reordered++;
+
+	if (h->count &&
+	    fwrite(p->samples, sizeof(struct latency_sample), h->count,
+		   s->raw) != h->count)
+		err_handler(errno, "fwrite()");
+
+	sender_received(s, h->resolution_ns, len);
+	if (h->count) {
+		ts = (uint64_t)p->samples[0].ts.tv_sec * 1000000000 +
+			p->samples[0].ts.tv_nsec;
+		if (!s->first_ts || ts < s->first_ts)
+			s->first_ts = ts;
+	}
+	s->packets++;
+	s->samples += h->count;
+
+	if (h->flags & JD_PACKET_LAST) {
+		s->last[h->cpuid] = 1;
+		done = sender_done(s);
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	return done;
+}
+
+static struct hist_thread *hist_thread_get(struct sender *s,
+					   struct jd_hist_header *h)
+{
+	struct hist_thread *t;
+	unsigned int n = h->cpuid + 1;
+
+	if (h->cpuid >= s->nr_hist) {
+		s->hist = realloc(s->hist, n * sizeof(*s->hist));
+		if (!s->hist)
+			err_handler(ENOMEM, "realloc()");
+		memset(s->hist + s->nr_hist, 0,
+		       (n - s->nr_hist) * sizeof(*s->hist));
+		s->nr_hist = n;
+	}
+
+	t = &s->hist[h->cpuid];
+	if (!t->hist) {
+		t->hist = histogram_create(h->digits, h->max_value);
+		if (!t->hist)
+			return NULL;
+		t->cpu = h->cpu;
+		t->min = UINT64_MAX;
+		t->start_ns = h->start_ns;
+	}
+
+	/* The histograms of all windows must be compatible */
+	if (t->hist->digits != h->digits || t->hist->max_value != h->max_value)
+		return NULL;
+
+	return t;
+}
+
+/* Adds a window (part) of a --stream-hist sender */
+static int sender_add_hist(struct sender *s, union collect_packet *p,
+			   size_t len)
+{
+	struct jd_hist_header *h = &p->hist;
+	struct jd_hist_bucket *b;
+	struct jd_hist_outlier *o;
+	struct latency_sample ls;
+	struct hist_thread *t;
+	unsigned int i;
+	int done = 0;
+
+	pthread_mutex_lock(&s->lock);
+
+	t = hist_thread_get(s, h);
+	if (!t) {
+		s->hist_invalid++;
+		goto out;
+	}
+
+	sender_received(s, h->resolution_ns, len);
+	s->hist_packets++;
+	s->hist_dirty = 1;
+	if (!s->have_realtime) {
+		s->realtime_offset = h->realtime_ns - h->start_ns;
+		s->have_realtime = 1;
+	}
+
+	b = (void *)(p->data + sizeof(*h));
+	for (i = 0; i < h->nr_buckets; i++) {
+		if (b[i].idx < t->hist->size)
+			t->hist->buckets[b[i].idx] += b[i].count;
+		else
+			t->hist->overflow += b[i].count;
+	}
+
+	o = (void *)(b + h->nr_buckets);
+	for (i = 0; i < h->nr_outliers; i++) {
+		ls.cpuid = h->cpuid;
+		ls.ts.tv_sec = o[i].ts / 1000000000;
+		ls.ts.tv_nsec = o[i].ts % 1000000000;
+		ls.val = o[i].val;
+		if (fwrite(&ls, sizeof(ls), 1, s->raw) != 1)
+			err_handler(errno, "fwrite()");
+		if (!s->first_ts || o[i].ts < s->first_ts)
+			s->first_ts = o[i].ts;
+	}
+	t->outliers += h->nr_outliers;
+	s->samples += h->nr_outliers;
+
+	if (!h->part) {
+		seq_window_add(&t->seq, h->seq, &t->lost);
+
+		t->windows++;
+		t->count += h->count;
+		t->total += h->total;
+		if (h->count && h->min < t->min)
+			t->min = h->min;
+		if (h->max > t->max)
+			t->max = h->max;
+		t->hist->overflow += h->overflow;
+		t->outliers_dropped += h->outliers_dropped;
+		if (h->start_ns + h->length_ns > t->end_ns)
+			t->end_ns = h->start_ns + h->length_ns;
+	}
+
+	if ((h->flags & JD_HIST_LAST) && h->part == h->nr_parts - 1) {
+		t->last = 1;
+		done = sender_done(s);
+	}
+
+out:
+	pthread_mutex_unlock(&s->lock);
+
+	return done;
+}
+
+/* Buckets are keyed by the lowest value they count, as jitterdebugger does */
+static void hist_thread_dump(FILE *f, struct hist_thread *t)
+{
+	struct histogram *h = t->hist;
+	unsigned int j, comma;
+
+	fprintf(f, "      \"histogram\": {");
+	for (j = 0, comma = 0; j < h->size; j++) {
+		if (!h->buckets[j])
+			continue;
+		fprintf(f, "%s        \"%" PRIu64 "\": %" PRIu64,
+			comma ? ",\n" : "\n", histogram_bucket_low(h, j),
+			h->buckets[j]);
+		comma = 1;
+	}
+	fprintf(f, "%s},\n", comma ? "\n      " : "");
+	fprintf(f, "      \"overflow\": %" PRIu64 ",\n", h->overflow);
+	fprintf(f, "      \"affinity\": %u,\n", t->cpu);
+	fprintf(f, "      \"windows\": %" PRIu64 ",\n", t->windows);
+	fprintf(f, "      \"windows_lost\": %" PRIu64 ",\n", t->lost);
+	fprintf(f, "      \"outliers\": %" PRIu64 ",\n", t->outliers);
+	fprintf(f, "      \"outliers_dropped\": %" PRIu64 ",\n",
+		t->outliers_dropped);
+	fprintf(f, "      \"duration_ns\": %" PRIu64 ",\n",
+		t->end_ns - t->start_ns);
+	fprintf(f, "      \"count\": %" PRIu64 ",\n", t->count);
+	fprintf(f, "      \"min\": %" PRIu64 ",\n", t->count ? t->min : 0);
+	fprintf(f, "      \"max\": %" PRIu64 ",\n", t->max);
+	fprintf(f, "      \"avg\": %.2f\n",
+		t->count ? (double)t->total / t->count : 0.0);
+}
+
+/*
+ * Writes the sum of all windows received so far to results.json, in
+ * the layout of jitterdebugger. The file is replaced atomically, so
+ * it can be read while the collector is running.
+ */
+static void sender_results(struct sender *s)
+{
+	char *tmp, *fn;
+	unsigned int i, n, digits = 0;
+	FILE *f;
+
+	pthread_mutex_lock(&s->lock);
+	if (!s->hist_dirty)
+		goto out;
+	s->hist_dirty = 0;
+
+	if (asprintf(&tmp, "%s/results.json.tmp", s->path) < 0 ||
+	    asprintf(&fn, "%s/results.json", s->path) < 0)
+		err_handler(errno, "asprintf()");
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		warn_handler("Could not create '%s'", tmp);
+		goto free;
+	}
+
+	for (i = 0; i < s->nr_hist; i++) {
+		if (s->hist[i].hist)
+			digits = s->hist[i].hist->digits;
+	}
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"version\": 4,\n");
+	fprintf(f, "  \"sysinfo\": {\n");
+	fprintf(f, "    \"resolution_in_ns\": %u,\n", s->resolution_ns);
+	fprintf(f, "    \"histogram_digits\": %u\n", digits);
+	fprintf(f, "  },\n");
+	fprintf(f, "  \"collector\": {\n");
+	fprintf(f, "    \"sender\": %u,\n", s->id);
+	fprintf(f, "    \"packets\": %" PRIu64 ",\n", s->hist_packets);
+	fprintf(f, "    \"invalid\": %" PRIu64 ",\n", s->hist_invalid);
+	fprintf(f, "    \"finished\": %s\n", s->finished ? "true" : "false");
+	fprintf(f, "  },\n");
+	fprintf(f, "  \"cpu\": {\n");
+	for (i = 0, n = 0; i < s->nr_hist; i++) {
+		if (!s->hist[i].hist)
+			continue;
+		fprintf(f, "%s    \"%u\": {\n", n++ ? ",\n" : "", i);
+		hist_thread_dump(f, &s->hist[i]);
+		fprintf(f, "    }");
+	}
+	fprintf(f, "%s  }\n", n ? "\n" : "");
+	fprintf(f, "}\n");
+
+	if (fclose(f) || rename(tmp, fn) < 0)
+		warn_handler("Could not write '%s'", fn);
+free:
+	free(fn);
+	free(tmp);
+out:
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void sender_close(struct sender *s)
+{
+	struct jd_samples_header *h;
+	uint32_t len;
+	unsigned int i;
+
+	len = jd_samples_header_size(COLLECT_MAX_THREADS);
+	h = calloc(1, len);
+	if (!h)
+		err_handler(ENOMEM, "calloc()");
+
+	memcpy(h->magic, JD_SAMPLES_MAGIC, sizeof(h->magic));
+	h->version = JD_SAMPLES_VERSION;
+	h->header_size = len;
+	h->record_size = sizeof(struct latency_sample);
+	h->resolution_ns = s->resolution_ns;
+	h->clock_id = CLOCK_MONOTONIC;
+	h->nr_threads = s->nr_threads > s->nr_hist ? s->nr_threads : s->nr_hist;
+	h->start_ns = s->first_ts;
+	if (s->have_realtime)
+		h->start_realtime_ns = s->first_ts + s->realtime_offset;
+	/* Only the histogram stream tells the CPUs */
+	for (i = 0; i < h->nr_threads; i++) {
+		if (i < s->nr_hist && s->hist[i].hist)
+			h->threads[i].cpu = s->hist[i].cpu;
+		else
+			h->threads[i].cpu = i;
+	}
+
+	if (fseeko(s->raw, 0, SEEK_SET) < 0 ||
+	    fwrite(h, len, 1, s->raw) != 1)
+		err_handler(errno, "Could not write the samples.raw header");
+	free(h);
+
+	fclose(s->raw);
+	s->raw = NULL;
+}
+
+static void sender_free(struct sender *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->nr_hist; i++) {
+		if (s->hist[i].hist)
+			histogram_free(s->hist[i].hist);
+	}
+	free(s->hist);
+	pthread_mutex_destroy(&s->lock);
+	free(s->seq);
+	free(s->last);
+	free(s->path);
+	free(s);
+}
+
+static int packet_valid(struct jd_packet *p, size_t len)
+{
+	struct jd_packet_header *h = &p->hdr;
+
+	return len >= sizeof(*h) &&
+		h->magic == JD_PACKET_MAGIC &&
+		h->version == JD_PACKET_VERSION &&
+		h->count <= SAMPLES_PER_PACKET &&
+		h->cpuid < COLLECT_MAX_THREADS &&
+		len == sizeof(*h) + h->count * sizeof(struct latency_sample);
+}
+
+static int hist_packet_valid(struct jd_hist_header *h, size_t len)
+{
+	return len >= sizeof(*h) &&
+		h->magic == JD_HIST_MAGIC &&
+		h->version == JD_HIST_VERSION &&
+		h->cpuid < COLLECT_MAX_THREADS &&
+		h->part < h->nr_parts &&
+		h->digits >= HISTOGRAM_MIN_DIGITS &&
+		h->digits <= HISTOGRAM_MAX_DIGITS &&
+		len == sizeof(*h) +
+		h->nr_buckets * sizeof(struct jd_hist_bucket) +
+		h->nr_outliers * sizeof(struct jd_hist_outlier);
+}
+
+static int collector_socket(const char *port)
+{
+	struct timeval tv = { 0, COLLECT_TIMEOUT_MS * 1000 };
+	struct addrinfo hints, *res, *tmp;
+	int err, sk = -1, one = 1, rcvbuf = COLLECT_RCVBUF;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_PASSIVE;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+
+	err = getaddrinfo(NULL, port, &hints, &res);
+	if (err)
+		err_handler(EINVAL, "getaddrinfo(): %s", gai_strerror(err));
+
+	for (tmp = res; tmp; tmp = tmp->ai_next) {
+		sk = socket(tmp->ai_family, tmp->ai_socktype,
+			    tmp->ai_protocol);
+		if (sk < 0)
+			continue;
+		if (setsockopt(sk, SOL_SOCKET, SO_REUSEPORT, &one,
+			       sizeof(one)) == 0 &&
+		    bind(sk, tmp->ai_addr, tmp->ai_addrlen) == 0)
+			break;
+		close(sk);
+		sk = -1;
+	}
+	freeaddrinfo(res);
+	if (sk < 0)
+		err_handler(errno, "Could not bind to port %s", port);
+
+	if (setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+		warn_handler("Could not set the receive buffer size");
+	if (setsockopt(sk, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+		err_handler(errno, "setsockopt()");
+
+	return sk;
+}
+
+struct collector_thread {
+	struct collector *c;
+	pthread_t tid;
+	int sk;
+};
+
+static void *collector_thread(void *arg)
+{
+	struct collector_thread *t = arg;
+	struct collector *c = t->c;
+	struct sockaddr_storage addrs[COLLECT_BATCH];
+	struct mmsghdr msgs[COLLECT_BATCH];
+	struct iovec iov[COLLECT_BATCH];
+	union collect_packet *pkts;
+	struct sender *s;
+	int i, n, done;
+
+	pkts = calloc(COLLECT_BATCH, sizeof(*pkts));
+	if (!pkts)
+		err_handler(ENOMEM, "calloc()");
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < COLLECT_BATCH; i++) {
+		iov[i].iov_base = &pkts[i];
+		iov[i].iov_len = sizeof(pkts[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+	}
+
+	while (!READ_ONCE(*c->stop)) {
+		for (i = 0; i < COLLECT_BATCH; i++)
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+
+		n = recvmmsg(t->sk, msgs, COLLECT_BATCH, MSG_WAITFORONE, NULL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR)
+				continue;
+			err_handler(errno, "recvmmsg()");
+		}
+
+		for (i = 0; i < n; i++) {
+			if (packet_valid(&pkts[i].samples, msgs[i].msg_len)) {
+				s = sender_get(c, &addrs[i],
+					       msgs[i].msg_hdr.msg_namelen,
+					       pkts[i].samples.hdr.sender);
+				done = sender_add(s, &pkts[i].samples,
+						  msgs[i].msg_len);
+			} else if (hist_packet_valid(&pkts[i].hist,
+						     msgs[i].msg_len)) {
+				s = sender_get(c, &addrs[i],
+					       msgs[i].msg_hdr.msg_namelen,
+					       pkts[i].hist.sender);
+				done = sender_add_hist(s, &pkts[i],
+						       msgs[i].msg_len);
+			} else {
+				__atomic_add_fetch(&c->invalid, 1,
+						   __ATOMIC_RELAXED);
+				continue;
+			}
+
+			if (done &&
+			    __atomic_add_fetch(&c->nr_finished, 1,
+					       __ATOMIC_RELAXED) ==
+			    c->senders_expected)
+				WRITE_ONCE(*c->stop, 1);
+		}
+	}
+
+	free(pkts);
+	return NULL;
+}
+
+static void collector_report(struct collector *c)
+{
+	struct hist_thread *t;
+	struct sender *s;
+	uint64_t sent, ns;
+	unsigned int i;
+	double mb;
+
+	for (s = c->senders; s; s = s->next) {
+		sent = s->packets + s->lost;
+		ns = s->last_ns - s->first_ns;
+		mb = ns ? (double)s->bytes / ns * 1000000000 / (1024 * 1024) : 0;
+		if (s->packets || !s->hist_packets)
+			printf("%s: %" PRIu64 " packets, %" PRIu64 " lost "
+			       "(%.2f%%), %" PRIu64 " reordered, %" PRIu64
+			       " samples, %.2f MB/s%s\n",
+			       s->path, s->packets, s->lost,
+			       sent ? 100.0 * s->lost / sent : 0.0,
+			       s->reordered, s->samples, mb,
+			       s->finished ? "" : ", incomplete");
+		else
+			printf("%s: %" PRIu64 " histogram packets, %.2f KB/s%s\n",
+			       s->path, s->hist_packets, mb * 1024,
+			       s->finished ? "" : ", incomplete");
+		for (i = 0; i < s->nr_hist; i++) {
+			t = &s->hist[i];
+			if (!t->hist)
+				continue;
+			printf("  T:%2u windows %" PRIu64 ", lost %" PRIu64
+			       ", outliers %" PRIu64 "\n",
+			       i, t->windows, t->lost, t->outliers);
+		}
+	}
+	if (c->invalid)
+		printf("%" PRIu64 " invalid packets\n", c->invalid);
+}
+
+/*
+ * Receives until *stop is set or, if senders is not 0, until that
+ * many senders have sent the last packet of all their threads. Then
+ * export() is called for every sender directory.
+ */
+int jd_collect(const char *port, const char *dir, unsigned int threads,
+	       unsigned int senders, int *stop,
+	       void (*export)(const char *dir, void *arg), void *arg)
+{
+	struct collector_thread *t;
+	struct collector c;
+	struct sender *s, *next;
+	unsigned int i;
+	uint64_t next_ns;
+	int err;
+
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST)
+		err_handler(errno, "Could not create '%s'", dir);
+
+	memset(&c, 0, sizeof(c));
+	c.dir = dir;
+	c.port = port;
+	c.senders_expected = senders;
+	c.stop = stop;
+	pthread_mutex_init(&c.lock, NULL);
+
+	t = calloc(threads, sizeof(*t));
+	if (!t)
+		err_handler(ENOMEM, "calloc()");
+
+	/* Bind all sockets first, so no thread sees the whole traffic */
+	for (i = 0; i < threads; i++) {
+		t[i].c = &c;
+		t[i].sk = collector_socket(port);
+	}
+	for (i = 0; i < threads; i++) {
+		err = pthread_create(&t[i].tid, NULL, collector_thread, &t[i]);
+		if (err)
+			err_handler(err, "pthread_create()");
+	}
+
+	/* Keep the results.json of the histogram streams up to date */
+	next_ns = now_ns() + COLLECT_RESULTS_S * 1000000000ULL;
+	while (!READ_ONCE(*stop)) {
+		usleep(COLLECT_TIMEOUT_MS * 1000);
+		if (now_ns() < next_ns)
+			continue;
+		next_ns += COLLECT_RESULTS_S * 1000000000ULL;
+
+		pthread_mutex_lock(&c.lock);
+		for (s = c.senders; s; s = s->next)
+			sender_results(s);
+		pthread_mutex_unlock(&c.lock);
+	}
+
+	for (i = 0; i < threads; i++) {
+		err = pthread_join(t[i].tid, NULL);
+		if (err)
+			err_handler(err, "pthread_join()");
+		close(t[i].sk);
+	}
+	free(t);
+
+	for (s = c.senders; s; s = s->next) {
+		sender_close(s);
+		sender_results(s);
+	}
+
+	collector_report(&c);
+
+	for (s = c.senders; s; s = next) {
+		next = s->next;
+		if (export)
+			export(s->path, arg);
+		sender_free(s);
+	}
+	pthread_mutex_destroy(&c.lock);
+
+	return 0;
+}
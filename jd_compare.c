@@ -0,0 +1,453 @@
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "jitterdebugger.h"
+
+/*
+ * Regression gate against a baseline results.json (jitterdebugger
+ * --baseline, jittersamples --compare). The distribution of every CPU
+ * is kept as ascending list of bucket values in ns. A CPU has
+ * regressed if one of the checked percentiles grew by more than its
+ * limit, or if the one sided two-sample Kolmogorov-Smirnov test says
+ * the latencies got larger.
+ *
+ * Every bucket only records its lowest value. Before comparing, both
+ * sides are moved onto the coarser layout of the two (resolution and
+ * histogram digits), otherwise a us baseline sits up to a whole
+ * microsecond below an ns run and the KS test sees a shift which is
+ * not there.
+ */
+
+#define NSEC_PER_SEC		1000000000ULL
+/* results.json written before histogram_digits was stored */
+#define DEFAULT_DIGITS		2
+
+void jd_compare_init(struct jd_compare_params *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->percentiles[0] = 99;
+	p->limits[0] = 10;
+	p->percentiles[1] = 99.99;
+	p->limits[1] = 20;
+	p->num_percentiles = 2;
+	p->ks_alpha = 0.001;
+	/*
+	 * With millions of samples the KS test detects any shift, a
+	 * regression also needs the CDFs to be apart by at least this.
+	 */
+	p->ks_min_d = 0.05;
+}
+
+/* P:PCT[,P:PCT...], e.g. 99:10,99.99:20 */
+int jd_compare_parse_limits(struct jd_compare_params *p, char *str)
+{
+	char *tok, *end, *saveptr;
+	unsigned int n = 0;
+	double v, limit;
+
+	for (tok = strtok_r(str, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		errno = 0;
+		v = strtod(tok, &end);
+		if (errno || end == tok || *end != ':' || !(v > 0 && v <= 100))
+			return -EINVAL;
+		tok = end + 1;
+		errno = 0;
+		limit = strtod(tok, &end);
+		if (errno || end == tok || *end || limit < 0)
+			return -EINVAL;
+		if (n && v <= p->percentiles[n - 1])
+			return -EINVAL;
+		if (n == JD_COMPARE_MAX)
+			return -E2BIG;
+		p->percentiles[n] = v;
+		p->limits[n] = limit;
+		n++;
+	}
+	p->num_percentiles = n;
+
+	return 0;
+}
+
+/* Returns the distribution of cpu, adds it if missing */
+struct jd_dist *jd_dists_cpu(struct jd_dists *d, unsigned int cpu)
+{
+	struct jd_dist *tmp;
+	unsigned int i;
+
+	for (i = 0; i < d->nr; i++) {
+		if (d->cpu[i].cpu == cpu)
+			return &d->cpu[i];
+	}
+
+	tmp = realloc(d->cpu, (d->nr + 1) * sizeof(*d->cpu));
+	if (!tmp)
+		err_handler(ENOMEM, "realloc()");
+	d->cpu = tmp;
+	memset(&d->cpu[d->nr], 0, sizeof(*d->cpu));
+	d->cpu[d->nr].cpu = cpu;
+
+	return &d->cpu[d->nr++];
+}
+
+void jd_dist_add(struct jd_dist *d, uint64_t val, uint64_t count)
+{
+	struct jd_dist_bucket *tmp;
+
+	if (!count)
+		return;
+
+	if (d->nr == d->size) {
+		d->size = d->size ? d->size * 2 : 256;
+		tmp = realloc(d->b, d->size * sizeof(*d->b));
+		if (!tmp)
+			err_handler(ENOMEM, "realloc()");
+		d->b = tmp;
+	}
+	d->b[d->nr].val = val;
+	d->b[d->nr].count = count;
+	d->nr++;
+	d->count += count;
+}
+
+/* Like results.json, samples beyond the histogram count as 1s */
+void jd_dist_add_histogram(struct jd_dist *d, struct histogram *h,
+			   unsigned int resolution_ns)
+{
+	unsigned int i;
+
+	for (i = 0; i < h->size; i++)
+		jd_dist_add(d, histogram_bucket_low(h, i) * resolution_ns,
+			    h->buckets[i]);
+	jd_dist_add(d, NSEC_PER_SEC, h->overflow);
+}
+
+static int bucket_cmp(const void *a, const void *b)
+{
+	const struct jd_dist_bucket *ba = a, *bb = b;
+
+	if (ba->val != bb->val)
+		return ba->val < bb->val ? -1 : 1;
+	return 0;
+}
+
+static int dist_cmp(const void *a, const void *b)
+{
+	const struct jd_dist *da = a, *db = b;
+
+	return (da->cpu > db->cpu) - (da->cpu < db->cpu);
+}
+
+static void dist_finish(struct jd_dist *d)
+{
+	unsigned int i, n = 0;
+
+	qsort(d->b, d->nr, sizeof(*d->b), bucket_cmp);
+	for (i = 0; i < d->nr; i++) {
+		if (n && d->b[n - 1].val == d->b[i].val)
+			d->b[n - 1].count += d->b[i].count;
+		else
+			d->b[n++] = d->b[i];
+	}
+	d->nr = n;
+}
+
+/* Sorts the CPUs and the buckets, call after the last jd_dist_add() */
+void jd_dists_finish(struct jd_dists *d)
+{
+	unsigned int i;
+
+	for (i = 0; i < d->nr; i++)
+		dist_finish(&d->cpu[i]);
+	qsort(d->cpu, d->nr, sizeof(*d->cpu), dist_cmp);
+}
+
+void jd_dists_free(struct jd_dists *d)
+{
+	unsigned int i;
+
+	for (i = 0; i < d->nr; i++)
+		free(d->cpu[i].b);
+	free(d->cpu);
+	memset(d, 0, sizeof(*d));
+}
+
+/*
+ * Reads the "cpu" histograms of a results.json, or of DIR/results.json.
+ * Threads on the same CPU are added up.
+ */
+int jd_dists_load(struct jd_dists *d, const char *path)
+{
+	struct jd_json *root, *sys, *cpus, *c, *hist, *b;
+	struct jd_dist *dist;
+	struct stat st;
+	uint64_t res, digits, val;
+	char *fn, *end;
+	int err = 0;
+
+	memset(d, 0, sizeof(*d));
+
+	if (!stat(path, &st) && S_ISDIR(st.st_mode)) {
+		if (asprintf(&fn, "%s/results.json", path) < 0)
+			err_handler(errno, "asprintf()");
+		root = jd_json_load(fn);
+		free(fn);
+	} else {
+		root = jd_json_load(path);
+	}
+	if (!root)
+		return -errno;
+
+	/* Files written before -N existed are in us */
+	sys = jd_json_get(root, "sysinfo");
+	res = jd_json_u64(jd_json_get(sys, "resolution_in_ns"), 1000);
+	digits = jd_json_u64(jd_json_get(sys, "histogram_digits"),
+			     DEFAULT_DIGITS);
+	cpus = jd_json_get(root, "cpu");
+	if (!res || res > 1000 || digits < HISTOGRAM_MIN_DIGITS ||
+	    digits > HISTOGRAM_MAX_DIGITS ||
+	    !cpus || cpus->type != JD_JSON_OBJECT) {
+		err = -EINVAL;
+		goto out;
+	}
+	d->resolution_ns = res;
+	d->digits = digits;
+
+	for (c = cpus->child; c; c = c->next) {
+		hist = jd_json_get(c, "histogram");
+		if (!hist || hist->type != JD_JSON_OBJECT) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		dist = jd_dists_cpu(d, jd_json_u64(jd_json_get(c, "affinity"),
+						   strtoul(c->key, NULL, 10)));
+		for (b = hist->child; b; b = b->next) {
+			val = strtoull(b->key, &end, 10);
+			if (*end || b->type != JD_JSON_NUMBER) {
+				err = -EINVAL;
+				goto out;
+			}
+			jd_dist_add(dist, val * res, b->u64);
+		}
+		jd_dist_add(dist, NSEC_PER_SEC,
+			    jd_json_u64(jd_json_get(c, "overflow"), 0));
+	}
+	jd_dists_finish(d);
+out:
+	jd_json_free(root);
+	if (err)
+		jd_dists_free(d);
+
+	return err;
+}
+
+/*
+ * Moves every bucket of d to the lowest value of the bucket of h
+ * holding it, h has the coarser layout. The overflow stays at 1s,
+ * values beyond h join it.
+ */
+static void dist_rebin(struct jd_dist *d, struct histogram *h,
+		       unsigned int res)
+{
+	unsigned int i, idx;
+
+	for (i = 0; i < d->nr; i++) {
+		if (d->b[i].val >= NSEC_PER_SEC)
+			continue;
+		idx = histogram_index(h, d->b[i].val / res);
+		if (idx < h->size)
+			d->b[i].val = histogram_bucket_low(h, idx) * res;
+		else
+			d->b[i].val = NSEC_PER_SEC;
+	}
+	dist_finish(d);
+}
+
+static void dists_rebin(struct jd_dists *d, struct histogram *h,
+			unsigned int res)
+{
+	unsigned int i;
+
+	for (i = 0; i < d->nr; i++)
+		dist_rebin(&d->cpu[i], h, res);
+}
+
+static uint64_t dist_percentile(struct jd_dist *d, double p)
+{
+	uint64_t sum = 0, target;
+	unsigned int i;
+
+	target = (uint64_t)(d->count * p / 100.0 + 0.5);
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < d->nr; i++) {
+		sum += d->b[i].count;
+		if (sum >= target)
+			return d->b[i].val;
+	}
+
+	return d->nr ? d->b[d->nr - 1].val : 0;
+}
+
+/*
+ * One sided KS statistic D+ = max(F_base(x) - F_run(x)), positive if
+ * the run has more samples at higher latencies. The p-value is the
+ * asymptotic exp(-2 n m / (n + m) D^2).
+ */
+static double dist_ks(struct jd_dist *base, struct jd_dist *run, double *pval)
+{
+	uint64_t cb = 0, cr = 0, x;
+	unsigned int i = 0, j = 0;
+	double d = 0, diff, ne;
+
+	while (i < base->nr || j < run->nr) {
+		if (j == run->nr ||
+		    (i < base->nr && base->b[i].val <= run->b[j].val))
+			x = base->b[i].val;
+		else
+			x = run->b[j].val;
+
+		while (i < base->nr && base->b[i].val <= x)
+			cb += base->b[i++].count;
+		while (j < run->nr && run->b[j].val <= x)
+			cr += run->b[j++].count;
+
+		diff = (double)cb / base->count - (double)cr / run->count;
+		if (diff > d)
+			d = diff;
+	}
+
+	ne = (double)base->count * run->count / (base->count + run->count);
+	*pval = exp(-2.0 * ne * d * d);
+
+	return d;
+}
+
+static int compare_dist(const char *name, struct jd_dist *base,
+			struct jd_dist *run, unsigned int unit,
+			struct jd_compare_params *p)
+{
+	uint64_t vb, vr, limit;
+	double change, d, pval;
+	unsigned int i;
+	int regressions = 0, bad;
+
+	printf("%s: %" PRIu64 " -> %" PRIu64 " samples\n", name,
+	       base->count, run->count);
+	if (!base->count || !run->count) {
+		printf("  no samples to compare\n");
+		return 0;
+	}
+
+	for (i = 0; i < p->num_percentiles; i++) {
+		vb = dist_percentile(base, p->percentiles[i]);
+		vr = dist_percentile(run, p->percentiles[i]);
+		change = vb ? ((double)vr - vb) * 100.0 / vb : 0;
+		limit = vb + (uint64_t)(vb * p->limits[i] / 100.0) +
+			p->slack * unit;
+		bad = vr > limit;
+		regressions += bad;
+		printf("  P%-8g %10" PRIu64 " -> %10" PRIu64 " %+8.1f%%"
+		       "  (limit %g%%)%s\n", p->percentiles[i], vb / unit,
+		       vr / unit, change, p->limits[i],
+		       bad ? "  REGRESSION" : "");
+	}
+
+	if (p->ks_alpha > 0) {
+		d = dist_ks(base, run, &pval);
+		bad = pval < p->ks_alpha && d >= p->ks_min_d;
+		regressions += bad;
+		printf("  KS D+ %.4f p %.3g  (alpha %g)%s\n", d, pval,
+		       p->ks_alpha, bad ? "  REGRESSION" : "");
+	}
+
+	return regressions;
+}
+
+/*
+ * Prints the comparison of every CPU of the baseline and of all CPUs
+ * together. Both sides are moved onto the coarser layout first.
+ * Returns the number of regressions.
+ */
+int jd_compare(struct jd_dists *base, struct jd_dists *run,
+	       struct jd_compare_params *p)
+{
+	struct jd_dist all_base = { 0 }, all_run = { 0 }, *r;
+	unsigned int i, j, unit, digits;
+	struct histogram *h;
+	int regressions = 0, bad;
+	char name[32];
+
+	unit = base->resolution_ns > run->resolution_ns ?
+		base->resolution_ns : run->resolution_ns;
+	digits = base->digits < run->digits ? base->digits : run->digits;
+	h = histogram_create(digits, NSEC_PER_SEC / unit);
+	if (!h)
+		err_handler(ENOMEM, "histogram_create()");
+	dists_rebin(base, h, unit);
+	dists_rebin(run, h, unit);
+	histogram_free(h);
+
+	printf("Comparison with the baseline, latencies in %s\n",
+	       unit == 1 ? "ns" : "us");
+
+	for (i = 0; i < base->nr; i++) {
+		r = NULL;
+		for (j = 0; j < run->nr; j++) {
+			if (run->cpu[j].cpu == base->cpu[i].cpu)
+				r = &run->cpu[j];
+		}
+		snprintf(name, sizeof(name), "CPU %u", base->cpu[i].cpu);
+		if (!r) {
+			/* A CPU which stopped reporting hides its latencies */
+			bad = !p->allow_missing;
+			regressions += bad;
+			printf("%s: missing in the run%s\n", name,
+			       bad ? "  REGRESSION" : "");
+			continue;
+		}
+		regressions += compare_dist(name, &base->cpu[i], r, unit, p);
+	}
+
+	for (i = 0; i < run->nr; i++) {
+		for (j = 0; j < base->nr; j++) {
+			if (base->cpu[j].cpu == run->cpu[i].cpu)
+				break;
+		}
+		if (j == base->nr)
+			printf("CPU %u: not in the baseline\n",
+			       run->cpu[i].cpu);
+	}
+
+	for (i = 0; i < base->nr; i++) {
+		for (j = 0; j < base->cpu[i].nr; j++)
+			jd_dist_add(&all_base, base->cpu[i].b[j].val,
+				    base->cpu[i].b[j].count);
+	}
+	for (i = 0; i < run->nr; i++) {
+		for (j = 0; j < run->cpu[i].nr; j++)
+			jd_dist_add(&all_run, run->cpu[i].b[j].val,
+				    run->cpu[i].b[j].count);
+	}
+	dist_finish(&all_base);
+	dist_finish(&all_run);
+	regressions += compare_dist("All", &all_base, &all_run, unit, p);
+	free(all_base.b);
+	free(all_run.b);
+
+	printf("%s: %d regression%s\n", regressions ? "FAIL" : "PASS",
+	       regressions, regressions == 1 ? "" : "s");
+
+	return regressions;
+}
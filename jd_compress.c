@@ -0,0 +1,455 @@
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+
+#include "jitterdebugger.h"
+
+/*
+ * Compressed sample file (samples.jdc)
+ *
+ *   struct jdc_file_header
+ *   struct jd_samples_header, padded to jdc_file_header.header_size
+ *   block 0: struct jdc_block_header, payload
+ *   block 1: ...
+ *   index:   struct jdc_index_entry[nr_blocks]
+ *   struct jdc_trailer
+ *
+ * A block holds up to JDC_BLOCK_SAMPLES samples of one thread. The
+ * first timestamp is stored in the header. For every sample the
+ * payload contains the zigzag encoded delta-of-delta of the timestamp
+ * and the latency, both as LEB128 varint. With a steady interval the
+ * delta-of-delta is just the wakeup jitter, which takes one or two
+ * bytes, and the latency usually fits into one byte.
+ *
+ * Readers can use min/max of the block headers to skip blocks without
+ * decoding them. The trailing index allows to find the blocks without
+ * scanning the file. If the recording was interrupted before the index
+ * was written, the reader scans the block headers instead.
+ */
+
+#define JDC_BLOCK_SAMPLES	4096
+/* two varints of at most 10 bytes each */
+#define JDC_BLOCK_PAYLOAD	(JDC_BLOCK_SAMPLES * 20)
+
+struct jdc_block {
+	struct jdc_block_header hdr;
+	uint64_t prev_ts;
+	int64_t prev_delta;
+	uint8_t payload[JDC_BLOCK_PAYLOAD];
+};
+
+struct jdc_writer {
+	jdc_write_fn write;
+	void *arg;
+	uint64_t off;
+	unsigned int nr_threads;
+	struct jdc_block *blocks;	/* one open block per thread */
+	struct jdc_index_entry *index;
+	uint32_t nr_index;
+	uint32_t max_index;
+};
+
+static inline uint64_t zigzag_enc(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t zigzag_dec(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline unsigned int varint_put(uint8_t *p, uint64_t v)
+{
+	unsigned int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = (uint8_t)v;
+
+	return n;
+}
+
+static inline int varint_get(const uint8_t *p, const uint8_t *end,
+			     uint64_t *v)
+{
+	unsigned int shift = 0;
+	const uint8_t *s = p;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p - s;
+		shift += 7;
+	}
+
+	return -EINVAL;
+}
+
+static void jdc_emit(struct jdc_writer *w, const void *data, size_t len)
+{
+	w->write(w->arg, data, len);
+	w->off += len;
+}
+
+/* hdr describes the recording, it is copied into the file header */
+struct jdc_writer *jdc_writer_create(const struct jd_samples_header *hdr,
+				     jdc_write_fn write, void *arg)
+{
+	struct jdc_file_header fh;
+	struct jdc_writer *w;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+
+	w->blocks = calloc(hdr->nr_threads, sizeof(*w->blocks));
+	if (!w->blocks) {
+		free(w);
+		return NULL;
+	}
+	w->nr_threads = hdr->nr_threads;
+	w->write = write;
+	w->arg = arg;
+
+	memset(&fh, 0, sizeof(fh));
+	fh.magic = JDC_MAGIC;
+	fh.version = JDC_VERSION;
+	fh.block_samples = JDC_BLOCK_SAMPLES;
+	fh.header_size = hdr->header_size;
+	jdc_emit(w, &fh, sizeof(fh));
+	jdc_emit(w, hdr, hdr->header_size);
+
+	return w;
+}
+
+static void jdc_block_flush(struct jdc_writer *w, unsigned int cpu)
+{
+	struct jdc_block *b = &w->blocks[cpu];
+	struct jdc_index_entry *e;
+
+	if (!b->hdr.count)
+		return;
+
+	if (w->nr_index == w->max_index) {
+		w->max_index = w->max_index ? w->max_index * 2 : 64;
+		w->index = realloc(w->index,
+				   w->max_index * sizeof(*w->index));
+		if (!w->index)
+			err_handler(ENOMEM, "realloc()");
+	}
+	e = &w->index[w->nr_index++];
+	e->offset = w->off;
+	e->hdr = b->hdr;
+
+	jdc_emit(w, &b->hdr, sizeof(b->hdr));
+	jdc_emit(w, b->payload, b->hdr.size);
+
+	memset(&b->hdr, 0, sizeof(b->hdr));
+}
+
+void jdc_writer_add(struct jdc_writer *w, unsigned int cpu, uint64_t ts,
+		    uint64_t val)
+{
+	struct jdc_block *b = &w->blocks[cpu];
+	int64_t delta;
+
+	if (!b->hdr.count) {
+		b->hdr.magic = JDC_BLOCK_MAGIC;
+		b->hdr.cpuid = cpu;
+		b->hdr.first_ts = ts;
+		b->hdr.min = UINT64_MAX;
+		b->prev_ts = ts;
+		b->prev_delta = 0;
+	}
+
+	delta = ts - b->prev_ts;
+	b->hdr.size += varint_put(b->payload + b->hdr.size,
+				  zigzag_enc(delta - b->prev_delta));
+	b->hdr.size += varint_put(b->payload + b->hdr.size, val);
+	b->prev_delta = delta;
+	b->prev_ts = ts;
+
+	b->hdr.last_ts = ts;
+	if (val < b->hdr.min)
+		b->hdr.min = val;
+	if (val > b->hdr.max)
+		b->hdr.max = val;
+
+	if (++b->hdr.count == JDC_BLOCK_SAMPLES)
+		jdc_block_flush(w, cpu);
+}
+
+/* Writes the open blocks, the index and the trailer */
+void jdc_writer_close(struct jdc_writer *w)
+{
+	struct jdc_trailer t;
+	unsigned int i;
+
+	for (i = 0; i < w->nr_threads; i++)
+		jdc_block_flush(w, i);
+
+	memset(&t, 0, sizeof(t));
+	t.index_offset = w->off;
+	t.nr_blocks = w->nr_index;
+	t.magic = JDC_MAGIC;
+
+	if (w->nr_index)
+		jdc_emit(w, w->index, w->nr_index * sizeof(*w->index));
+	jdc_emit(w, &t, sizeof(t));
+}
+
+void jdc_writer_free(struct jdc_writer *w)
+{
+	free(w->index);
+	free(w->blocks);
+	free(w);
+}
+
+struct jdc_reader {
+	FILE *fd;
+	struct jd_samples_header *samples_hdr;	/* NULL for version 1 */
+	struct jdc_index_entry *index;
+	uint32_t nr_blocks;
+	uint32_t next;		/* next block to load */
+	jdc_block_filter filter;
+	void *filter_arg;
+
+	/* Current block */
+	struct jdc_block_header hdr;
+	uint8_t *payload;
+	const uint8_t *p;
+	uint32_t left;
+	uint64_t ts;
+	int64_t delta;
+};
+
+/*
+ * Builds the index from the block headers following each other from
+ * off on. Stops at the first block which is incomplete or not a block
+ * at all, the part the recording didn't get to write anymore.
+ */
+static void jdc_scan_blocks(struct jdc_reader *r, off_t off)
+{
+	struct jdc_index_entry e;
+	uint32_t max = 0;
+
+	while (fseeko(r->fd, off, SEEK_SET) == 0 &&
+	       fread(&e.hdr, sizeof(e.hdr), 1, r->fd) == 1 &&
+	       e.hdr.magic == JDC_BLOCK_MAGIC &&
+	       e.hdr.size <= JDC_BLOCK_PAYLOAD &&
+	       e.hdr.count && e.hdr.count <= JDC_BLOCK_SAMPLES &&
+	       fseeko(r->fd, off + sizeof(e.hdr) + e.hdr.size - 1,
+		      SEEK_SET) == 0 &&
+	       fgetc(r->fd) != EOF) {
+		if (r->nr_blocks == max) {
+			max = max ? max * 2 : 256;
+			r->index = realloc(r->index, max * sizeof(*r->index));
+			if (!r->index)
+				err_handler(ENOMEM, "realloc()");
+		}
+		e.offset = off;
+		r->index[r->nr_blocks++] = e;
+		off += sizeof(e.hdr) + e.hdr.size;
+	}
+}
+
+struct jdc_reader *jdc_reader_open(FILE *fd)
+{
+	struct jdc_file_header fh;
+	struct jdc_trailer t;
+	struct jdc_reader *r;
+	off_t data_off;
+	int has_index;
+
+	if (fseeko(fd, 0, SEEK_SET) < 0 ||
+	    fread(&fh, sizeof(fh), 1, fd) != 1 ||
+	    fh.magic != JDC_MAGIC || !fh.version || fh.version > JDC_VERSION)
+		return NULL;
+	if (fh.version > 1 &&
+	    fh.header_size < sizeof(struct jd_samples_header))
+		return NULL;
+
+	has_index = fseeko(fd, -(off_t)sizeof(t), SEEK_END) == 0 &&
+		fread(&t, sizeof(t), 1, fd) == 1 && t.magic == JDC_MAGIC;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		err_handler(ENOMEM, "calloc()");
+
+	r->fd = fd;
+	data_off = sizeof(fh) + (fh.version > 1 ? fh.header_size : 0);
+	if (fh.version > 1) {
+		r->samples_hdr = malloc(fh.header_size);
+		if (!r->samples_hdr)
+			err_handler(ENOMEM, "malloc()");
+		if (fseeko(fd, sizeof(fh), SEEK_SET) < 0 ||
+		    fread(r->samples_hdr, fh.header_size, 1, fd) != 1)
+			err_handler(EIO, "Could not read the samples header");
+	}
+
+	r->payload = malloc(JDC_BLOCK_PAYLOAD);
+	if (!r->payload)
+		err_handler(ENOMEM, "malloc()");
+
+	if (!has_index) {
+		jdc_scan_blocks(r, data_off);
+		warn_handler("Compressed sample file has no index, the "
+			     "recording was interrupted. Recovered %u blocks",
+			     r->nr_blocks);
+		return r;
+	}
+
+	r->nr_blocks = t.nr_blocks;
+	r->index = calloc(t.nr_blocks ? t.nr_blocks : 1, sizeof(*r->index));
+	if (!r->index)
+		err_handler(ENOMEM, "calloc()");
+
+	if (t.nr_blocks &&
+	    (fseeko(fd, t.index_offset, SEEK_SET) < 0 ||
+	     fread(r->index, sizeof(*r->index), t.nr_blocks, fd) !=
+	     t.nr_blocks))
+		err_handler(EIO, "Could not read the block index");
+
+	return r;
+}
+
+void jdc_reader_close(struct jdc_reader *r)
+{
+	free(r->samples_hdr);
+	free(r->payload);
+	free(r->index);
+	free(r);
+}
+
+/* Blocks for which filter returns 0 are skipped without decoding */
+void jdc_reader_set_filter(struct jdc_reader *r, jdc_block_filter filter,
+			   void *arg)
+{
+	r->filter = filter;
+	r->filter_arg = arg;
+}
+
+static int jdc_block_wanted(struct jdc_reader *r,
+			    const struct jdc_block_header *hdr)
+{
+	return !r->filter || r->filter(r->filter_arg, hdr);
+}
+
+/* Number of samples in the blocks which pass the filter */
+uint64_t jdc_reader_count(struct jdc_reader *r)
+{
+	uint64_t count = 0;
+	uint32_t i;
+
+	for (i = 0; i < r->nr_blocks; i++) {
+		if (jdc_block_wanted(r, &r->index[i].hdr))
+			count += r->index[i].hdr.count;
+	}
+
+	return count;
+}
+
+/* Header of the recording, NULL for files written before version 2 */
+const struct jd_samples_header *jdc_reader_header(struct jdc_reader *r)
+{
+	return r->samples_hdr;
+}
+
+/* Timestamp of the last sample of all blocks */
+uint64_t jdc_reader_last_ts(struct jdc_reader *r)
+{
+	uint64_t ts = 0;
+	uint32_t i;
+
+	for (i = 0; i < r->nr_blocks; i++) {
+		if (r->index[i].hdr.last_ts > ts)
+			ts = r->index[i].hdr.last_ts;
+	}
+
+	return ts;
+}
+
+/* Highest thread index of all blocks plus one */
+unsigned int jdc_reader_threads(struct jdc_reader *r)
+{
+	unsigned int n = 0;
+	uint32_t i;
+
+	for (i = 0; i < r->nr_blocks; i++) {
+		if (r->index[i].hdr.cpuid >= n)
+			n = r->index[i].hdr.cpuid + 1;
+	}
+
+	return n;
+}
+
+static int jdc_load_block(struct jdc_reader *r)
+{
+	struct jdc_index_entry *e;
+
+	for (; r->next < r->nr_blocks; r->next++) {
+		e = &r->index[r->next];
+		if (!jdc_block_wanted(r, &e->hdr))
+			continue;
+
+		if (fseeko(r->fd, e->offset, SEEK_SET) < 0 ||
+		    fread(&r->hdr, sizeof(r->hdr), 1, r->fd) != 1 ||
+		    r->hdr.magic != JDC_BLOCK_MAGIC ||
+		    r->hdr.size > JDC_BLOCK_PAYLOAD ||
+		    fread(r->payload, 1, r->hdr.size, r->fd) != r->hdr.size)
+			err_handler(EIO, "Corrupted block %u", r->next);
+
+		r->next++;
+		r->p = r->payload;
+		r->left = r->hdr.count;
+		r->ts = r->hdr.first_ts;
+		r->delta = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Decodes up to n samples, returns the number of samples decoded */
+size_t jdc_reader_read(struct jdc_reader *r, struct latency_sample *buf,
+		       size_t n)
+{
+	const uint8_t *end;
+	uint64_t dod, val;
+	size_t i = 0;
+	int len;
+
+	while (i < n) {
+		if (!r->left && !jdc_load_block(r))
+			break;
+
+		end = r->payload + r->hdr.size;
+		for (; i < n && r->left; i++, r->left--) {
+			len = varint_get(r->p, end, &dod);
+			if (len < 0)
+				err_handler(EIO, "Corrupted block");
+			r->p += len;
+			len = varint_get(r->p, end, &val);
+			if (len < 0)
+				err_handler(EIO, "Corrupted block");
+			r->p += len;
+
+			r->delta += zigzag_dec(dod);
+			r->ts += r->delta;
+
+			buf[i].cpuid = r->hdr.cpuid;
+			buf[i].ts.tv_sec = r->ts / 1000000000;
+			buf[i].ts.tv_nsec = r->ts % 1000000000;
+			buf[i].val = val;
+		}
+	}
+
+	return i;
+}
@@ -0,0 +1,169 @@
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jitterdebugger.h"
+
+/*
+ * Log-linear histogram in the spirit of HdrHistogram. Values below
+ * 2^sub_bucket_bits are counted exactly, above that each power of two
+ * is split into 2^(sub_bucket_bits - 1) equally sized buckets. That
+ * keeps the relative error below the requested number of significant
+ * digits while the memory grows only logarithmically with the highest
+ * trackable value. Anything beyond that ends up in the overflow
+ * bucket.
+ */
+
+struct histogram *histogram_create(unsigned int digits, uint64_t max_value)
+{
+	struct histogram *h;
+	uint64_t largest = 2;
+	unsigned int i, bits = 1;
+
+	if (digits < HISTOGRAM_MIN_DIGITS || digits > HISTOGRAM_MAX_DIGITS)
+		return NULL;
+
+	for (i = 0; i < digits; i++)
+		largest *= 10;
+	while ((1ULL << bits) < largest)
+		bits++;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return NULL;
+
+	h->digits = digits;
+	h->sub_bucket_bits = bits;
+	h->size = histogram_index(h, max_value) + 1;
+	h->max_value = histogram_bucket_high(h, h->size - 1);
+
+	h->buckets = calloc(h->size, sizeof(uint64_t));
+	if (!h->buckets) {
+		free(h);
+		return NULL;
+	}
+	jd_prefault(h->buckets, h->size * sizeof(uint64_t));
+
+	return h;
+}
+
+void histogram_free(struct histogram *h)
+{
+	free(h->buckets);
+	free(h);
+}
+
+static unsigned int histogram_bucket_shift(struct histogram *h,
+					   unsigned int idx)
+{
+	unsigned int half = h->sub_bucket_bits - 1;
+
+	if (idx < (2U << half))
+		return 0;
+
+	return (idx >> half) - 1;
+}
+
+/* Lowest value which is counted in bucket idx */
+uint64_t histogram_bucket_low(struct histogram *h, unsigned int idx)
+{
+	unsigned int shift = histogram_bucket_shift(h, idx);
+	uint64_t sub = idx - (shift << (h->sub_bucket_bits - 1));
+
+	return sub << shift;
+}
+
+/* Highest value which is counted in bucket idx */
+uint64_t histogram_bucket_high(struct histogram *h, unsigned int idx)
+{
+	unsigned int shift = histogram_bucket_shift(h, idx);
+
+	return histogram_bucket_low(h, idx) + (1ULL << shift) - 1;
+}
+
+/*
+ * Like histogram_percentile() for n percentiles at once, p has to be
+ * sorted in ascending order. The buckets are walked only once.
+ */
+void histogram_percentiles(struct histogram *h, const double *p,
+			   uint64_t *val, unsigned int n)
+{
+	uint64_t count = h->overflow, sum = 0, target;
+	unsigned int i, j = 0;
+
+	for (i = 0; i < h->size; i++)
+		count += h->buckets[i];
+	if (!count) {
+		for (j = 0; j < n; j++)
+			val[j] = 0;
+		return;
+	}
+
+	for (i = 0; i < h->size && j < n; i++) {
+		sum += h->buckets[i];
+		for (; j < n; j++) {
+			target = (uint64_t)(count * p[j] / 100.0 + 0.5);
+			if (target < 1)
+				target = 1;
+			if (sum < target)
+				break;
+			val[j] = histogram_bucket_low(h, i);
+		}
+	}
+
+	for (; j < n; j++)
+		val[j] = h->max_value + 1;
+}
+
+/*
+ * Returns the lowest value of the bucket which contains the given
+ * percentile (0 < p <= 100). Samples in the overflow bucket are
+ * reported as max_value + 1.
+ */
+uint64_t histogram_percentile(struct histogram *h, double p)
+{
+	uint64_t val;
+
+	histogram_percentiles(h, &p, &val, 1);
+
+	return val;
+}
+
+/*
+ * Number of values >= val. The bucket which contains val is counted
+ * in full, so above the exactly counted range the threshold is
+ * rounded down to the lower bound of its bucket.
+ */
+uint64_t histogram_count_from(struct histogram *h, uint64_t val)
+{
+	uint64_t count = h->overflow;
+	unsigned int i;
+
+	for (i = histogram_index(h, val); i < h->size; i++)
+		count += h->buckets[i];
+
+	return count;
+}
+
+/* Adds the counts of src to dst, both must have the same layout */
+int histogram_merge(struct histogram *dst, struct histogram *src)
+{
+	unsigned int i;
+
+	if (dst->digits != src->digits || dst->size != src->size)
+		return -EINVAL;
+
+	for (i = 0; i < src->size; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->overflow += src->overflow;
+
+	return 0;
+}
+
+void histogram_reset(struct histogram *h)
+{
+	memset(h->buckets, 0, h->size * sizeof(uint64_t));
+	h->overflow = 0;
+}
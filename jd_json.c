@@ -0,0 +1,452 @@
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jitterdebugger.h"
+
+/*
+ * Minimal JSON reader for results.json. The whole document is parsed
+ * into a tree of struct jd_json. Members of objects and elements of
+ * arrays are kept in order in a singly linked list, lookups are
+ * linear which is fine for the small objects we read.
+ */
+
+#define JSON_MAX_DEPTH	64
+
+struct json_parser {
+	const char *p;
+	const char *end;
+	unsigned int depth;
+};
+
+static struct jd_json *json_value(struct json_parser *jp);
+
+static void json_skip_ws(struct json_parser *jp)
+{
+	while (jp->p < jp->end &&
+	       (*jp->p == ' ' || *jp->p == '\t' ||
+		*jp->p == '\n' || *jp->p == '\r'))
+		jp->p++;
+}
+
+static int json_expect(struct json_parser *jp, char c)
+{
+	json_skip_ws(jp);
+	if (jp->p == jp->end || *jp->p != c)
+		return -1;
+	jp->p++;
+	return 0;
+}
+
+static int json_literal(struct json_parser *jp, const char *lit)
+{
+	size_t len = strlen(lit);
+
+	if ((size_t)(jp->end - jp->p) < len || memcmp(jp->p, lit, len))
+		return -1;
+	jp->p += len;
+	return 0;
+}
+
+static int json_hex4(const char *p, unsigned int *cp)
+{
+	unsigned int i, v = 0;
+	char c;
+
+	for (i = 0; i < 4; i++) {
+		c = p[i];
+		v <<= 4;
+		if (c >= '0' && c <= '9')
+			v |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			v |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			v |= c - 'A' + 10;
+		else
+			return -1;
+	}
+	*cp = v;
+	return 0;
+}
+
+static char *json_utf8(char *d, unsigned int cp)
+{
+	if (cp < 0x80) {
+		*d++ = cp;
+	} else if (cp < 0x800) {
+		*d++ = 0xc0 | (cp >> 6);
+		*d++ = 0x80 | (cp & 0x3f);
+	} else if (cp < 0x10000) {
+		*d++ = 0xe0 | (cp >> 12);
+		*d++ = 0x80 | ((cp >> 6) & 0x3f);
+		*d++ = 0x80 | (cp & 0x3f);
+	} else {
+		*d++ = 0xf0 | (cp >> 18);
+		*d++ = 0x80 | ((cp >> 12) & 0x3f);
+		*d++ = 0x80 | ((cp >> 6) & 0x3f);
+		*d++ = 0x80 | (cp & 0x3f);
+	}
+	return d;
+}
+
+/* The escaped string is never shorter than the decoded one */
+static char *json_string(struct json_parser *jp)
+{
+	const char *s;
+	char *str, *d;
+	unsigned int cp, lo;
+
+	if (json_expect(jp, '"'))
+		return NULL;
+
+	for (s = jp->p; s < jp->end && *s != '"'; s++) {
+		if (*s == '\\')
+			s++;
+	}
+	if (s >= jp->end)
+		return NULL;
+
+	str = malloc(s - jp->p + 1);
+	if (!str)
+		return NULL;
+
+	for (d = str; jp->p < s; jp->p++) {
+		if (*jp->p != '\\') {
+			*d++ = *jp->p;
+			continue;
+		}
+		switch (*++jp->p) {
+		case 'b':
+			*d++ = '\b';
+			break;
+		case 'f':
+			*d++ = '\f';
+			break;
+		case 'n':
+			*d++ = '\n';
+			break;
+		case 'r':
+			*d++ = '\r';
+			break;
+		case 't':
+			*d++ = '\t';
+			break;
+		case 'u':
+			if (s - jp->p < 5 || json_hex4(jp->p + 1, &cp))
+				goto err;
+			jp->p += 4;
+			/* surrogate pair */
+			if (cp >= 0xd800 && cp < 0xdc00 && s - jp->p >= 7 &&
+			    jp->p[1] == '\\' && jp->p[2] == 'u' &&
+			    !json_hex4(jp->p + 3, &lo) &&
+			    lo >= 0xdc00 && lo < 0xe000) {
+				cp = 0x10000 + ((cp - 0xd800) << 10) +
+					(lo - 0xdc00);
+				jp->p += 6;
+			}
+			d = json_utf8(d, cp);
+			break;
+		case '"':
+		case '\\':
+		case '/':
+			*d++ = *jp->p;
+			break;
+		default:
+			goto err;
+		}
+	}
+	*d = '\0';
+	jp->p = s + 1;
+
+	return str;
+err:
+	free(str);
+	return NULL;
+}
+
+static int json_number(struct json_parser *jp, struct jd_json *j)
+{
+	const char *s = jp->p;
+	char buf[64], *end;
+	size_t len;
+	int integer = 1;
+
+	while (jp->p < jp->end && strchr("+-0123456789.eE", *jp->p)) {
+		if (*jp->p == '.' || *jp->p == 'e' || *jp->p == 'E' ||
+		    *jp->p == '-')
+			integer = 0;
+		jp->p++;
+	}
+
+	len = jp->p - s;
+	if (!len || len >= sizeof(buf))
+		return -1;
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+
+	errno = 0;
+	j->num = strtod(buf, &end);
+	if (*end || errno)
+		return -1;
+
+	/* Counters don't fit into a double without loss */
+	if (integer)
+		j->u64 = strtoull(buf, NULL, 10);
+	else
+		j->u64 = j->num > 0 ? (uint64_t)j->num : 0;
+
+	return 0;
+}
+
+static struct jd_json *json_container(struct json_parser *jp,
+				      struct jd_json *j, char close)
+{
+	struct jd_json **tail = &j->child, *c;
+	char *key = NULL;
+
+	if (++jp->depth > JSON_MAX_DEPTH)
+		goto err;
+
+	json_skip_ws(jp);
+	if (jp->p < jp->end && *jp->p == close) {
+		jp->p++;
+		goto out;
+	}
+
+	while (1) {
+		if (close == '}') {
+			key = json_string(jp);
+			if (!key || json_expect(jp, ':'))
+				goto err;
+		}
+
+		c = json_value(jp);
+		if (!c)
+			goto err;
+		c->key = key;
+		key = NULL;
+		*tail = c;
+		tail = &c->next;
+
+		json_skip_ws(jp);
+		if (jp->p == jp->end)
+			goto err;
+		if (*jp->p == close) {
+			jp->p++;
+			break;
+		}
+		if (*jp->p++ != ',')
+			goto err;
+	}
+out:
+	jp->depth--;
+	return j;
+err:
+	free(key);
+	jd_json_free(j);
+	return NULL;
+}
+
+static struct jd_json *json_value(struct json_parser *jp)
+{
+	struct jd_json *j;
+
+	json_skip_ws(jp);
+	if (jp->p == jp->end)
+		return NULL;
+
+	j = calloc(1, sizeof(*j));
+	if (!j)
+		return NULL;
+
+	switch (*jp->p) {
+	case '{':
+		jp->p++;
+		j->type = JD_JSON_OBJECT;
+		return json_container(jp, j, '}');
+	case '[':
+		jp->p++;
+		j->type = JD_JSON_ARRAY;
+		return json_container(jp, j, ']');
+	case '"':
+		j->type = JD_JSON_STRING;
+		j->str = json_string(jp);
+		if (!j->str)
+			goto err;
+		return j;
+	case 't':
+		j->type = JD_JSON_BOOL;
+		j->u64 = 1;
+		if (json_literal(jp, "true"))
+			goto err;
+		return j;
+	case 'f':
+		j->type = JD_JSON_BOOL;
+		if (json_literal(jp, "false"))
+			goto err;
+		return j;
+	case 'n':
+		j->type = JD_JSON_NULL;
+		if (json_literal(jp, "null"))
+			goto err;
+		return j;
+	default:
+		j->type = JD_JSON_NUMBER;
+		if (json_number(jp, j))
+			goto err;
+		return j;
+	}
+err:
+	free(j);
+	return NULL;
+}
+
+struct jd_json *jd_json_parse(const char *buf, size_t len)
+{
+	struct json_parser jp = {
+		.p = buf,
+		.end = buf + len,
+	};
+	struct jd_json *j;
+
+	j = json_value(&jp);
+	if (!j)
+		return NULL;
+
+	json_skip_ws(&jp);
+	if (jp.p != jp.end) {
+		jd_json_free(j);
+		return NULL;
+	}
+
+	return j;
+}
+
+/* Returns NULL with errno set if the file can't be read or parsed */
+struct jd_json *jd_json_load(const char *path)
+{
+	struct jd_json *j;
+	size_t len = 0, size = 0, n;
+	char *buf = NULL, *tmp;
+	FILE *fd;
+
+	fd = fopen(path, "r");
+	if (!fd)
+		return NULL;
+
+	do {
+		if (len == size) {
+			size = size ? size * 2 : 64 * 1024;
+			tmp = realloc(buf, size);
+			if (!tmp) {
+				free(buf);
+				fclose(fd);
+				errno = ENOMEM;
+				return NULL;
+			}
+			buf = tmp;
+		}
+		n = fread(buf + len, 1, size - len, fd);
+		len += n;
+	} while (n);
+
+	if (ferror(fd)) {
+		free(buf);
+		fclose(fd);
+		errno = EIO;
+		return NULL;
+	}
+	fclose(fd);
+
+	j = jd_json_parse(buf, len);
+	free(buf);
+	if (!j)
+		errno = EINVAL;
+
+	return j;
+}
+
+void jd_json_free(struct jd_json *j)
+{
+	struct jd_json *next;
+
+	while (j) {
+		next = j->next;
+		jd_json_free(j->child);
+		free(j->key);
+		free(j->str);
+		free(j);
+		j = next;
+	}
+}
+
+/* Member key of an object or NULL */
+struct jd_json *jd_json_get(struct jd_json *j, const char *key)
+{
+	struct jd_json *c;
+
+	if (!j || j->type != JD_JSON_OBJECT)
+		return NULL;
+
+	for (c = j->child; c; c = c->next) {
+		if (!strcmp(c->key, key))
+			return c;
+	}
+
+	return NULL;
+}
+
+uint64_t jd_json_u64(struct jd_json *j, uint64_t def)
+{
+	if (!j || j->type != JD_JSON_NUMBER)
+		return def;
+	return j->u64;
+}
+
+double jd_json_num(struct jd_json *j, double def)
+{
+	if (!j || j->type != JD_JSON_NUMBER)
+		return def;
+	return j->num;
+}
+
+const char *jd_json_str(struct jd_json *j)
+{
+	if (!j || j->type != JD_JSON_STRING)
+		return NULL;
+	return j->str;
+}
+
+/* Writes s as JSON string, quoted and escaped */
+void jd_json_fputs(FILE *f, const char *s)
+{
+	const unsigned char *p;
+
+	fputc('"', f);
+	for (p = (const unsigned char *)s; *p; p++) {
+		switch (*p) {
+		case '"':
+		case '\\':
+			fputc('\\', f);
+			fputc(*p, f);
+			break;
+		case '\n':
+			fputs("\\n", f);
+			break;
+		case '\t':
+			fputs("\\t", f);
+			break;
+		default:
+			if (*p < 0x20)
+				fprintf(f, "\\u%04x", *p);
+			else
+				fputc(*p, f);
+		}
+	}
+	fputc('"', f);
+}
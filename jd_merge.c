@@ -0,0 +1,818 @@
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "jitterdebugger.h"
+
+/*
+ * Merges the results.json of many runs (jittersamples --merge). The
+ * files are parsed in parallel, every run is converted to ns so runs
+ * with and without -N can be mixed. The runs are then sorted by host
+ * and added up one host at a time into the histograms of the host, of
+ * every CPU and of all runs.
+ *
+ * The merged histograms use the coarsest resolution and the fewest
+ * digits of the runs. A bucket only records its lowest value, so
+ * putting a coarse bucket into a finer histogram would pile all of
+ * its samples up at the lower edge. The other way round a fine bucket
+ * lands in the coarse bucket holding its lowest value, which is off
+ * by at most one coarse bucket when it straddles a coarse boundary.
+ */
+
+#define NSEC_PER_SEC		1000000000ULL
+#define HOST_WIDTH		24
+
+struct merge_bucket {
+	uint64_t val;		/* ns, lowest value of the bucket */
+	uint64_t count;
+};
+
+struct merge_cpu {
+	unsigned int cpu;
+	uint64_t count;
+	uint64_t min;		/* ns */
+	uint64_t max;
+	uint64_t overflow;
+	double total;
+	double m2;		/* Welford, < 0 if the run has no stddev */
+	unsigned int nr_buckets;
+	struct merge_bucket *buckets;
+};
+
+struct merge_run {
+	char *path;
+	char *host;
+	unsigned int resolution_ns;
+	unsigned int digits;
+	unsigned int nr_cpus;
+	struct merge_cpu *cpus;
+	int err;
+};
+
+/* A merged host, CPU or all runs, all values but hist in ns */
+struct merge_stats {
+	struct histogram *hist;
+	unsigned int runs;	/* CPUs: threads */
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	double total;
+	double m2;
+	int m2_valid;
+};
+
+/* Row of the ranking tables and of "hosts" in the merged file */
+struct merge_rank {
+	const char *host;
+	int cpu;		/* -1 for the whole host */
+	unsigned int runs;
+	uint64_t count;
+	uint64_t min;		/* in the merged resolution */
+	uint64_t max;
+	uint64_t overflow;
+	double avg;
+	double stddev;		/* < 0 if unknown */
+	uint64_t *pval;
+	uint64_t key;		/* highest percentile, for the ranking */
+	unsigned int first_cpu;	/* host: its rows in the CPU ranking */
+	unsigned int nr_cpus;
+};
+
+struct merge_files {
+	char **paths;
+	unsigned int n;
+	unsigned int size;
+};
+
+struct merge_jobs {
+	struct merge_run *runs;
+	unsigned int n;
+	unsigned int next;
+};
+
+static void files_add(struct merge_files *f, char *path)
+{
+	char **tmp;
+
+	if (f->n == f->size) {
+		f->size = f->size ? f->size * 2 : 64;
+		tmp = realloc(f->paths, f->size * sizeof(*f->paths));
+		if (!tmp)
+			err_handler(ENOMEM, "realloc()");
+		f->paths = tmp;
+	}
+	f->paths[f->n++] = path;
+}
+
+static int is_file(const char *path)
+{
+	struct stat st;
+
+	return !stat(path, &st) && S_ISREG(st.st_mode);
+}
+
+/*
+ * A path is either a results.json, a jitterdebugger --output
+ * directory or a directory of those such as the one written by
+ * jittersamples --listen.
+ */
+static void files_expand(struct merge_files *f, const char *path)
+{
+	struct dirent **names;
+	struct stat st;
+	char *fn;
+	int i, n;
+
+	if (stat(path, &st) < 0) {
+		warn_handler("Could not access '%s': %s", path,
+			     strerror(errno));
+		return;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		files_add(f, jd_strdup(path));
+		return;
+	}
+
+	if (asprintf(&fn, "%s/results.json", path) < 0)
+		err_handler(errno, "asprintf()");
+	if (is_file(fn)) {
+		files_add(f, fn);
+		return;
+	}
+	free(fn);
+
+	n = scandir(path, &names, NULL, alphasort);
+	if (n < 0) {
+		warn_handler("Could not read '%s': %s", path, strerror(errno));
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		if (names[i]->d_name[0] != '.') {
+			if (asprintf(&fn, "%s/%s/results.json", path,
+				     names[i]->d_name) < 0)
+				err_handler(errno, "asprintf()");
+			if (is_file(fn))
+				files_add(f, fn);
+			else
+				free(fn);
+		}
+		free(names[i]);
+	}
+	free(names);
+}
+
+/* Host name of a run, the directory name if sysinfo has none */
+static char *run_host(struct merge_run *r, struct jd_json *root)
+{
+	const char *name;
+	char *tmp, *host;
+
+	name = jd_json_str(jd_json_get(jd_json_get(root, "sysinfo"),
+				       "nodename"));
+	if (name)
+		return jd_strdup(name);
+
+	tmp = jd_strdup(r->path);
+	host = jd_strdup(basename(dirname(tmp)));
+	free(tmp);
+
+	return host;
+}
+
+static int run_load_cpu(struct merge_run *r, struct merge_cpu *c,
+			struct jd_json *j)
+{
+	struct jd_json *hist, *b, *sd;
+	uint64_t res = r->resolution_ns;
+	unsigned int i;
+	char *end;
+
+	c->cpu = jd_json_u64(jd_json_get(j, "affinity"),
+			     strtoul(j->key, NULL, 10));
+	c->count = jd_json_u64(jd_json_get(j, "count"), 0);
+	c->min = jd_json_u64(jd_json_get(j, "min"), 0) * res;
+	c->max = jd_json_u64(jd_json_get(j, "max"), 0) * res;
+	c->overflow = jd_json_u64(jd_json_get(j, "overflow"), 0);
+	c->total = jd_json_num(jd_json_get(j, "avg"), 0) * c->count * res;
+
+	sd = jd_json_get(j, "stddev");
+	if (sd && c->count > 1)
+		c->m2 = pow(jd_json_num(sd, 0) * res, 2) * (c->count - 1);
+	else
+		c->m2 = sd ? 0 : -1;
+
+	hist = jd_json_get(j, "histogram");
+	if (!hist || hist->type != JD_JSON_OBJECT)
+		return -EINVAL;
+
+	for (b = hist->child; b; b = b->next)
+		c->nr_buckets++;
+	c->buckets = calloc(c->nr_buckets, sizeof(*c->buckets));
+	if (!c->buckets)
+		return -ENOMEM;
+
+	for (b = hist->child, i = 0; b; b = b->next, i++) {
+		c->buckets[i].val = strtoull(b->key, &end, 10) * res;
+		if (*end || b->type != JD_JSON_NUMBER)
+			return -EINVAL;
+		c->buckets[i].count = b->u64;
+	}
+
+	return 0;
+}
+
+static void run_load(struct merge_run *r)
+{
+	struct jd_json *root, *sys, *cpus, *c;
+	unsigned int i;
+	int err;
+
+	root = jd_json_load(r->path);
+	if (!root) {
+		r->err = -errno;
+		return;
+	}
+
+	/* Files written before -N existed are in us */
+	sys = jd_json_get(root, "sysinfo");
+	r->resolution_ns = jd_json_u64(jd_json_get(sys, "resolution_in_ns"),
+				       1000);
+	r->digits = jd_json_u64(jd_json_get(sys, "histogram_digits"), 2);
+	if (!r->resolution_ns || r->resolution_ns > 1000 ||
+	    r->digits < HISTOGRAM_MIN_DIGITS ||
+	    r->digits > HISTOGRAM_MAX_DIGITS) {
+		r->err = -EINVAL;
+		goto out;
+	}
+
+	cpus = jd_json_get(root, "cpu");
+	if (!cpus || cpus->type != JD_JSON_OBJECT) {
+		r->err = -EINVAL;
+		goto out;
+	}
+
+	for (c = cpus->child; c; c = c->next)
+		r->nr_cpus++;
+	r->cpus = calloc(r->nr_cpus, sizeof(*r->cpus));
+	if (!r->cpus) {
+		r->err = -ENOMEM;
+		goto out;
+	}
+
+	for (c = cpus->child, i = 0; c; c = c->next, i++) {
+		err = run_load_cpu(r, &r->cpus[i], c);
+		if (err) {
+			r->err = err;
+			goto out;
+		}
+	}
+
+	r->host = run_host(r, root);
+out:
+	jd_json_free(root);
+}
+
+static void run_free(struct merge_run *r)
+{
+	unsigned int i;
+
+	for (i = 0; i < r->nr_cpus; i++)
+		free(r->cpus[i].buckets);
+	free(r->cpus);
+	free(r->host);
+	free(r->path);
+}
+
+static void *merge_worker(void *arg)
+{
+	struct merge_jobs *j = arg;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->n)
+		run_load(&j->runs[i]);
+
+	return NULL;
+}
+
+static void runs_load(struct merge_run *runs, unsigned int n,
+		      unsigned int jobs)
+{
+	struct merge_jobs j = {
+		.runs = runs,
+		.n = n,
+	};
+	pthread_t *pids;
+	unsigned int i;
+	int err;
+
+	if (jobs > n)
+		jobs = n;
+	if (jobs <= 1) {
+		merge_worker(&j);
+		return;
+	}
+
+	pids = calloc(jobs, sizeof(*pids));
+	if (!pids)
+		err_handler(ENOMEM, "calloc()");
+
+	for (i = 0; i < jobs; i++) {
+		err = pthread_create(&pids[i], NULL, merge_worker, &j);
+		if (err)
+			err_handler(err, "pthread_create()");
+	}
+	for (i = 0; i < jobs; i++) {
+		err = pthread_join(pids[i], NULL);
+		if (err)
+			err_handler(err, "pthread_join()");
+	}
+	free(pids);
+}
+
+/* The failed runs go to the end */
+static int run_cmp(const void *a, const void *b)
+{
+	const struct merge_run *ra = a, *rb = b;
+
+	if (ra->err || rb->err)
+		return !!ra->err - !!rb->err;
+
+	return strcmp(ra->host, rb->host);
+}
+
+static struct histogram *stats_init(struct merge_stats *m,
+				    unsigned int digits, uint64_t max_value)
+{
+	memset(m, 0, sizeof(*m));
+	m->hist = histogram_create(digits, max_value);
+	if (!m->hist)
+		err_handler(ENOMEM, "histogram_create()");
+	m->m2_valid = 1;
+
+	return m->hist;
+}
+
+static void stats_reset(struct merge_stats *m)
+{
+	struct histogram *h = m->hist;
+
+	histogram_reset(h);
+	memset(m, 0, sizeof(*m));
+	m->hist = h;
+	m->m2_valid = 1;
+}
+
+/* Parallel Welford as in jitterdebugger's stats_total_add() */
+static void stats_add(struct merge_stats *m, struct merge_cpu *c,
+		      unsigned int res)
+{
+	struct histogram *h = m->hist;
+	unsigned int i, idx;
+	double delta;
+
+	for (i = 0; i < c->nr_buckets; i++) {
+		idx = histogram_index(h, c->buckets[i].val / res);
+		if (idx < h->size)
+			h->buckets[idx] += c->buckets[i].count;
+		else
+			h->overflow += c->buckets[i].count;
+	}
+	h->overflow += c->overflow;
+
+	if (!c->count)
+		return;
+
+	if (c->m2 < 0)
+		m->m2_valid = 0;
+	if (!m->count) {
+		m->m2 = c->m2;
+		m->min = c->min;
+	} else {
+		delta = c->total / c->count - m->total / m->count;
+		m->m2 += c->m2 + delta * delta * m->count * c->count /
+			(m->count + c->count);
+		if (c->min < m->min)
+			m->min = c->min;
+	}
+	if (c->max > m->max)
+		m->max = c->max;
+	m->count += c->count;
+	m->total += c->total;
+}
+
+static void stats_rank(struct merge_stats *m, struct merge_rank *r,
+		       unsigned int res, struct jd_merge_params *p)
+{
+	r->runs = m->runs;
+	r->count = m->count;
+	r->min = m->min / res;
+	r->max = m->max / res;
+	r->overflow = m->hist->overflow;
+	r->avg = m->count ? m->total / m->count / res : 0;
+	if (!m->m2_valid)
+		r->stddev = -1;
+	else
+		r->stddev = m->count > 1 ?
+			sqrt(m->m2 / (m->count - 1)) / res : 0;
+	histogram_percentiles(m->hist, p->percentiles, r->pval,
+			      p->num_percentiles);
+	r->key = r->pval[p->num_percentiles - 1];
+}
+
+/* Worst first: the highest percentile, then max */
+static int rank_cmp(const void *a, const void *b)
+{
+	const struct merge_rank *ra = *(const struct merge_rank **)a;
+	const struct merge_rank *rb = *(const struct merge_rank **)b;
+	if (ra->key != rb->key)
+		return ra->key < rb->key ? 1 : -1;
+	if (ra->max != rb->max)
+		return ra->max < rb->max ? 1 : -1;
+	return 0;
+}
+
+static void dump_summary(FILE *f, struct merge_rank *r,
+			 struct jd_merge_params *p, const char *indent)
+{
+	unsigned int i;
+
+	fprintf(f, "%s\"percentiles\": {", indent);
+	for (i = 0; i < p->num_percentiles; i++)
+		fprintf(f, "%s\n%s  \"%g\": %" PRIu64, i ? "," : "", indent,
+			p->percentiles[i], r->pval[i]);
+	fprintf(f, "\n%s},\n", indent);
+	fprintf(f, "%s\"overflow\": %" PRIu64 ",\n", indent, r->overflow);
+	if (r->stddev >= 0)
+		fprintf(f, "%s\"stddev\": %.2f,\n", indent, r->stddev);
+	fprintf(f, "%s\"count\": %" PRIu64 ",\n", indent, r->count);
+	fprintf(f, "%s\"min\": %" PRIu64 ",\n", indent, r->min);
+	fprintf(f, "%s\"max\": %" PRIu64 ",\n", indent, r->max);
+	fprintf(f, "%s\"avg\": %.2f\n", indent, r->avg);
+}
+
+static void dump_histogram(FILE *f, struct histogram *h)
+{
+	unsigned int i, n = 0;
+
+	fprintf(f, "      \"histogram\": {");
+	for (i = 0; i < h->size; i++) {
+		if (!h->buckets[i])
+			continue;
+		fprintf(f, "%s\n        \"%" PRIu64 "\": %" PRIu64,
+			n++ ? "," : "", histogram_bucket_low(h, i),
+			h->buckets[i]);
+	}
+	fprintf(f, "\n      },\n");
+}
+
+struct merge_result {
+	unsigned int resolution_ns;
+	unsigned int digits;
+	unsigned int files;
+	unsigned int failed;
+	struct merge_rank *hosts;
+	unsigned int nr_hosts;
+	struct merge_rank *cpus;	/* per host and CPU */
+	unsigned int nr_cpus;
+	struct merge_stats *cpu;	/* per CPU over all hosts */
+	struct merge_rank *cpu_rank;
+	unsigned int max_cpu;
+	struct merge_stats all;
+	struct merge_rank all_rank;
+};
+
+static int merge_dump(struct merge_result *m, struct jd_merge_params *p)
+{
+	struct merge_rank *r;
+	unsigned int i, j, n;
+	char *tmp;
+	FILE *f;
+
+	if (asprintf(&tmp, "%s.tmp", p->output) < 0)
+		err_handler(errno, "asprintf()");
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		warn_handler("Could not create '%s': %s", tmp,
+			     strerror(errno));
+		free(tmp);
+		return -errno;
+	}
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"version\": 4,\n");
+	fprintf(f, "  \"sysinfo\": {\n");
+	fprintf(f, "    \"resolution_in_ns\": %u,\n", m->resolution_ns);
+	fprintf(f, "    \"histogram_digits\": %u\n", m->digits);
+	fprintf(f, "  },\n");
+	fprintf(f, "  \"merge\": {\n");
+	fprintf(f, "    \"files\": %u,\n", m->files);
+	fprintf(f, "    \"failed\": %u,\n", m->failed);
+	fprintf(f, "    \"hosts\": %u\n", m->nr_hosts);
+	fprintf(f, "  },\n");
+
+	fprintf(f, "  \"cpu\": {\n");
+	for (i = 0, n = 0; i <= m->max_cpu; i++) {
+		if (!m->cpu[i].runs)
+			continue;
+		fprintf(f, "%s    \"%u\": {\n", n++ ? ",\n" : "", i);
+		dump_histogram(f, m->cpu[i].hist);
+		fprintf(f, "      \"affinity\": %u,\n", i);
+		fprintf(f, "      \"threads\": %u,\n", m->cpu[i].runs);
+		dump_summary(f, &m->cpu_rank[i], p, "      ");
+		fprintf(f, "    }");
+	}
+	fprintf(f, "\n  },\n");
+
+	fprintf(f, "  \"hosts\": {\n");
+	for (i = 0; i < m->nr_hosts; i++) {
+		r = &m->hosts[i];
+		fprintf(f, "    ");
+		jd_json_fputs(f, r->host);
+		fprintf(f, ": {\n");
+		fprintf(f, "      \"runs\": %u,\n", r->runs);
+		fprintf(f, "      \"cpu\": {\n");
+		for (j = 0; j < r->nr_cpus; j++) {
+			fprintf(f, "        \"%d\": {\n",
+				m->cpus[r->first_cpu + j].cpu);
+			dump_summary(f, &m->cpus[r->first_cpu + j], p,
+				     "          ");
+			fprintf(f, "        }%s\n",
+				j == r->nr_cpus - 1 ? "" : ",");
+		}
+		fprintf(f, "      },\n");
+		dump_summary(f, r, p, "      ");
+		fprintf(f, "    }%s\n", i == m->nr_hosts - 1 ? "" : ",");
+	}
+	fprintf(f, "  },\n");
+
+	fprintf(f, "  \"all\": {\n");
+	dump_summary(f, &m->all_rank, p, "    ");
+	fprintf(f, "  }\n");
+	fprintf(f, "}\n");
+
+	if (fclose(f) || rename(tmp, p->output) < 0) {
+		warn_handler("Could not write '%s': %s", p->output,
+			     strerror(errno));
+		free(tmp);
+		return -EIO;
+	}
+	free(tmp);
+
+	return 0;
+}
+
+static void print_row(const char *name, int cpu, struct merge_rank *r,
+		      struct jd_merge_params *p)
+{
+	unsigned int i;
+
+	printf("  %-*.*s ", HOST_WIDTH, HOST_WIDTH, name);
+	if (cpu >= 0)
+		printf("%4d", cpu);
+	else
+		printf("%4s", "");
+	printf(" %12" PRIu64 " %8" PRIu64 " %10.2f", r->count, r->min, r->avg);
+	for (i = 0; i < p->num_percentiles; i++)
+		printf(" %8" PRIu64, r->pval[i]);
+	printf(" %8" PRIu64 "\n", r->max);
+}
+
+static void print_header(struct jd_merge_params *p)
+{
+	char buf[32];
+	unsigned int i;
+
+	printf("  %-*s %4s %12s %8s %10s", HOST_WIDTH, "HOST", "CPU",
+	       "COUNT", "MIN", "AVG");
+	for (i = 0; i < p->num_percentiles; i++) {
+		snprintf(buf, sizeof(buf), "P%g", p->percentiles[i]);
+		printf(" %8s", buf);
+	}
+	printf(" %8s\n", "MAX");
+}
+
+static void print_ranking(const char *title, struct merge_rank *rows,
+			  unsigned int n, struct jd_merge_params *p)
+{
+	struct merge_rank **order;
+	unsigned int i;
+
+	if (!n || !p->top)
+		return;
+
+	order = calloc(n, sizeof(*order));
+	if (!order)
+		err_handler(ENOMEM, "calloc()");
+	for (i = 0; i < n; i++)
+		order[i] = &rows[i];
+	qsort(order, n, sizeof(*order), rank_cmp);
+
+	printf("\n%s by P%g:\n", title,
+	       p->percentiles[p->num_percentiles - 1]);
+	print_header(p);
+	for (i = 0; i < n && i < p->top; i++)
+		print_row(order[i]->host, order[i]->cpu, order[i], p);
+
+	free(order);
+}
+
+static void merge_print(struct merge_result *m, struct jd_merge_params *p)
+{
+	unsigned int i;
+
+	printf("Merged %u files (%u failed) of %u hosts, latencies in %s\n",
+	       m->files, m->failed, m->nr_hosts,
+	       m->resolution_ns == 1 ? "ns" : "us");
+	printf("\n");
+	print_header(p);
+	for (i = 0; i <= m->max_cpu; i++) {
+		if (m->cpu[i].runs)
+			print_row("all", i, &m->cpu_rank[i], p);
+	}
+	print_row("all", -1, &m->all_rank, p);
+
+	print_ranking("Worst hosts", m->hosts, m->nr_hosts, p);
+	print_ranking("Worst CPUs", m->cpus, m->nr_cpus, p);
+}
+
+static uint64_t *rank_alloc(struct merge_rank *r, unsigned int n,
+			    struct jd_merge_params *p)
+{
+	uint64_t *pval;
+	unsigned int i;
+
+	pval = calloc((size_t)n * p->num_percentiles, sizeof(*pval));
+	if (!pval && n)
+		err_handler(ENOMEM, "calloc()");
+	for (i = 0; i < n; i++) {
+		r[i].pval = pval + (size_t)i * p->num_percentiles;
+		r[i].cpu = -1;
+	}
+
+	return pval;
+}
+
+int jd_merge(char **paths, unsigned int n, struct jd_merge_params *p)
+{
+	struct merge_files files = { 0 };
+	struct merge_result m = { 0 };
+	struct merge_stats host, *host_cpu;
+	struct merge_run *runs;
+	struct merge_rank *r;
+	uint64_t max_value, *pval[3];
+	unsigned int i, j, k, ok;
+	int err = 0;
+
+	for (i = 0; i < n; i++)
+		files_expand(&files, paths[i]);
+	if (!files.n) {
+		fprintf(stderr, "No results.json found\n");
+		return -ENOENT;
+	}
+
+	runs = calloc(files.n, sizeof(*runs));
+	if (!runs)
+		err_handler(ENOMEM, "calloc()");
+	for (i = 0; i < files.n; i++)
+		runs[i].path = files.paths[i];
+	free(files.paths);
+
+	runs_load(runs, files.n, p->jobs);
+
+	m.resolution_ns = 1;
+	m.digits = HISTOGRAM_MAX_DIGITS;
+	for (i = 0; i < files.n; i++) {
+		if (runs[i].err) {
+			warn_handler("Could not read '%s': %s", runs[i].path,
+				     strerror(-runs[i].err));
+			m.failed++;
+			continue;
+		}
+		if (runs[i].resolution_ns > m.resolution_ns)
+			m.resolution_ns = runs[i].resolution_ns;
+		if (runs[i].digits < m.digits)
+			m.digits = runs[i].digits;
+		for (j = 0; j < runs[i].nr_cpus; j++) {
+			if (runs[i].cpus[j].cpu > m.max_cpu)
+				m.max_cpu = runs[i].cpus[j].cpu;
+			m.nr_cpus++;
+		}
+	}
+	ok = m.files = files.n - m.failed;
+	if (!ok) {
+		fprintf(stderr, "No results.json could be read\n");
+		err = -EINVAL;
+		goto out;
+	}
+
+	qsort(runs, files.n, sizeof(*runs), run_cmp);
+	for (i = 0; i < ok; i++) {
+		if (!i || strcmp(runs[i].host, runs[i - 1].host))
+			m.nr_hosts++;
+	}
+
+	/* Same upper limit as jitterdebugger: one second */
+	max_value = NSEC_PER_SEC / m.resolution_ns;
+	stats_init(&m.all, m.digits, max_value);
+	stats_init(&host, m.digits, max_value);
+	m.cpu = calloc(m.max_cpu + 1, sizeof(*m.cpu));
+	host_cpu = calloc(m.max_cpu + 1, sizeof(*host_cpu));
+	m.cpu_rank = calloc(m.max_cpu + 1, sizeof(*m.cpu_rank));
+	m.hosts = calloc(m.nr_hosts, sizeof(*m.hosts));
+	m.cpus = calloc(m.nr_cpus, sizeof(*m.cpus));
+	if (!m.cpu || !host_cpu || !m.cpu_rank || !m.hosts || !m.cpus)
+		err_handler(ENOMEM, "calloc()");
+	for (i = 0; i <= m.max_cpu; i++) {
+		stats_init(&m.cpu[i], m.digits, max_value);
+		stats_init(&host_cpu[i], m.digits, max_value);
+	}
+	pval[0] = rank_alloc(m.hosts, m.nr_hosts, p);
+	pval[1] = rank_alloc(m.cpus, m.nr_cpus, p);
+	pval[2] = rank_alloc(m.cpu_rank, m.max_cpu + 1, p);
+	rank_alloc(&m.all_rank, 1, p);
+
+	m.nr_hosts = 0;
+	m.nr_cpus = 0;
+	for (i = 0; i < ok; i = j) {
+		stats_reset(&host);
+		for (k = 0; k <= m.max_cpu; k++)
+			stats_reset(&host_cpu[k]);
+
+		for (j = i; j < ok && !strcmp(runs[j].host, runs[i].host);
+		     j++) {
+			for (k = 0; k < runs[j].nr_cpus; k++) {
+				struct merge_cpu *c = &runs[j].cpus[k];
+
+				stats_add(&host, c, m.resolution_ns);
+				stats_add(&host_cpu[c->cpu], c,
+					  m.resolution_ns);
+				stats_add(&m.cpu[c->cpu], c, m.resolution_ns);
+				stats_add(&m.all, c, m.resolution_ns);
+				host_cpu[c->cpu].runs++;
+				m.cpu[c->cpu].runs++;
+			}
+			host.runs++;
+			m.all.runs++;
+		}
+
+		r = &m.hosts[m.nr_hosts++];
+		r->host = runs[i].host;
+		r->first_cpu = m.nr_cpus;
+		stats_rank(&host, r, m.resolution_ns, p);
+		for (k = 0; k <= m.max_cpu; k++) {
+			if (!host_cpu[k].runs)
+				continue;
+			m.cpus[m.nr_cpus].host = runs[i].host;
+			m.cpus[m.nr_cpus].cpu = k;
+			stats_rank(&host_cpu[k], &m.cpus[m.nr_cpus],
+				   m.resolution_ns, p);
+			m.nr_cpus++;
+		}
+		r->nr_cpus = m.nr_cpus - r->first_cpu;
+	}
+	for (i = 0; i <= m.max_cpu; i++) {
+		if (m.cpu[i].runs)
+			stats_rank(&m.cpu[i], &m.cpu_rank[i],
+				   m.resolution_ns, p);
+	}
+	stats_rank(&m.all, &m.all_rank, m.resolution_ns, p);
+
+	if (p->output)
+		err = merge_dump(&m, p);
+	merge_print(&m, p);
+
+	for (i = 0; i <= m.max_cpu; i++) {
+		histogram_free(m.cpu[i].hist);
+		histogram_free(host_cpu[i].hist);
+	}
+	histogram_free(host.hist);
+	histogram_free(m.all.hist);
+	free(m.all_rank.pval);
+	for (i = 0; i < 3; i++)
+		free(pval[i]);
+	free(m.cpu);
+	free(host_cpu);
+	free(m.cpu_rank);
+	free(m.hosts);
+	free(m.cpus);
+out:
+	for (i = 0; i < files.n; i++)
+		run_free(&runs[i]);
+	free(runs);
+
+	return err;
+}
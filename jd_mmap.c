@@ -0,0 +1,227 @@
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "jitterdebugger.h"
+
+/*
+ * Per thread sample file which the worker writes through a shared
+ * mapping. The worker only ever stores into the current window. When
+ * it is full the worker swaps in the next window, which the mapper
+ * thread has already mapped and faulted in, and hands the old one
+ * back. The mapper thread (sample_file_service()) starts the write
+ * back of a retired window and maps it again at the same address
+ * behind the end of the file, where it becomes the next window.
+ *
+ * Only these two windows exist for the whole run. Any change to the
+ * mapping flushes the TLBs of all CPUs running threads of the process,
+ * which are the measured ones. Remapping in place costs one such
+ * flush per window instead of one for munmap() and one for mmap(),
+ * and the windows are large so it happens rarely. The number of
+ * remaps and the time spent in them is kept for results.json.
+ *
+ * The file starts with a struct jd_samples_header like samples.raw.
+ * Its room is rounded up to the page size, so the windows stay page
+ * aligned. The header is written once all workers are set up, see
+ * sample_file_write_header().
+ */
+
+static size_t window_bytes(struct sample_file *f)
+{
+	return (size_t)f->cap * sizeof(struct mmap_sample);
+}
+
+/* Maps the window behind the end of the file, at addr if not NULL */
+static struct mmap_sample *window_map(struct sample_file *f,
+				      struct mmap_sample *addr)
+{
+	struct mmap_sample *p;
+	size_t len = window_bytes(f);
+
+	if (ftruncate(f->fd, f->next_off + len) < 0)
+		err_handler(errno, "ftruncate()");
+
+	p = mmap(addr, len, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | (addr ? MAP_FIXED : 0), f->fd, f->next_off);
+	if (p == MAP_FAILED)
+		err_handler(errno, "mmap()");
+
+	/* No page faults in the worker, mlockall() keeps them */
+	jd_prefault(p, len);
+	f->next_off += len;
+
+	return p;
+}
+
+/*
+ * Moves a retired window behind the end of the file. It was mapped two
+ * windows before the end, the current one sits in between.
+ */
+static void window_remap(struct sample_file *f, struct mmap_sample *p)
+{
+	size_t len = window_bytes(f);
+	uint64_t start = clock_monotonic_ns();
+
+	sync_file_range(f->fd, f->next_off - 2 * len, len,
+			SYNC_FILE_RANGE_WRITE);
+	window_map(f, p);
+
+	f->remaps++;
+	f->remap_ns += clock_monotonic_ns() - start;
+}
+
+static void window_unmap(struct sample_file *f, struct mmap_sample *p)
+{
+	msync(p, window_bytes(f), MS_ASYNC);
+	munmap(p, window_bytes(f));
+}
+
+struct sample_file *sample_file_open(const char *path, unsigned int id,
+				     unsigned int nr_threads,
+				     unsigned int window, uint32_t *doorbell)
+{
+	struct sample_file *f;
+	long page;
+	char *fn;
+
+	f = aligned_alloc(JD_CACHELINE_SIZE, sizeof(*f));
+	if (!f)
+		return NULL;
+	memset(f, 0, sizeof(*f));
+
+	if (asprintf(&fn, "%s/samples.%u.raw", path, id) < 0)
+		err_handler(errno, "asprintf()");
+	f->fd = open(fn, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	free(fn);
+	if (f->fd < 0) {
+		free(f);
+		return NULL;
+	}
+
+	page = sysconf(_SC_PAGESIZE);
+	if (page <= 0)
+		page = JD_SAMPLES_ALIGN;
+	f->data_off = jd_samples_header_size(nr_threads);
+	f->data_off = (f->data_off + page - 1) / page * page;
+	f->next_off = f->data_off;
+
+	f->cap = window;
+	f->doorbell = doorbell;
+	f->cur = window_map(f, NULL);
+	f->next = window_map(f, NULL);
+
+	return f;
+}
+
+/*
+ * hdr is the header of samples.raw. header_size and record_size are
+ * adjusted to this file.
+ */
+void sample_file_write_header(struct sample_file *f,
+			      const struct jd_samples_header *hdr)
+{
+	struct jd_samples_header *h;
+	size_t len = jd_samples_header_size(hdr->nr_threads);
+
+	h = calloc(1, len);
+	if (!h)
+		err_handler(ENOMEM, "calloc()");
+	memcpy(h, hdr, sizeof(*h) +
+	       hdr->nr_threads * sizeof(struct jd_samples_thread));
+	h->header_size = f->data_off;
+	h->record_size = sizeof(struct mmap_sample);
+
+	if (pwrite(f->fd, h, len, 0) != (ssize_t)len)
+		err_handler(errno, "pwrite()");
+	free(h);
+}
+
+static int sample_file_drop(struct sample_file *f)
+{
+	__atomic_store_n(&f->dropped, f->dropped + 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+ * Called by the worker when the current window is full. There is only
+ * one retired slot. As long as the mapper thread hasn't remapped the
+ * previous window there is no next one and the samples are dropped.
+ */
+int sample_file_switch(struct sample_file *f)
+{
+	struct mmap_sample *next;
+
+	if (__atomic_load_n(&f->retired, __ATOMIC_ACQUIRE))
+		return sample_file_drop(f);
+
+	next = __atomic_exchange_n(&f->next, NULL, __ATOMIC_ACQUIRE);
+	if (!next)
+		return sample_file_drop(f);
+
+	__atomic_store_n(&f->retired, f->cur, __ATOMIC_RELEASE);
+	f->cur = next;
+	f->pos = 0;
+	__atomic_store_n(&f->windows, f->windows + 1, __ATOMIC_RELAXED);
+
+	jd_futex_wake(f->doorbell);
+
+	return 0;
+}
+
+/*
+ * Called by the mapper thread. The worker takes the next window before
+ * it retires the current one, so a retired window always finds the
+ * next slot empty.
+ */
+void sample_file_service(struct sample_file *f)
+{
+	struct mmap_sample *p;
+
+	p = __atomic_exchange_n(&f->retired, NULL, __ATOMIC_ACQUIRE);
+	if (!p)
+		return;
+
+	window_remap(f, p);
+	__atomic_store_n(&f->next, p, __ATOMIC_RELEASE);
+}
+
+/* Number of samples in the file */
+uint64_t sample_file_count(struct sample_file *f)
+{
+	return (uint64_t)__atomic_load_n(&f->windows, __ATOMIC_RELAXED) *
+		f->cap + READ_ONCE(f->pos);
+}
+
+uint64_t sample_file_dropped(struct sample_file *f)
+{
+	return __atomic_load_n(&f->dropped, __ATOMIC_RELAXED);
+}
+
+/* Only safe after the worker has stopped */
+void sample_file_close(struct sample_file *f)
+{
+	uint64_t count = sample_file_count(f);
+
+	if (f->retired)
+		window_unmap(f, f->retired);
+	if (f->next)
+		window_unmap(f, f->next);
+	window_unmap(f, f->cur);
+
+	if (ftruncate(f->fd, f->data_off +
+		      count * sizeof(struct mmap_sample)) < 0)
+		err_handler(errno, "ftruncate()");
+	close(f->fd);
+	f->fd = -1;
+}
+
+void sample_file_free(struct sample_file *f)
+{
+	free(f);
+}
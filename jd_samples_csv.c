@@ -5,7 +5,8 @@
 
 #include "jitterdebugger.h"
 
-static int output_csv(struct jd_samples_info *info, FILE *input)
+static int output_csv(struct jd_samples_info *info,
+		      struct jd_samples_reader *input)
 {
 	struct latency_sample sample;
 	FILE *output;
@@ -15,7 +16,7 @@ static int output_csv(struct jd_samples_info *info, FILE *input)
 		err_handler(errno, "Could not open '%s/samples.csv' for writing",
 			info->dir);
 
-	while(fread(&sample, sizeof(struct latency_sample), 1, input)) {
+	while(jd_samples_read(input, &sample, 1)) {
 		fprintf(output, "%d;%lld.%.9ld;%" PRIu64 "\n",
 			sample.cpuid,
 			(long long)sample.ts.tv_sec,
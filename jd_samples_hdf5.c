@@ -25,7 +25,8 @@ struct cpu_data {
 	struct latency_sample *data;
 };
 
-static int output_hdf5(struct jd_samples_info *info, FILE *input)
+static int output_hdf5(struct jd_samples_info *info,
+		       struct jd_samples_reader *input)
 {
 	struct cpu_data *cpudata;
 	struct latency_sample *data, *s, *d;
@@ -33,7 +34,6 @@ static int output_hdf5(struct jd_samples_info *info, FILE *input)
 	herr_t err;
 	uint64_t nrs, bs;
 	size_t nr;
-	off_t sz;
 	unsigned int i, cnt;
 	char *sid;
 	char *ofile;
@@ -41,13 +41,7 @@ static int output_hdf5(struct jd_samples_info *info, FILE *input)
 	if (asprintf(&ofile, "%s/samples.hdf5", info->dir) < 0)
 		err_handler(errno, "asprintf()");
 
-	if (fseeko(input, 0L, SEEK_END) < 0)
-		err_handler(errno, "fseek()");
-	sz = ftello(input);
-	if (fseeko(input, 0L, SEEK_SET) < 0)
-		err_handler(errno, "fseek()");
-
-	nrs = sz / sizeof(struct latency_sample);
+	nrs = jd_samples_count(input);
 	bs = min(nrs, BLOCK_SIZE);
 
 	data = malloc(sizeof(struct latency_sample) * bs);
@@ -97,13 +91,9 @@ static int output_hdf5(struct jd_samples_info *info, FILE *input)
 	}
 
 	for (;;) {
-		nr = fread(data, sizeof(struct latency_sample), bs, input);
-		if (nr != bs) {
-			if (feof(input))
-				break;
-			if (ferror(input))
-				err_handler(errno, "fread()");
-		}
+		nr = jd_samples_read(input, data, bs);
+		if (!nr)
+			break;
 
 		for (i = 0; i < nr; i++) {
 			s = &data[i];
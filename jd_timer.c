@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+
+#include "jitterdebugger.h"
+
+/* Not exported by all glibc versions */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/*
+ * Wakeup mechanisms for the measurement loop. All of them wait until
+ * an absolute CLOCK_MONOTONIC time. They only differ in the kernel
+ * path which brings the worker back to the CPU.
+ */
+struct timer_ops {
+	const char *name;
+	void (*init)(struct timer *t);
+	void (*wait)(struct timer *t, const struct timespec *next);
+	void (*cleanup)(struct timer *t);
+};
+
+static void nanosleep_wait(struct timer *t, const struct timespec *next)
+{
+	int err;
+
+	err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL);
+	if (err)
+		err_handler(err, "clock_nanosleep()");
+}
+
+static void timerfd_init(struct timer *t)
+{
+	struct epoll_event ev;
+
+	t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (t->fd < 0)
+		err_handler(errno, "timerfd_create()");
+
+	t->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (t->epfd < 0)
+		err_handler(errno, "epoll_create1()");
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->fd, &ev) < 0)
+		err_handler(errno, "epoll_ctl()");
+}
+
+static void timerfd_wait(struct timer *t, const struct timespec *next)
+{
+	struct itimerspec its;
+	struct epoll_event ev;
+	uint64_t expirations;
+	int n;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value = *next;
+	if (timerfd_settime(t->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		err_handler(errno, "timerfd_settime()");
+
+	do {
+		n = epoll_wait(t->epfd, &ev, 1, -1);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		err_handler(errno, "epoll_wait()");
+
+	if (read(t->fd, &expirations, sizeof(expirations)) < 0)
+		err_handler(errno, "read()");
+}
+
+static void timerfd_cleanup(struct timer *t)
+{
+	close(t->epfd);
+	close(t->fd);
+}
+
+static void signal_init(struct timer *t)
+{
+	struct sigevent sev;
+
+	/*
+	 * The signal is blocked in the worker (as are all others)
+	 * and picked up with sigwaitinfo().
+	 */
+	t->signo = SIGRTMIN;
+
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = t->signo;
+	sev.sigev_notify_thread_id = syscall(SYS_gettid);
+	if (timer_create(CLOCK_MONOTONIC, &sev, &t->id) < 0)
+		err_handler(errno, "timer_create()");
+}
+
+static void signal_wait(struct timer *t, const struct timespec *next)
+{
+	struct itimerspec its;
+	sigset_t set;
+	int sig;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value = *next;
+	if (timer_settime(t->id, TIMER_ABSTIME, &its, NULL) < 0)
+		err_handler(errno, "timer_settime()");
+
+	sigemptyset(&set);
+	sigaddset(&set, t->signo);
+	do {
+		sig = sigwaitinfo(&set, NULL);
+	} while (sig < 0 && errno == EINTR);
+	if (sig < 0)
+		err_handler(errno, "sigwaitinfo()");
+}
+
+static void signal_cleanup(struct timer *t)
+{
+	timer_delete(t->id);
+}
+
+static void busy_wait(struct timer *t, const struct timespec *next)
+{
+	struct timespec now;
+
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (now.tv_sec < next->tv_sec ||
+		 (now.tv_sec == next->tv_sec && now.tv_nsec < next->tv_nsec));
+}
+
+static const struct timer_ops timers[] = {
+	{
+		.name = "nanosleep",
+		.wait = nanosleep_wait,
+	},
+	{
+		.name = "timerfd",
+		.init = timerfd_init,
+		.wait = timerfd_wait,
+		.cleanup = timerfd_cleanup,
+	},
+	{
+		.name = "signal",
+		.init = signal_init,
+		.wait = signal_wait,
+		.cleanup = signal_cleanup,
+	},
+	{
+		.name = "busy",
+		.wait = busy_wait,
+	},
+	{ NULL, },
+};
+
+const struct timer_ops *timer_ops_find(const char *name)
+{
+	const struct timer_ops *ops;
+
+	for (ops = timers; ops->name; ops++) {
+		if (!strcmp(ops->name, name))
+			return ops;
+	}
+
+	return NULL;
+}
+
+const char *timer_ops_name(const struct timer_ops *ops)
+{
+	return ops->name;
+}
+
+/* Has to be called from the thread which is going to wait */
+void timer_init(struct timer *t, const struct timer_ops *ops)
+{
+	memset(t, 0, sizeof(*t));
+	t->ops = ops;
+	if (ops->init)
+		ops->init(t);
+}
+
+void timer_wait(struct timer *t, const struct timespec *next)
+{
+	t->ops->wait(t, next);
+}
+
+void timer_cleanup(struct timer *t)
+{
+	if (t->ops->cleanup)
+		t->ops->cleanup(t);
+}
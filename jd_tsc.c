@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jitterdebugger.h"
+
+#define NSEC_PER_SEC		1000000000ULL
+#define TSC_CONV_SHIFT		40
+#define TSC_CALIBRATION_US	(200 * 1000)
+
+uint64_t clock_monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * v * num / den, precomputed as multiplication and shift. The mult is
+ * (num << shift) / den, done as long division to stay within 64 bits.
+ * den must be below 2^63.
+ */
+void tsc_conv_init(struct tsc_conv *c, uint64_t num, uint64_t den)
+{
+	uint64_t q = num / den, r = num % den;
+	unsigned int i;
+
+	for (i = 0; i < TSC_CONV_SHIFT; i++) {
+		q <<= 1;
+		r <<= 1;
+		if (r >= den) {
+			r -= den;
+			q |= 1;
+		}
+	}
+
+	c->shift = TSC_CONV_SHIFT;
+	c->mult = q;
+}
+
+#if defined(__x86_64__)
+
+static int cpuinfo_has_flag(const char *flag)
+{
+	char *line = NULL, *p;
+	size_t n = 0, len;
+	int found = 0;
+	FILE *fd;
+
+	fd = fopen("/proc/cpuinfo", "r");
+	if (!fd)
+		return 0;
+
+	len = strlen(flag);
+	while (getline(&line, &n, fd) > 0) {
+		if (strncmp(line, "flags", 5))
+			continue;
+
+		for (p = strstr(line, flag); p; p = strstr(p + 1, flag)) {
+			if (p[-1] == ' ' && (p[len] == ' ' || p[len] == '\n')) {
+				found = 1;
+				break;
+			}
+		}
+		break;
+	}
+
+	free(line);
+	fclose(fd);
+	return found;
+}
+
+/*
+ * The TSC is only usable as time source when it ticks at a constant
+ * rate in all P- and C-states. Whether it is synchronized across
+ * CPUs is verified by the kernel at boot. If it finds them out of
+ * sync it marks the TSC unstable and switches to another
+ * clocksource.
+ */
+int tsc_check(void)
+{
+	const char *cs = "/sys/devices/system/clocksource/clocksource0/current_clocksource";
+	char *buf;
+	int ret;
+
+	if (!cpuinfo_has_flag("constant_tsc") ||
+	    !cpuinfo_has_flag("nonstop_tsc")) {
+		fprintf(stderr, "TSC is not invariant (constant_tsc, nonstop_tsc)\n");
+		return -ENOTSUP;
+	}
+
+	ret = sysfs_load_str(cs, &buf);
+	if (ret < 0) {
+		warn_handler("Could not read %s, TSC synchronization unknown",
+			     cs);
+		return 0;
+	}
+
+	if (strncmp(buf, "tsc", 3))
+		warn_handler("Kernel clocksource is not tsc, TSC might not "
+			     "be synchronized across CPUs");
+	free(buf);
+
+	return 0;
+}
+
+/* Read a TSC and CLOCK_MONOTONIC pair as close together as possible */
+static void tsc_sample(uint64_t *tsc, uint64_t *ns)
+{
+	uint64_t t1, t2, best = UINT64_MAX;
+	uint64_t now;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		t1 = tsc_read();
+		now = clock_monotonic_ns();
+		t2 = tsc_read();
+
+		if (t2 - t1 < best) {
+			best = t2 - t1;
+			*tsc = t1 + (t2 - t1) / 2;
+			*ns = now;
+		}
+	}
+}
+
+void tsc_calibrate(struct tsc_calibration *c)
+{
+	uint64_t tsc0, ns0, tsc1, ns1;
+
+	tsc_sample(&tsc0, &ns0);
+	usleep(TSC_CALIBRATION_US);
+	tsc_sample(&tsc1, &ns1);
+
+	/* Fits into 64 bits for TSC rates up to 90 GHz */
+	c->hz = (tsc1 - tsc0) * NSEC_PER_SEC / (ns1 - ns0);
+	c->tsc0 = tsc1;
+	c->ns0 = ns1;
+
+	tsc_conv_init(&c->to_ns, NSEC_PER_SEC, c->hz);
+	tsc_conv_init(&c->from_ns, c->hz, NSEC_PER_SEC);
+}
+
+/*
+ * Difference in ns between CLOCK_MONOTONIC and the time predicted by
+ * the calibration on the calling CPU.
+ */
+int64_t tsc_offset(struct tsc_calibration *c)
+{
+	uint64_t tsc, ns;
+
+	tsc_sample(&tsc, &ns);
+
+	return (int64_t)(tsc_to_mono(c, tsc) - ns);
+}
+
+#else
+
+int tsc_check(void)
+{
+	fprintf(stderr, "TSC is not supported on this architecture\n");
+	return -ENOTSUP;
+}
+
+void tsc_calibrate(struct tsc_calibration *c)
+{
+	memset(c, 0, sizeof(*c));
+}
+
+int64_t tsc_offset(struct tsc_calibration *c)
+{
+	return 0;
+}
+
+#endif
@@ -12,29 +12,65 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 
 #include "jitterdebugger.h"
 
 #define BUFSIZE		4096
 
-struct ringbuffer_sample {
-	struct timespec ts;
-	uint64_t val;
+/*
+ * Samples are stored in 8 byte slots. Usually the timestamp is stored
+ * as difference to the previous sample and the latency as 32 bit
+ * value. If either doesn't fit (or for the very first sample), the
+ * slot is marked as escape and the full values follow in the next two
+ * slots.
+ */
+#define RB_ESCAPE	UINT32_MAX
+
+union ringbuffer_sample {
+	struct {
+		uint32_t delta;		/* ns since the previous sample */
+		uint32_t val;
+	};
+	uint64_t raw;
 };
 
+/*
+ * Single producer (the worker), single consumer (the I/O thread) ring.
+ * Each side owns a cache line with its index and a cached copy of the
+ * other side's index. The shared index is only loaded again when the
+ * cached copy says the ring is full (producer) or empty (consumer).
+ * Slot i lives at data[i & (size - 1)].
+ */
 struct ringbuffer {
+	/* Set up once */
 	uint32_t size;
-	uint32_t overflow;
-	uint32_t read;
-	uint32_t write;
-	struct ringbuffer_sample *data;
+	uint32_t watermark;
+	uint32_t *doorbell;	/* reader waits on it, see jd_futex_wait() */
+	union ringbuffer_sample *data;
+
+	/* Producer */
+	struct {
+		uint32_t write;
+		uint32_t read_cache;
+		uint32_t overflow;
+		int write_valid;
+		uint64_t write_ts;	/* last written timestamp */
+	} __attribute__((aligned(JD_CACHELINE_SIZE))) p;
+
+	/* Consumer */
+	struct {
+		uint32_t read;
+		uint32_t write_cache;
+		uint64_t read_ts;	/* last read timestamp */
+	} __attribute__((aligned(JD_CACHELINE_SIZE))) c;
+
+	/* Doorbell rung since the last drain, written by both sides */
+	int rang __attribute__((aligned(JD_CACHELINE_SIZE)));
 };
 
-static int ringbuffer_full(uint32_t size, uint32_t read, uint32_t write)
-{
-	return write - read == size;
-}
-
 static int ringbuffer_empty(uint32_t read, uint32_t write)
 {
 	return write == read;
@@ -53,12 +89,20 @@ struct ringbuffer *ringbuffer_create(unsigned int size)
 	if ((size & (size - 1)) != 0)
 		return NULL;
 
-	rb = calloc(1, sizeof(*rb));
+	rb = aligned_alloc(JD_CACHELINE_SIZE, sizeof(*rb));
 	if (!rb)
 		return NULL;
+	memset(rb, 0, sizeof(*rb));
 
 	rb->size = size;
-	rb->data = calloc(rb->size, sizeof(struct ringbuffer_sample));
+	rb->data = calloc(rb->size, sizeof(union ringbuffer_sample));
+	if (!rb->data) {
+		free(rb);
+		return NULL;
+	}
+
+	/* Place the pages on the node of the calling thread */
+	jd_prefault(rb->data, rb->size * sizeof(union ringbuffer_sample));
 
 	return rb;
 }
@@ -69,38 +113,135 @@ void ringbuffer_free(struct ringbuffer *rb)
 	free(rb);
 }
 
-int ringbuffer_write(struct ringbuffer *rb, struct timespec ts, uint64_t val)
+/* Only safe while no reader is active */
+void ringbuffer_reset(struct ringbuffer *rb)
+{
+	memset(&rb->p, 0, sizeof(rb->p));
+	memset(&rb->c, 0, sizeof(rb->c));
+	rb->rang = 0;
+}
+
+/*
+ * The writer rings the doorbell once the ring is filled up to
+ * watermark slots. It doesn't ring again until the reader has drained
+ * the ring.
+ */
+void ringbuffer_set_doorbell(struct ringbuffer *rb, uint32_t *doorbell,
+			     unsigned int watermark)
+{
+	rb->doorbell = doorbell;
+	rb->watermark = watermark;
+}
+
+uint32_t ringbuffer_overflow(struct ringbuffer *rb)
 {
-	uint32_t read, idx;
+	return __atomic_load_n(&rb->p.overflow, __ATOMIC_RELAXED);
+}
+
+int ringbuffer_mem_node(struct ringbuffer *rb)
+{
+	return jd_mem_node(rb->data);
+}
+
+static inline uint32_t ringbuffer_free_slots(struct ringbuffer *rb)
+{
+	return rb->size - (rb->p.write - rb->p.read_cache);
+}
+
+int ringbuffer_write(struct ringbuffer *rb, uint64_t ts, uint64_t val)
+{
+	union ringbuffer_sample *d;
+	uint32_t write = rb->p.write, n;
+	uint64_t delta;
+
+	delta = ts - rb->p.write_ts;
+	if (rb->p.write_valid && ts >= rb->p.write_ts && delta < RB_ESCAPE &&
+	    val < UINT32_MAX)
+		n = 1;
+	else
+		n = 3;
+
+	if (ringbuffer_free_slots(rb) < n) {
+		rb->p.read_cache = smp_load_acquire(&rb->c.read);
+		if (ringbuffer_free_slots(rb) < n) {
+			__atomic_store_n(&rb->p.overflow, rb->p.overflow + 1,
+					 __ATOMIC_RELAXED);
+			return 1;
+		}
+	}
 
-	read = READ_ONCE(rb->read);
-	if (ringbuffer_full(rb->size, read, rb->write)) {
-		rb->overflow++;
-		return 1;
+	d = &rb->data[ringbuffer_mask(rb->size, write)];
+	if (n == 1) {
+		d->delta = delta;
+		d->val = val;
+	} else {
+		d->delta = RB_ESCAPE;
+		d->val = 0;
+		rb->data[ringbuffer_mask(rb->size, write + 1)].raw = ts;
+		rb->data[ringbuffer_mask(rb->size, write + 2)].raw = val;
 	}
 
-	idx = ringbuffer_mask(rb->size, rb->write + 1);
-	rb->data[idx].ts = ts;
-	rb->data[idx].val = val;
+	rb->p.write_ts = ts;
+	rb->p.write_valid = 1;
+
+	/* Publishes the slots to the consumer */
+	smp_store_release(&rb->p.write, write + n);
+
+	if (rb->doorbell &&
+	    rb->size - ringbuffer_free_slots(rb) >= rb->watermark) {
+		/* Only now it's worth looking at the consumer's line */
+		rb->p.read_cache = smp_load_acquire(&rb->c.read);
+		if (rb->size - ringbuffer_free_slots(rb) >= rb->watermark &&
+		    !__atomic_load_n(&rb->rang, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&rb->rang, 1, __ATOMIC_RELAXED);
+			jd_futex_wake(rb->doorbell);
+		}
+	}
 
-	WRITE_ONCE(rb->write, rb->write + 1);
 	return 0;
 }
 
-int ringbuffer_read(struct ringbuffer *rb, struct timespec *ts, uint64_t *val)
+/*
+ * Decodes up to max samples in one go. The read index is only
+ * published once for the whole batch. Returns the number of samples
+ * read.
+ */
+unsigned int ringbuffer_read_batch(struct ringbuffer *rb, uint64_t *ts,
+				   uint64_t *val, unsigned int max)
 {
-	uint32_t write, idx;
+	union ringbuffer_sample *d;
+	uint32_t read = rb->c.read;
+	uint64_t last = rb->c.read_ts;
+	unsigned int i;
+
+	/* The producer's line is only touched when the cache can't fill the batch */
+	if (rb->c.write_cache - read < max)
+		rb->c.write_cache = smp_load_acquire(&rb->p.write);
+
+	for (i = 0; i < max && !ringbuffer_empty(read, rb->c.write_cache); i++) {
+		d = &rb->data[ringbuffer_mask(rb->size, read)];
+		if (d->delta == RB_ESCAPE) {
+			ts[i] = rb->data[ringbuffer_mask(rb->size, read + 1)].raw;
+			val[i] = rb->data[ringbuffer_mask(rb->size, read + 2)].raw;
+			read += 3;
+		} else {
+			ts[i] = last + d->delta;
+			val[i] = d->val;
+			read++;
+		}
+		last = ts[i];
+	}
 
-	write = READ_ONCE(rb->write);
-	if (ringbuffer_empty(rb->read, write))
-		return 1;
+	rb->c.read_ts = last;
 
-	idx = ringbuffer_mask(rb->size, rb->read + 1);
-	*ts = rb->data[idx].ts;
-	*val = rb->data[idx].val;
+	/* Hands the slots back to the producer */
+	smp_store_release(&rb->c.read, read);
 
-	WRITE_ONCE(rb->read, rb->read + 1);
-	return 0;
+	/* Drained, arm the doorbell again */
+	if (ringbuffer_empty(read, rb->c.write_cache))
+		__atomic_store_n(&rb->rang, 0, __ATOMIC_RELAXED);
+
+	return i;
 }
 
 void _err_handler(int error, char *fmt, ...)
@@ -186,6 +327,32 @@ long int parse_time(const char *str)
 	return t;
 }
 
+/*
+ * Comma separated list of ascending percentiles in (0, 100]. Returns
+ * the number of percentiles, -EINVAL or -E2BIG for more than max.
+ */
+int parse_percentiles(char *str, double *p, unsigned int max)
+{
+	unsigned int n = 0;
+	char *tok, *end, *save;
+	double v;
+
+	for (tok = strtok_r(str, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		errno = 0;
+		v = strtod(tok, &end);
+		if (errno || end == tok || *end || !(v > 0 && v <= 100))
+			return -EINVAL;
+		if (n && v <= p[n - 1])
+			return -EINVAL;
+		if (n == max)
+			return -E2BIG;
+		p[n++] = v;
+	}
+
+	return n;
+}
+
 static void cpuset_from_bits(cpu_set_t *set, unsigned long bits)
 {
 	unsigned i;
@@ -332,6 +499,62 @@ out_fd:
 	return ret;
 }
 
+/* Touch every page so it gets allocated on the node of the caller */
+void jd_prefault(void *addr, size_t len)
+{
+	volatile char *p = addr;
+	size_t i, pagesize;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	for (i = 0; i < len; i += pagesize)
+		p[i] = p[i];
+	if (len)
+		p[len - 1] = p[len - 1];
+}
+
+/* Sets *addr and wakes up a waiter in jd_futex_wait() */
+void jd_futex_wake(uint32_t *addr)
+{
+	__atomic_store_n(addr, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Waits until *addr has been set by jd_futex_wake() or the relative
+ * timeout expired and clears it again. Returns 1 if woken up.
+ */
+int jd_futex_wait(uint32_t *addr, const struct timespec *timeout)
+{
+	if (!__atomic_load_n(addr, __ATOMIC_ACQUIRE))
+		syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, 0, timeout,
+			NULL, 0);
+
+	return __atomic_exchange_n(addr, 0, __ATOMIC_ACQUIRE);
+}
+
+/* Returns the NUMA node of the CPU the caller runs on or -1 */
+int jd_cpu_node(void)
+{
+	unsigned int cpu, node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+		return -1;
+
+	return node;
+}
+
+/* Returns the NUMA node backing addr or -1 if unknown */
+int jd_mem_node(void *addr)
+{
+	int node;
+
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+		    MPOL_F_NODE | MPOL_F_ADDR) < 0)
+		return -1;
+
+	return node;
+}
+
 char *jd_strdup(const char *src)
 {
 	char *dst;
@@ -0,0 +1,421 @@
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "jitterdebugger.h"
+
+#define NSEC_PER_SEC		1000000000ULL
+#define NSEC_PER_US		1000ULL
+
+/* Highest priority of the wakee, as for -p */
+#define WAKEUP_PRIO_MAX		98
+
+/*
+ * Measures how long it takes until a thread which is woken up by a
+ * thread on another CPU is running. The waker takes a timestamp right
+ * before it signals the wakee, the wakee takes the second one as
+ * soon as it returns from waiting. The difference includes the IPI
+ * (or the local reschedule when both are on the same CPU), the remote
+ * runqueue lock and the context switch.
+ *
+ * All (source, target) pairs are measured one after the other so
+ * they don't disturb each other.
+ */
+struct wakeup_pair {
+	const struct wakeup_ops *ops;
+	struct wakeup_params *p;
+	struct wakeup_cell *cell;
+	pthread_barrier_t barrier;
+
+	/* Shared between waker and wakee */
+	uint64_t t0 __attribute__((aligned(JD_CACHELINE_SIZE)));
+	int done;
+	int quit;
+	uint32_t futex;
+	int efd;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int flag;
+};
+
+struct wakeup_ops {
+	const char *name;
+	void (*init)(struct wakeup_pair *w);
+	void (*signal)(struct wakeup_pair *w);
+	void (*wait)(struct wakeup_pair *w);
+	void (*cleanup)(struct wakeup_pair *w);
+};
+
+static void futex_signal(struct wakeup_pair *w)
+{
+	__atomic_store_n(&w->futex, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &w->futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void futex_wait(struct wakeup_pair *w)
+{
+	while (!__atomic_load_n(&w->futex, __ATOMIC_ACQUIRE)) {
+		if (syscall(SYS_futex, &w->futex, FUTEX_WAIT_PRIVATE, 0,
+			    NULL, NULL, 0) < 0 &&
+		    errno != EAGAIN && errno != EINTR)
+			err_handler(errno, "futex()");
+	}
+	__atomic_store_n(&w->futex, 0, __ATOMIC_RELAXED);
+}
+
+static void eventfd_init(struct wakeup_pair *w)
+{
+	w->efd = eventfd(0, EFD_CLOEXEC);
+	if (w->efd < 0)
+		err_handler(errno, "eventfd()");
+}
+
+static void eventfd_signal(struct wakeup_pair *w)
+{
+	uint64_t one = 1;
+
+	if (write(w->efd, &one, sizeof(one)) < 0)
+		err_handler(errno, "write()");
+}
+
+static void eventfd_wait(struct wakeup_pair *w)
+{
+	uint64_t cnt;
+
+	while (read(w->efd, &cnt, sizeof(cnt)) < 0) {
+		if (errno != EINTR)
+			err_handler(errno, "read()");
+	}
+}
+
+static void eventfd_cleanup(struct wakeup_pair *w)
+{
+	close(w->efd);
+}
+
+static void condvar_init(struct wakeup_pair *w)
+{
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+}
+
+static void condvar_signal(struct wakeup_pair *w)
+{
+	pthread_mutex_lock(&w->mutex);
+	w->flag = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+static void condvar_wait(struct wakeup_pair *w)
+{
+	pthread_mutex_lock(&w->mutex);
+	while (!w->flag)
+		pthread_cond_wait(&w->cond, &w->mutex);
+	w->flag = 0;
+	pthread_mutex_unlock(&w->mutex);
+}
+
+static void condvar_cleanup(struct wakeup_pair *w)
+{
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->mutex);
+}
+
+static const struct wakeup_ops wakeups[] = {
+	{
+		.name = "futex",
+		.signal = futex_signal,
+		.wait = futex_wait,
+	},
+	{
+		.name = "eventfd",
+		.init = eventfd_init,
+		.signal = eventfd_signal,
+		.wait = eventfd_wait,
+		.cleanup = eventfd_cleanup,
+	},
+	{
+		.name = "condvar",
+		.init = condvar_init,
+		.signal = condvar_signal,
+		.wait = condvar_wait,
+		.cleanup = condvar_cleanup,
+	},
+	{ NULL, },
+};
+
+const struct wakeup_ops *wakeup_ops_find(const char *name)
+{
+	const struct wakeup_ops *ops;
+
+	for (ops = wakeups; ops->name; ops++) {
+		if (!strcmp(ops->name, name))
+			return ops;
+	}
+
+	return NULL;
+}
+
+const char *wakeup_ops_name(const struct wakeup_ops *ops)
+{
+	return ops->name;
+}
+
+static struct timespec ts_add_ns(struct timespec t, uint64_t ns)
+{
+	ns += t.tv_nsec;
+	t.tv_sec += ns / NSEC_PER_SEC;
+	t.tv_nsec = ns % NSEC_PER_SEC;
+
+	return t;
+}
+
+static void *waker(void *arg)
+{
+	struct wakeup_pair *w = arg;
+	uint64_t interval = w->p->interval_us * NSEC_PER_US;
+	struct timespec next;
+	unsigned int sent = 0;
+
+	pthread_barrier_wait(&w->barrier);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (sent < w->p->loops && !READ_ONCE(*w->p->stop)) {
+		next = ts_add_ns(next, interval);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		/* The wakee has not picked up the last one yet */
+		if (!smp_load_acquire(&w->done))
+			continue;
+
+		WRITE_ONCE(w->done, 0);
+		smp_store_release(&w->t0, clock_monotonic_ns());
+		w->ops->signal(w);
+		sent++;
+	}
+
+	while (!smp_load_acquire(&w->done)) {
+		next = ts_add_ns(next, interval);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	WRITE_ONCE(w->quit, 1);
+	w->ops->signal(w);
+
+	return NULL;
+}
+
+static void *wakee(void *arg)
+{
+	struct wakeup_pair *w = arg;
+	struct wakeup_cell *c = w->cell;
+	uint64_t t1, diff;
+
+	/* First touch from the target CPU */
+	c->hist = histogram_create(w->p->digits,
+				   10 * NSEC_PER_SEC / w->p->resolution);
+	if (!c->hist)
+		err_handler(ENOMEM, "histogram_create()");
+	c->min = UINT64_MAX;
+
+	pthread_barrier_wait(&w->barrier);
+
+	while (1) {
+		w->ops->wait(w);
+		t1 = clock_monotonic_ns();
+		if (READ_ONCE(w->quit))
+			break;
+
+		diff = (t1 - smp_load_acquire(&w->t0)) / w->p->resolution;
+		histogram_add(c->hist, diff);
+		c->count++;
+		c->total += diff;
+		if (diff < c->min)
+			c->min = diff;
+		if (diff > c->max)
+			c->max = diff;
+
+		smp_store_release(&w->done, 1);
+	}
+
+	return NULL;
+}
+
+static void thread_create(pthread_t *pid, unsigned int cpu, int prio,
+			  void *(*fn)(void *), void *arg)
+{
+	struct sched_param sched;
+	pthread_attr_t attr;
+	cpu_set_t mask;
+	int err;
+
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+
+	pthread_attr_init(&attr);
+
+	err = pthread_attr_setaffinity_np(&attr, sizeof(mask), &mask);
+	if (err)
+		err_handler(err, "pthread_attr_setaffinity_np()");
+
+	err = pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	if (err)
+		err_handler(err, "pthread_attr_setschedpolicy()");
+
+	sched.sched_priority = prio;
+	err = pthread_attr_setschedparam(&attr, &sched);
+	if (err)
+		err_handler(err, "pthread_attr_setschedparam()");
+
+	err = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	if (err)
+		err_handler(err, "pthread_attr_setinheritsched()");
+
+	err = pthread_create(pid, &attr, fn, arg);
+	if (err)
+		err_handler(err, "pthread_create()");
+
+	pthread_attr_destroy(&attr);
+}
+
+static void wakeup_pair_run(struct wakeup_pair *w, unsigned int src,
+			    unsigned int dst)
+{
+	pthread_t waker_pid, wakee_pid;
+	int err, prio;
+
+	w->done = 1;
+	if (w->ops->init)
+		w->ops->init(w);
+
+	err = pthread_barrier_init(&w->barrier, NULL, 2);
+	if (err)
+		err_handler(err, "pthread_barrier_init()");
+
+	/*
+	 * The wakee runs one priority level above the waker, otherwise
+	 * it wouldn't preempt the waker when both share a CPU. With -p 98
+	 * the waker moves one level down, 99 is left to the kernel.
+	 */
+	prio = w->p->priority;
+	if (prio >= WAKEUP_PRIO_MAX)
+		prio = WAKEUP_PRIO_MAX - 1;
+	thread_create(&wakee_pid, dst, prio + 1, wakee, w);
+	thread_create(&waker_pid, src, prio, waker, w);
+
+	err = pthread_join(waker_pid, NULL);
+	if (err)
+		err_handler(err, "pthread_join()");
+	err = pthread_join(wakee_pid, NULL);
+	if (err)
+		err_handler(err, "pthread_join()");
+
+	pthread_barrier_destroy(&w->barrier);
+	if (w->ops->cleanup)
+		w->ops->cleanup(w);
+}
+
+struct wakeup_matrix *wakeup_matrix_run(cpu_set_t *cpus,
+					const struct wakeup_ops *ops,
+					struct wakeup_params *p)
+{
+	struct wakeup_matrix *m;
+	struct wakeup_pair *w;
+	unsigned int cpu, i, src, dst;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		err_handler(ENOMEM, "calloc()");
+
+	m->ops = ops;
+	m->n = CPU_COUNT(cpus);
+	m->cpus = calloc(m->n, sizeof(*m->cpus));
+	m->cells = calloc(m->n * m->n, sizeof(*m->cells));
+	if (!m->cpus || !m->cells)
+		err_handler(ENOMEM, "calloc()");
+
+	for (cpu = 0, i = 0; i < m->n; cpu++) {
+		if (CPU_ISSET(cpu, cpus))
+			m->cpus[i++] = cpu;
+	}
+
+	w = aligned_alloc(JD_CACHELINE_SIZE, sizeof(*w));
+	if (!w)
+		err_handler(errno, "aligned_alloc()");
+
+	for (src = 0; src < m->n; src++) {
+		for (dst = 0; dst < m->n; dst++) {
+			if (READ_ONCE(*p->stop))
+				goto out;
+
+			memset(w, 0, sizeof(*w));
+			w->ops = ops;
+			w->p = p;
+			w->cell = wakeup_cell(m, src, dst);
+			wakeup_pair_run(w, m->cpus[src], m->cpus[dst]);
+		}
+	}
+
+out:
+	free(w);
+	return m;
+}
+
+void wakeup_matrix_free(struct wakeup_matrix *m)
+{
+	unsigned int i;
+
+	for (i = 0; i < m->n * m->n; i++) {
+		if (m->cells[i].hist)
+			histogram_free(m->cells[i].hist);
+	}
+	free(m->cells);
+	free(m->cpus);
+	free(m);
+}
+
+static int cpu_topology(unsigned int cpu, const char *name)
+{
+	char path[128], *buf;
+	int ret;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%u/topology/%s", cpu, name);
+	ret = sysfs_load_str(path, &buf);
+	if (ret < 0)
+		return -1;
+
+	ret = parse_dec(buf);
+	free(buf);
+
+	return ret;
+}
+
+/* How close two CPUs are in the topology */
+const char *wakeup_cpu_relation(unsigned int a, unsigned int b)
+{
+	int pkg_a, pkg_b;
+
+	if (a == b)
+		return "local";
+
+	pkg_a = cpu_topology(a, "physical_package_id");
+	pkg_b = cpu_topology(b, "physical_package_id");
+	if (pkg_a < 0 || pkg_b < 0)
+		return "unknown";
+	if (pkg_a != pkg_b)
+		return "remote-package";
+
+	if (cpu_topology(a, "core_id") == cpu_topology(b, "core_id"))
+		return "smt";
+
+	return "package";
+}
@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+
+#include "jitterdebugger.h"
+
+/*
+ * Per thread window statistics. The worker accumulates into one of two
+ * buffers. The window thread advances the epoch at the end of every
+ * window, the worker notices it with the next sample (window_tick()),
+ * hands the filled buffer over through ready and continues with the
+ * other one. The window thread reads the handed over buffer, resets it
+ * and gives it back with window_put(). Neither side ever waits for the
+ * other and the worker doesn't need any atomic read-modify-write.
+ */
+
+static void window_stats_reset(struct window_stats *ws)
+{
+	histogram_reset(ws->hist);
+	ws->count = 0;
+	ws->total = 0;
+	ws->min = UINT64_MAX;
+	ws->max = 0;
+	ws->nr_outliers = 0;
+	ws->outliers_dropped = 0;
+}
+
+/* Call from the worker, so the buffers are placed on its node */
+struct window *window_create(unsigned int digits, uint64_t max_value,
+			     uint32_t *clock)
+{
+	struct window *w;
+	unsigned int i;
+
+	w = aligned_alloc(JD_CACHELINE_SIZE, sizeof(*w));
+	if (!w)
+		return NULL;
+	memset(w, 0, sizeof(*w));
+
+	for (i = 0; i < 2; i++) {
+		w->buf[i].hist = histogram_create(digits, max_value);
+		if (!w->buf[i].hist) {
+			window_free(w);
+			return NULL;
+		}
+		window_stats_reset(&w->buf[i]);
+	}
+	w->clock = clock;
+	w->epoch = READ_ONCE(*clock);
+	w->ready = -1;
+
+	return w;
+}
+
+void window_free(struct window *w)
+{
+	unsigned int i;
+
+	for (i = 0; i < 2; i++) {
+		if (w->buf[i].hist)
+			histogram_free(w->buf[i].hist);
+	}
+	free(w);
+}
+
+/* Returns the buffer the worker has handed over, if any */
+struct window_stats *window_get(struct window *w)
+{
+	int ready = smp_load_acquire(&w->ready);
+
+	if (ready < 0)
+		return NULL;
+
+	return &w->buf[ready];
+}
+
+/* Only valid after the worker has stopped */
+struct window_stats *window_get_current(struct window *w)
+{
+	return &w->buf[w->cur];
+}
+
+/* Resets the buffer returned by window_get() and gives it back */
+void window_put(struct window *w, struct window_stats *ws)
+{
+	int ready = READ_ONCE(w->ready);
+
+	window_stats_reset(ws);
+	if (ready >= 0 && ws == &w->buf[ready])
+		smp_store_release(&w->ready, -1);
+}
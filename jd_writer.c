@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jitterdebugger.h"
+
+/*
+ * Collects the records in large blocks and writes each block with a
+ * single system call. With O_DIRECT the page cache is bypassed, so
+ * the blocks need to be aligned and a second buffer is filled while
+ * a helper thread writes out the first one. Without O_DIRECT the
+ * page cache already hides the latency of the disk and the blocks are
+ * written synchronously.
+ *
+ * A failed write doesn't abort the measurement. The file ends with
+ * the last block written and everything after it is discarded.
+ */
+#define BW_BLOCK_SIZE	(1024 * 1024)
+#define BW_ALIGN	4096
+
+struct block_writer {
+	int fd;
+	int direct;
+	char *buf[2];
+	unsigned int cur;
+	size_t len;		/* bytes used in buf[cur] */
+	off_t off;		/* file offset of the next block */
+	uint64_t bytes;		/* payload handed to the writer */
+	uint64_t ns;		/* time spent in write calls */
+	uint64_t start_ns;	/* open and close, for the throughput */
+	uint64_t end_ns;
+	int error;		/* errno of the first failed write */
+	uint64_t lost;		/* payload not written, see bw_write() */
+
+	/* O_DIRECT flusher */
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int pending;		/* buffer waiting to be written or -1 */
+	size_t pending_len;
+	int quit;
+};
+
+static void bw_write(struct block_writer *bw, const char *buf, size_t len)
+{
+	uint64_t start;
+	ssize_t ret;
+	size_t done = 0;
+
+	if (READ_ONCE(bw->error))
+		return;
+
+	start = clock_monotonic_ns();
+	while (done < len) {
+		ret = pwrite(bw->fd, buf + done, len - done, bw->off + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			warn_handler("pwrite() failed: %s, recording stopped",
+				     strerror(errno));
+			WRITE_ONCE(bw->error, errno);
+			return;
+		}
+		done += ret;
+	}
+	bw->ns += clock_monotonic_ns() - start;
+	bw->off += len;
+}
+
+static void *bw_flusher(void *arg)
+{
+	struct block_writer *bw = arg;
+	int idx;
+
+	pthread_mutex_lock(&bw->lock);
+	while (1) {
+		while (bw->pending < 0 && !bw->quit)
+			pthread_cond_wait(&bw->cond, &bw->lock);
+		if (bw->pending < 0)
+			break;
+
+		idx = bw->pending;
+		pthread_mutex_unlock(&bw->lock);
+
+		bw_write(bw, bw->buf[idx], bw->pending_len);
+
+		pthread_mutex_lock(&bw->lock);
+		bw->pending = -1;
+		pthread_cond_broadcast(&bw->cond);
+	}
+	pthread_mutex_unlock(&bw->lock);
+
+	return NULL;
+}
+
+/* Hands the current buffer to the flusher and switches to the other */
+static void bw_submit(struct block_writer *bw, size_t len)
+{
+	if (!bw->direct) {
+		bw_write(bw, bw->buf[bw->cur], len);
+		bw->len = 0;
+		return;
+	}
+
+	pthread_mutex_lock(&bw->lock);
+	while (bw->pending >= 0)
+		pthread_cond_wait(&bw->cond, &bw->lock);
+	bw->pending = bw->cur;
+	bw->pending_len = len;
+	pthread_cond_broadcast(&bw->cond);
+	pthread_mutex_unlock(&bw->lock);
+
+	bw->cur ^= 1;
+	bw->len = 0;
+}
+
+static void bw_wait_idle(struct block_writer *bw)
+{
+	pthread_mutex_lock(&bw->lock);
+	while (bw->pending >= 0)
+		pthread_cond_wait(&bw->cond, &bw->lock);
+	pthread_mutex_unlock(&bw->lock);
+}
+
+/*
+ * The O_DIRECT flusher is created with attr, so it runs where the
+ * thread feeding the writer runs and stays off the measured CPUs.
+ */
+struct block_writer *block_writer_open(const char *path, const char *filename,
+				       int direct, const pthread_attr_t *attr)
+{
+	struct block_writer *bw;
+	char *fn, *tmp;
+	int flags, i, err;
+
+	bw = calloc(1, sizeof(*bw));
+	if (!bw)
+		return NULL;
+
+	tmp = jd_strdup(filename);
+	if (asprintf(&fn, "%s/%s", path, basename(tmp)) < 0)
+		err_handler(errno, "asprintf()");
+
+	flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	if (direct)
+		flags |= O_DIRECT;
+	bw->fd = open(fn, flags, 0666);
+	if (bw->fd < 0 && direct && errno == EINVAL) {
+		warn_handler("O_DIRECT not supported for '%s'", fn);
+		direct = 0;
+		bw->fd = open(fn, flags & ~O_DIRECT, 0666);
+	}
+	free(tmp);
+	free(fn);
+	if (bw->fd < 0) {
+		free(bw);
+		return NULL;
+	}
+
+	bw->direct = direct;
+	bw->pending = -1;
+	bw->start_ns = clock_monotonic_ns();
+	for (i = 0; i < 2; i++) {
+		bw->buf[i] = aligned_alloc(BW_ALIGN, BW_BLOCK_SIZE);
+		if (!bw->buf[i])
+			err_handler(ENOMEM, "aligned_alloc()");
+		jd_prefault(bw->buf[i], BW_BLOCK_SIZE);
+	}
+
+	if (direct) {
+		pthread_mutex_init(&bw->lock, NULL);
+		pthread_cond_init(&bw->cond, NULL);
+		err = pthread_create(&bw->tid, attr, bw_flusher, bw);
+		if (err)
+			err_handler(err, "pthread_create()");
+	}
+
+	return bw;
+}
+
+void block_writer_add(struct block_writer *bw, const void *data, size_t len)
+{
+	const char *p = data;
+	size_t n;
+
+	bw->bytes += len;
+	if (READ_ONCE(bw->error))
+		return;
+
+	while (len) {
+		n = BW_BLOCK_SIZE - bw->len;
+		if (n > len)
+			n = len;
+		memcpy(bw->buf[bw->cur] + bw->len, p, n);
+		bw->len += n;
+		p += n;
+		len -= n;
+
+		if (bw->len == BW_BLOCK_SIZE)
+			bw_submit(bw, BW_BLOCK_SIZE);
+	}
+}
+
+/*
+ * Called at the end of a drain cycle. Without O_DIRECT the partial
+ * block is written out, with O_DIRECT only full blocks can be written.
+ */
+void block_writer_flush(struct block_writer *bw)
+{
+	if (!bw->direct && bw->len)
+		bw_submit(bw, bw->len);
+}
+
+void block_writer_close(struct block_writer *bw)
+{
+	uint64_t payload = bw->off;
+	size_t len;
+
+	if (bw->direct) {
+		bw_wait_idle(bw);
+		payload = bw->off + bw->len;
+
+		/* Pad the tail to the alignment and cut it off again */
+		if (bw->len) {
+			len = (bw->len + BW_ALIGN - 1) & ~(size_t)(BW_ALIGN - 1);
+			memset(bw->buf[bw->cur] + bw->len, 0, len - bw->len);
+			bw_submit(bw, len);
+			bw_wait_idle(bw);
+		}
+
+		pthread_mutex_lock(&bw->lock);
+		bw->quit = 1;
+		pthread_cond_broadcast(&bw->cond);
+		pthread_mutex_unlock(&bw->lock);
+		pthread_join(bw->tid, NULL);
+
+		/* Only what made it to the file before the error counts */
+		if (bw->error && (uint64_t)bw->off < payload)
+			payload = bw->off;
+		if (ftruncate(bw->fd, payload) < 0)
+			warn_handler("ftruncate() failed: %s", strerror(errno));
+
+		pthread_cond_destroy(&bw->cond);
+		pthread_mutex_destroy(&bw->lock);
+	} else {
+		block_writer_flush(bw);
+		payload = bw->off;
+	}
+
+	if (bw->error)
+		bw->lost = bw->bytes - payload;
+
+	close(bw->fd);
+	bw->fd = -1;
+	bw->end_ns = clock_monotonic_ns();
+}
+
+void block_writer_free(struct block_writer *bw)
+{
+	free(bw->buf[0]);
+	free(bw->buf[1]);
+	free(bw);
+}
+
+/* Payload written, only valid after block_writer_close() */
+uint64_t block_writer_bytes(struct block_writer *bw)
+{
+	return bw->bytes - bw->lost;
+}
+
+/* Time spent writing, only valid after block_writer_close() */
+uint64_t block_writer_ns(struct block_writer *bw)
+{
+	return bw->ns;
+}
+
+/* Time from open to close, only valid after block_writer_close() */
+uint64_t block_writer_wall_ns(struct block_writer *bw)
+{
+	return bw->end_ns - bw->start_ns;
+}
+
+/* errno of the write which stopped the writer or 0 */
+int block_writer_error(struct block_writer *bw)
+{
+	return READ_ONCE(bw->error);
+}
+
+/* Payload discarded after an error, only valid after block_writer_close() */
+uint64_t block_writer_lost(struct block_writer *bw)
+{
+	return bw->lost;
+}
+
+int block_writer_direct(struct block_writer *bw)
+{
+	return bw->direct;
+}
@@ -18,6 +18,7 @@
 #include <sys/syscall.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <linux/limits.h>
 #include <arpa/inet.h>
@@ -25,9 +26,33 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <poll.h>
+#include <math.h>
 
 #include "jitterdebugger.h"
 
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE		6
+#endif
+#ifndef SCHED_FLAG_DL_OVERRUN
+#define SCHED_FLAG_DL_OVERRUN	0x04
+#endif
+
+/*
+ * <linux/sched/types.h> clashes with glibc's struct sched_param and
+ * glibc has no sched_setattr() wrapper.
+ */
+struct sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+
 #define VT100_ERASE_EOL		"\033[K"
 #define VT100_CURSOR_UP		"\033[%uA"
 
@@ -37,27 +62,236 @@
 /* Default test interval in us */
 #define DEFAULT_INTERVAL        1000
 
+/*
+ * The I/O thread drains the ringbuffers at least every
+ * STORE_TIMEOUT_MS. The workers wake it up earlier when a ring is
+ * filled up to 1/RB_WATERMARK_DIV of its size.
+ */
+#define STORE_BATCH		256
+#define STORE_TIMEOUT_MS	100
+#define RB_WATERMARK_DIV	8
+
+/*
+ * Up to NET_BATCH packets are sent with one sendmmsg(). When the
+ * socket buffer is full the I/O thread waits up to NET_SEND_TIMEOUT_MS
+ * before it drops a packet.
+ */
+#define NET_BATCH		64
+#define NET_SEND_TIMEOUT_MS	100
+
+/* Upper limit of the --percentiles and --tail lists */
+#define MAX_PERCENTILES		16
+#define MAX_TAILS		16
+
+/* Default length of the --window windows in seconds */
+#define WINDOW_DEFAULT		10
+
+/* Samples per mapping window of the --mmap sample files (8 MB) */
+#define MMAP_WINDOW		(512 * 1024)
+
+/*
+ * The hwlat workers spin for HWLAT_WIDTH of every HWLAT_WINDOW (in
+ * ms), same as the kernel's hwlat tracer. The pause keeps them from
+ * running into the RT throttling.
+ */
+#define HWLAT_WINDOW		1000
+#define HWLAT_WIDTH		500
+
+/* Default gap threshold of the hwlat workers in ns */
+#define HWLAT_THRESHOLD		10000
+
+/* Iterations of the measurement overhead calibration */
+#define CALIBRATION_LOOPS	10000
+
+/*
+ * The TSC of each measured CPU is compared against CLOCK_MONOTONIC
+ * every TSC_CHECK_NS. An offset above TSC_DRIFT_WARN_NS is reported,
+ * above TSC_DRIFT_STOP_NS the measurement is stopped.
+ */
+#define TSC_CHECK_NS		NSEC_PER_SEC
+#define TSC_DRIFT_WARN_NS	1000
+#define TSC_DRIFT_STOP_NS	(100 * 1000)
+
+/* Default number of wakeups per CPU pair */
+#define WAKEUP_LOOPS		1000
+
+enum worker_mode {
+	MODE_TIMER,
+	MODE_HWLAT,
+	MODE_DEADLINE,
+};
+
+/*
+ * A set of workers sharing the same parameters. Without --group or
+ * --job there is one group built from -a, -i, -p, --policy and
+ * --timer, and a second one for the --hwlat CPUs.
+ */
+struct group {
+	char *name;
+	cpu_set_t cpus;
+	enum worker_mode mode;
+	int policy;
+	unsigned int interval_us;
+	unsigned int priority;
+	unsigned int dl_runtime_us;
+	unsigned int threads;		/* per CPU */
+	const struct timer_ops **timers;
+	unsigned int num_timers;
+	unsigned int first;		/* index of the first worker */
+	unsigned int count;		/* number of workers */
+};
+
+/* 128 bit sum of the squared latencies, see sum_sq_add() */
+struct sum_sq {
+	uint64_t lo;
+	uint64_t hi;
+};
+
+/*
+ * Consistent copy of the worker counters for readers outside of the
+ * measurement loop, protected by a sequence counter. Only the worker
+ * writes it, see snapshot_publish() and snapshot_read().
+ */
+struct stats_snapshot {
+	uint32_t seq;
+	uint64_t count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	struct sum_sq sq;
+};
+
+/* Combined counters of several threads, see stats_total_add() */
+struct stats_total {
+	uint64_t count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	struct sum_sq sq;
+};
+
+/*
+ * One entry per worker. The entries are padded to a cache line so no
+ * two workers ever write to the same line. The entry, the histogram
+ * and the ringbuffer are allocated by the worker itself after it has
+ * been pinned, thus they are placed on the node of the measured CPU.
+ *
+ * The first line holds the fields which are set up once. The counters
+ * updated on every sample and the snapshot get a line each, so the
+ * display thread never pulls the line the worker is working on.
+ */
 struct stats {
 	pthread_t pid;
 	pid_t tid;
 	unsigned int affinity;
-	uint64_t max;
+	struct group *group;
+	int node;
+	int hist_node;
+	int rb_node;
+	int64_t tsc_offset;
+	int64_t tsc_drift;		/* largest offset seen while running */
+	uint64_t tsc_check_next;	/* TSC value of the next drift check */
+	const struct timer_ops *timer;
+	struct histogram *overhead;	/* in ns, see calibrate_overhead() */
+	uint64_t overhead_min;
+	uint64_t overhead_max;
+	uint64_t overhead_total;
+	uint64_t overhead_floor;	/* overhead_min in interval_resolution */
+	uint64_t spin_time;		/* ns spent spinning in hwlat mode */
+	uint64_t dl_missed;		/* periods missed in deadline mode */
+	uint64_t dl_throttled;		/* runtime overruns in deadline mode */
+	struct histogram *hist;
+	struct ringbuffer *rb;
+	struct sample_file *sf;		/* --mmap */
+	struct window *win;		/* --stream-hist */
+	unsigned int id;
+
+	uint64_t max __attribute__((aligned(JD_CACHELINE_SIZE)));
 	uint64_t min;
 	uint64_t avg;
-	unsigned int hist_size;
-	uint64_t *hist;		/* each slot is one us */
 	uint64_t total;
 	uint64_t count;
-	struct ringbuffer *rb;
+	struct sum_sq sq;	/* for the standard deviation */
+
+	struct stats_snapshot snap __attribute__((aligned(JD_CACHELINE_SIZE)));
+} __attribute__((aligned(JD_CACHELINE_SIZE)));
+
+/* Handed to a new worker, see worker_setup() */
+struct worker_init {
+	struct stats **stats;	/* the worker's entry in main's array */
+	struct group *group;
+	const struct timer_ops *timer;
+	unsigned int affinity;
+	unsigned int id;
 };
 
 struct record_data {
-	struct stats *stats;
+	struct stats **stats;
 	char *server;
 	char *port;
-	FILE *fd;
+	struct block_writer *bw;
+	struct jdc_writer *jdc;	/* --compress */
+	FILE *idx;		/* samples.idx */
+	uint64_t idx_records;
+	struct jd_samples_index_entry idx_cur;
+	int done;		/* all workers have finished */
+	uint64_t *stored;	/* per thread */
+	uint64_t *write_dropped;	/* samples after a write error */
+
+	/* store_network() */
+	int sk;
+	struct sockaddr *sa;
+	socklen_t salen;
+	uint32_t sender;
+	struct jd_packet *open;		/* per thread, being filled */
+	struct jd_packet *queue;	/* full packets, see store_network_flush() */
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	unsigned int queued;
+	uint64_t *send_dropped;		/* samples, per thread */
+	uint64_t packets_sent;
+	uint64_t packets_dropped;
+	uint64_t send_stalls;		/* socket buffer full */
+};
+
+/* Last closed window of a thread, shown with -v */
+struct window_summary {
+	uint64_t count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	uint64_t p99;
+};
+
+/* State of the window thread, see window_thread() */
+struct window_data {
+	struct stats **stats;
+	uint64_t start_ns;	/* CLOCK_MONOTONIC of the first window */
+	int64_t realtime_offset;
+	uint64_t *win_start;	/* per thread */
+	uint64_t *win_seq;
+	uint64_t windows;	/* closed windows of all threads */
+	int done;
+
+	/* -v */
+	pthread_mutex_t lock;
+	struct window_summary *last;	/* per thread */
+
+	/* DIR/windows.jsonl */
+	FILE *log;
+
+	/* --stream-hist */
+	char *server;
+	char *port;
+	int sk;
+	uint32_t sender;
+	struct jd_hist_bucket *buckets;
+	unsigned int max_buckets;
+	uint64_t packets_sent;
+	uint64_t send_errors;
 };
 
+
 static int jd_shutdown;
 static cpu_set_t affinity;
 static unsigned int num_threads;
@@ -65,6 +299,37 @@ static unsigned int priority = 80;
 static uint64_t break_val = UINT64_MAX;
 static unsigned int sleep_interval_us = DEFAULT_INTERVAL;
 static unsigned int interval_resolution = NSEC_PER_US;
+static unsigned int hist_digits = 2;
+static unsigned int ringbuffer_size;
+static uint32_t rb_doorbell;
+static const char *mmap_dir;
+static int mmap_done;
+static uint64_t window_ns;
+static struct window_data *windows;
+static uint32_t window_epoch;
+static uint64_t outlier_threshold = UINT64_MAX;
+static double percentiles[MAX_PERCENTILES] = { 50, 90, 99, 99.9, 99.99 };
+static unsigned int num_percentiles = 5;
+static uint64_t tails[MAX_TAILS];
+static unsigned int num_tails;
+static struct histogram *total_hist;	/* all threads */
+static struct group *groups;
+static unsigned int num_groups;
+static pthread_barrier_t start_barrier;
+static int use_tsc;
+static struct tsc_calibration tsc_cal;
+static struct tsc_conv tsc_to_units;
+static uint64_t tsc_check_period;
+static int subtract_overhead;
+static cpu_set_t hwlat_affinity;
+static uint64_t hwlat_threshold;
+static int sched_policy = SCHED_FIFO;
+static unsigned int dl_runtime_us;
+static uint64_t dl_overruns;
+static int deadline_used;
+static int live_details;		/* -vv */
+static const struct wakeup_ops *wakeup_mode;
+static cpu_set_t wakeup_affinity;
 static unsigned int max_loops = 0;
 static int trace_fd = -1;
 static int tracemark_fd = -1;
@@ -74,6 +339,16 @@ static void sig_handler(int sig)
 	WRITE_ONCE(jd_shutdown, 1);
 }
 
+/*
+ * SIGXCPU is sent to the process when a SCHED_DEADLINE worker overruns
+ * its runtime (SCHED_FLAG_DL_OVERRUN). It is not directed to the
+ * thread, so only the total is known.
+ */
+static void sigxcpu_handler(int sig)
+{
+	__atomic_fetch_add(&dl_overruns, 1, __ATOMIC_RELAXED);
+}
+
 static inline int64_t ts_sub(struct timespec t1, struct timespec t2)
 {
 	int64_t diff;
@@ -84,6 +359,21 @@ static inline int64_t ts_sub(struct timespec t1, struct timespec t2)
 	return diff / interval_resolution;
 }
 
+static inline uint64_t ts_to_ns(struct timespec ts)
+{
+	return ts.tv_sec * (uint64_t)NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline struct timespec ns_to_ts(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / NSEC_PER_SEC;
+	ts.tv_nsec = ns % NSEC_PER_SEC;
+
+	return ts;
+}
+
 static inline struct timespec ts_add(struct timespec t1, struct timespec t2)
 {
 	t1.tv_sec = t1.tv_sec + t2.tv_sec;
@@ -160,313 +450,2346 @@ static inline pid_t __gettid(void)
 	return syscall(SYS_gettid);
 }
 
-static void dump_stats(FILE *f, struct system_info *sysinfo, struct stats *s)
+static const char *group_mode_name(struct group *g)
 {
-	unsigned int i, j, comma;
+	switch (g->mode) {
+	case MODE_HWLAT:
+		return "hwlat";
+	case MODE_DEADLINE:
+		return "deadline";
+	default:
+		return "timer";
+	}
+}
 
-	fprintf(f, "{\n");
-	fprintf(f, "  \"version\": 3,\n");
+/*
+ * The worker only adds up the squares, integer operations without a
+ * division. A square only needs more than 64 bits for latencies of
+ * seconds in ns, sum_sq_add() leaves that to sum_sq_add_wide().
+ */
+static void __attribute__((noinline)) sum_sq_add_wide(struct sum_sq *q,
+						       uint64_t v)
+{
+	uint64_t vl = (uint32_t)v, vh = v >> 32;
+	uint64_t cross = vh * vl, sq;
+
+	/* v^2 = vh^2 * 2^64 + 2 * vh * vl * 2^32 + vl^2 */
+	q->hi += vh * vh + (cross >> 31);
+	sq = cross << 33;
+	q->lo += sq;
+	q->hi += q->lo < sq;
+	sq = vl * vl;
+	q->lo += sq;
+	q->hi += q->lo < sq;
+}
+
+static inline void sum_sq_add(struct sum_sq *q, uint64_t v)
+{
+	uint64_t sq;
+
+	if (v >> 32) {
+		sum_sq_add_wide(q, v);
+		return;
+	}
+
+	sq = v * v;
+	q->lo += sq;
+	q->hi += q->lo < sq;
+}
+
+/* Adds the counters of one thread */
+static void stats_total_add(struct stats_total *t, uint64_t count,
+			    uint64_t total, uint64_t min, uint64_t max,
+			    struct sum_sq sq)
+{
+	if (!count)
+		return;
+
+	if (!t->count || min < t->min)
+		t->min = min;
+	if (max > t->max)
+		t->max = max;
+	t->count += count;
+	t->total += total;
+	t->sq.lo += sq.lo;
+	t->sq.hi += sq.hi + (t->sq.lo < sq.lo);
+}
+
+/* Sample standard deviation from the sum and the sum of squares */
+static double stats_stddev(uint64_t count, uint64_t total, struct sum_sq sq)
+{
+	long double m2;
+
+	if (count < 2)
+		return 0.0;
+
+	m2 = sq.hi * 18446744073709551616.0L + sq.lo -
+		(long double)total * total / count;
+
+	return m2 > 0 ? sqrt(m2 / (count - 1)) : 0.0;
+}
+
+/* Sum of the histograms of all threads */
+static void total_hist_update(struct stats **s)
+{
+	unsigned int i;
+
+	histogram_reset(total_hist);
+	for (i = 0; i < num_threads; i++)
+		histogram_merge(total_hist, s[i]->hist);
+}
+
+static void dump_percentiles(FILE *f, struct histogram *h, const char *indent)
+{
+	uint64_t val[MAX_PERCENTILES];
+	unsigned int i;
+
+	histogram_percentiles(h, percentiles, val, num_percentiles);
+	fprintf(f, "%s\"percentiles\": {", indent);
+	for (i = 0; i < num_percentiles; i++)
+		fprintf(f, "%s\n%s  \"%g\": %" PRIu64, i ? "," : "", indent,
+			percentiles[i], val[i]);
+	fprintf(f, "%s%s},\n", num_percentiles ? "\n" : "",
+		num_percentiles ? indent : "");
+
+	fprintf(f, "%s\"tail\": {", indent);
+	for (i = 0; i < num_tails; i++)
+		fprintf(f, "%s\n%s  \"%" PRIu64 "\": %" PRIu64,
+			i ? "," : "", indent, tails[i],
+			histogram_count_from(h, tails[i]));
+	fprintf(f, "%s%s},\n", num_tails ? "\n" : "",
+		num_tails ? indent : "");
+}
+
+/* Summary of a group, the per thread values are found under "cpu" */
+static void dump_group(FILE *f, struct group *g, struct stats **s, int last)
+{
+	struct stats_total t = { 0 };
+	unsigned int i, cpu, n;
+
+	for (i = g->first; i < g->first + g->count; i++)
+		stats_total_add(&t, s[i]->count, s[i]->total, s[i]->min,
+				s[i]->max, s[i]->sq);
+
+	fprintf(f, "    ");
+	jd_json_fputs(f, g->name);
+	fprintf(f, ": {\n");
+	fprintf(f, "      \"cpus\": [");
+	for (cpu = 0, n = 0; n < (unsigned) CPU_COUNT(&g->cpus); cpu++) {
+		if (!CPU_ISSET(cpu, &g->cpus))
+			continue;
+		fprintf(f, "%s%u", n ? ", " : "", cpu);
+		n++;
+	}
+	fprintf(f, "],\n");
+	fprintf(f, "      \"threads\": [");
+	for (i = g->first; i < g->first + g->count; i++)
+		fprintf(f, "%s%u", i == g->first ? "" : ", ", i);
+	fprintf(f, "],\n");
+	fprintf(f, "      \"mode\": \"%s\",\n", group_mode_name(g));
+	fprintf(f, "      \"interval_us\": %u,\n", g->interval_us);
+	fprintf(f, "      \"priority\": %d,\n", g->priority);
+	fprintf(f, "      \"threads_per_cpu\": %u,\n", g->threads);
+	fprintf(f, "      \"count\": %" PRIu64 ",\n", t.count);
+	fprintf(f, "      \"min\": %" PRIu64 ",\n", t.count ? t.min : 0);
+	fprintf(f, "      \"max\": %" PRIu64 ",\n", t.max);
+	fprintf(f, "      \"stddev\": %.2f,\n", stats_stddev(t.count, t.total, t.sq));
+	fprintf(f, "      \"avg\": %.2f\n",
+		t.count ? (double)t.total / (double)t.count : 0.0);
+	fprintf(f, "    }%s\n", last ? "" : ",");
+}
+
+static void dump_sysinfo(FILE *f, struct system_info *sysinfo,
+			 int64_t tsc_drift)
+{
+	fprintf(f, "  \"version\": 4,\n");
 	fprintf(f, "  \"sysinfo\": {\n");
-	fprintf(f, "    \"sysname\": \"%s\",\n", sysinfo->sysname);
-	fprintf(f, "    \"nodename\": \"%s\",\n", sysinfo->nodename);
-	fprintf(f, "    \"release\": \"%s\",\n", sysinfo->release);
-	fprintf(f, "    \"version\": \"%s\",\n", sysinfo->version);
-	fprintf(f, "    \"machine\": \"%s\",\n", sysinfo->machine);
+	fprintf(f, "    \"sysname\": ");
+	jd_json_fputs(f, sysinfo->sysname);
+	fprintf(f, ",\n    \"nodename\": ");
+	jd_json_fputs(f, sysinfo->nodename);
+	fprintf(f, ",\n    \"release\": ");
+	jd_json_fputs(f, sysinfo->release);
+	fprintf(f, ",\n    \"version\": ");
+	jd_json_fputs(f, sysinfo->version);
+	fprintf(f, ",\n    \"machine\": ");
+	jd_json_fputs(f, sysinfo->machine);
+	fprintf(f, ",\n");
 	fprintf(f, "    \"cpus_online\": %d,\n", sysinfo->cpus_online);
-	fprintf(f, "    \"resolution_in_ns\": %u\n", interval_resolution);
+	fprintf(f, "    \"resolution_in_ns\": %u,\n", interval_resolution);
+	fprintf(f, "    \"histogram_digits\": %u,\n", hist_digits);
+	if (use_tsc) {
+		fprintf(f, "    \"tsc_hz\": %" PRIu64 ",\n", tsc_cal.hz);
+		fprintf(f, "    \"tsc_drift_ns\": %" PRId64 ",\n", tsc_drift);
+	}
+	fprintf(f, "    \"clock\": \"%s\",\n", use_tsc ? "tsc" : "monotonic");
+	if (deadline_used)
+		fprintf(f, "    \"dl_overruns\": %" PRIu64 ",\n",
+			__atomic_load_n(&dl_overruns, __ATOMIC_RELAXED));
+	fprintf(f, "    \"overhead_subtracted\": %s\n",
+		subtract_overhead ? "true" : "false");
+	fprintf(f, "  },\n");
+}
+
+/* Buckets are keyed by the lowest value they count */
+static void dump_histogram(FILE *f, struct histogram *h, const char *indent)
+{
+	unsigned int j, comma;
+
+	fprintf(f, "%s\"histogram\": {", indent);
+	for (j = 0, comma = 0; j < h->size; j++) {
+		if (!h->buckets[j])
+			continue;
+		fprintf(f, "%s", comma ? ",\n" : "\n");
+		fprintf(f, "%s  \"%" PRIu64 "\": %" PRIu64, indent,
+			histogram_bucket_low(h, j), h->buckets[j]);
+		comma = 1;
+	}
+	if (comma)
+		fprintf(f, "\n%s", indent);
+	fprintf(f, "},\n");
+	fprintf(f, "%s\"overflow\": %" PRIu64 ",\n", indent, h->overflow);
+}
+
+/* Sustained throughput over the whole run, not only inside pwrite() */
+static double writer_mb_per_s(struct block_writer *bw)
+{
+	uint64_t ns = block_writer_wall_ns(bw);
+
+	if (!ns)
+		return 0;
+	return (double)block_writer_bytes(bw) / ns * NSEC_PER_SEC / (1024 * 1024);
+}
+
+static const char *samples_file_name(struct record_data *rec)
+{
+	return rec->jdc ? "samples.jdc" : "samples.raw";
+}
+
+static void dump_writer(FILE *f, struct record_data *rec)
+{
+	struct block_writer *bw = rec->bw;
+
+	fprintf(f, "  \"samples_file\": {\n");
+	fprintf(f, "    \"name\": \"%s\",\n", samples_file_name(rec));
+	fprintf(f, "    \"bytes\": %" PRIu64 ",\n", block_writer_bytes(bw));
+	fprintf(f, "    \"write_time_ns\": %" PRIu64 ",\n", block_writer_ns(bw));
+	fprintf(f, "    \"wall_time_ns\": %" PRIu64 ",\n",
+		block_writer_wall_ns(bw));
+	fprintf(f, "    \"mb_per_s\": %.2f,\n", writer_mb_per_s(bw));
+	if (block_writer_error(bw)) {
+		fprintf(f, "    \"error\": ");
+		jd_json_fputs(f, strerror(block_writer_error(bw)));
+		fprintf(f, ",\n");
+		fprintf(f, "    \"lost_bytes\": %" PRIu64 ",\n",
+			block_writer_lost(bw));
+	}
+	fprintf(f, "    \"direct_io\": %s\n",
+		block_writer_direct(bw) ? "true" : "false");
+	fprintf(f, "  },\n");
+}
+
+static void display_writer(struct record_data *rec)
+{
+	struct block_writer *bw = rec->bw;
+
+	printf("%s: %" PRIu64 " bytes written at %.2f MB/s%s\n",
+	       samples_file_name(rec), block_writer_bytes(bw), writer_mb_per_s(bw),
+	       block_writer_direct(bw) ? " (O_DIRECT)" : "");
+	if (block_writer_error(bw))
+		printf("%s: stopped after write error: %s, %" PRIu64
+		       " bytes lost\n", samples_file_name(rec),
+		       strerror(block_writer_error(bw)), block_writer_lost(bw));
+}
+
+static void dump_network(FILE *f, struct record_data *rec)
+{
+	fprintf(f, "  \"network\": {\n");
+	fprintf(f, "    \"sender\": %u,\n", rec->sender);
+	fprintf(f, "    \"packets_sent\": %" PRIu64 ",\n", rec->packets_sent);
+	fprintf(f, "    \"packets_dropped\": %" PRIu64 ",\n",
+		rec->packets_dropped);
+	fprintf(f, "    \"send_stalls\": %" PRIu64 "\n", rec->send_stalls);
+	fprintf(f, "  },\n");
+}
+
+static void dump_windows(FILE *f, struct window_data *wd)
+{
+	fprintf(f, "  \"windows\": {\n");
+	if (wd->log)
+		fprintf(f, "    \"file\": \"windows.jsonl\",\n");
+	fprintf(f, "    \"window_ns\": %" PRIu64 ",\n", window_ns);
+	fprintf(f, "    \"closed\": %" PRIu64 "\n", wd->windows);
+	fprintf(f, "  },\n");
+}
+
+static void dump_hist_stream(FILE *f, struct window_data *wd)
+{
+	fprintf(f, "  \"hist_stream\": {\n");
+	fprintf(f, "    \"sender\": %u,\n", wd->sender);
+	fprintf(f, "    \"packets_sent\": %" PRIu64 ",\n", wd->packets_sent);
+	fprintf(f, "    \"send_errors\": %" PRIu64 "\n", wd->send_errors);
 	fprintf(f, "  },\n");
+}
+
+static void dump_stats(FILE *f, struct system_info *sysinfo, struct stats **s,
+		       struct record_data *rec, struct window_data *wd,
+		       int64_t tsc_drift)
+{
+	struct stats_total t = { 0 };
+	unsigned int i;
+
+	fprintf(f, "{\n");
+	dump_sysinfo(f, sysinfo, tsc_drift);
 	fprintf(f, "  \"cpu\": {\n");
 	for (i = 0; i < num_threads; i++) {
 		fprintf(f, "    \"%u\": {\n", i);
 
-		fprintf(f, "      \"histogram\": {");
-		for (j = 0, comma = 0; j < s[i].hist_size; j++) {
-			if (!s[i].hist[j])
-				continue;
-			fprintf(f, "%s", comma ? ",\n" : "\n");
-			fprintf(f, "        \"%u\": %" PRIu64,j, s[i].hist[j]);
-			comma = 1;
+		dump_histogram(f, s[i]->hist, "      ");
+		fprintf(f, "      \"group\": ");
+		jd_json_fputs(f, s[i]->group->name);
+		fprintf(f, ",\n");
+		fprintf(f, "      \"affinity\": %u,\n", s[i]->affinity);
+		if (s[i]->group->mode == MODE_HWLAT) {
+			fprintf(f, "      \"mode\": \"hwlat\",\n");
+			fprintf(f, "      \"hwlat_threshold\": %" PRIu64 ",\n",
+				hwlat_threshold);
+			fprintf(f, "      \"spin_time_ns\": %" PRIu64 ",\n",
+				s[i]->spin_time);
+		} else if (s[i]->group->mode == MODE_DEADLINE) {
+			fprintf(f, "      \"mode\": \"deadline\",\n");
+			fprintf(f, "      \"dl_runtime_us\": %u,\n",
+				s[i]->group->dl_runtime_us);
+			fprintf(f, "      \"dl_period_us\": %u,\n",
+				s[i]->group->interval_us);
+			fprintf(f, "      \"dl_missed\": %" PRIu64 ",\n",
+				s[i]->dl_missed);
+			fprintf(f, "      \"dl_throttled\": %" PRIu64 ",\n",
+				s[i]->dl_throttled);
+		} else {
+			fprintf(f, "      \"mode\": \"timer\",\n");
+			fprintf(f, "      \"timer\": \"%s\",\n",
+				timer_ops_name(s[i]->timer));
+		}
+		if (use_tsc) {
+			fprintf(f, "      \"tsc_offset_ns\": %" PRId64 ",\n",
+				s[i]->tsc_offset);
+			fprintf(f, "      \"tsc_drift_ns\": %" PRId64 ",\n",
+				s[i]->tsc_drift);
 		}
-		if (comma)
-			fprintf(f, "\n");
+		fprintf(f, "      \"node\": %d,\n", s[i]->node);
+		fprintf(f, "      \"memory_node\": {\n");
+		fprintf(f, "        \"stats\": %d,\n", jd_mem_node(s[i]));
+		fprintf(f, "        \"histogram\": %d,\n", s[i]->hist_node);
+		fprintf(f, "        \"ringbuffer\": %d\n", s[i]->rb_node);
 		fprintf(f, "      },\n");
-		fprintf(f, "      \"count\": %" PRIu64 ",\n", s[i].count);
-		fprintf(f, "      \"min\": %" PRIu64 ",\n", s[i].min);
-		fprintf(f, "      \"max\": %" PRIu64 ",\n", s[i].max);
-		fprintf(f, "      \"avg\": %.2f\n",
-			(double)s[i].total / (double)s[i].count);
+		if (rec) {
+			fprintf(f, "      \"samples\": {\n");
+			fprintf(f, "        \"stored\": %" PRIu64 ",\n",
+				rec->stored[i]);
+			fprintf(f, "        \"dropped\": %u",
+				ringbuffer_overflow(s[i]->rb));
+			if (rec->send_dropped)
+				fprintf(f, ",\n        \"send_dropped\": %" PRIu64,
+					rec->send_dropped[i]);
+			if (rec->write_dropped)
+				fprintf(f, ",\n        \"write_dropped\": %" PRIu64,
+					rec->write_dropped[i]);
+			fprintf(f, "\n      },\n");
+		} else if (s[i]->sf) {
+			fprintf(f, "      \"samples\": {\n");
+			fprintf(f, "        \"file\": \"samples.%u.raw\",\n", i);
+			fprintf(f, "        \"stored\": %" PRIu64 ",\n",
+				sample_file_count(s[i]->sf));
+			fprintf(f, "        \"remaps\": %" PRIu64 ",\n",
+				s[i]->sf->remaps);
+			fprintf(f, "        \"remap_ns\": %" PRIu64 ",\n",
+				s[i]->sf->remap_ns);
+			fprintf(f, "        \"dropped\": %" PRIu64 "\n",
+				sample_file_dropped(s[i]->sf));
+			fprintf(f, "      },\n");
+		}
+		if (s[i]->overhead) {
+			fprintf(f, "      \"overhead_ns\": {\n");
+			fprintf(f, "        \"min\": %" PRIu64 ",\n",
+				s[i]->overhead_min);
+			fprintf(f, "        \"avg\": %.2f,\n",
+				(double)s[i]->overhead_total / CALIBRATION_LOOPS);
+			fprintf(f, "        \"p50\": %" PRIu64 ",\n",
+				histogram_percentile(s[i]->overhead, 50));
+			fprintf(f, "        \"p99\": %" PRIu64 ",\n",
+				histogram_percentile(s[i]->overhead, 99));
+			fprintf(f, "        \"max\": %" PRIu64 "\n",
+				s[i]->overhead_max);
+			fprintf(f, "      },\n");
+		}
+		dump_percentiles(f, s[i]->hist, "      ");
+		fprintf(f, "      \"stddev\": %.2f,\n",
+			stats_stddev(s[i]->count, s[i]->total, s[i]->sq));
+		fprintf(f, "      \"count\": %" PRIu64 ",\n", s[i]->count);
+		fprintf(f, "      \"min\": %" PRIu64 ",\n",
+			s[i]->count ? s[i]->min : 0);
+		fprintf(f, "      \"max\": %" PRIu64 ",\n", s[i]->max);
+		fprintf(f, "      \"avg\": %.2f\n", s[i]->count ?
+			(double)s[i]->total / (double)s[i]->count : 0.0);
 		fprintf(f, "    }%s\n", i == num_threads - 1 ? "" : ",");
 	}
+	fprintf(f, "  },\n");
+
+	for (i = 0; i < num_threads; i++)
+		stats_total_add(&t, s[i]->count, s[i]->total, s[i]->min,
+				s[i]->max, s[i]->sq);
+	total_hist_update(s);
+	fprintf(f, "  \"all\": {\n");
+	dump_percentiles(f, total_hist, "    ");
+	fprintf(f, "    \"overflow\": %" PRIu64 ",\n", total_hist->overflow);
+	fprintf(f, "    \"stddev\": %.2f,\n", stats_stddev(t.count, t.total, t.sq));
+	fprintf(f, "    \"count\": %" PRIu64 ",\n", t.count);
+	fprintf(f, "    \"min\": %" PRIu64 ",\n", t.count ? t.min : 0);
+	fprintf(f, "    \"max\": %" PRIu64 ",\n", t.max);
+	fprintf(f, "    \"avg\": %.2f\n",
+		t.count ? (double)t.total / (double)t.count : 0.0);
+	fprintf(f, "  },\n");
+	if (rec && rec->bw)
+		dump_writer(f, rec);
+	if (rec && rec->send_dropped)
+		dump_network(f, rec);
+	if (wd)
+		dump_windows(f, wd);
+	if (wd && wd->server)
+		dump_hist_stream(f, wd);
+	fprintf(f, "  \"groups\": {\n");
+	for (i = 0; i < num_groups; i++)
+		dump_group(f, &groups[i], s, i == num_groups - 1);
+	fprintf(f, "  }\n");
+	fprintf(f, "}\n");
+}
+
+/* Called by the worker after each update of its counters */
+static inline void snapshot_publish(struct stats *s)
+{
+	struct stats_snapshot *snap = &s->snap;
+	uint32_t seq = snap->seq;
+
+	WRITE_ONCE(snap->seq, seq + 1);
+	smp_wmb();
+
+	WRITE_ONCE(snap->count, s->count);
+	WRITE_ONCE(snap->total, s->total);
+	WRITE_ONCE(snap->min, s->min);
+	WRITE_ONCE(snap->max, s->max);
+	WRITE_ONCE(snap->sq.lo, s->sq.lo);
+	WRITE_ONCE(snap->sq.hi, s->sq.hi);
+
+	smp_store_release(&snap->seq, seq + 2);
+}
+
+/* Safe to be called from any thread */
+static void snapshot_read(struct stats *s, struct stats_snapshot *v)
+{
+	struct stats_snapshot *snap = &s->snap;
+	uint32_t seq;
+
+	do {
+		seq = smp_load_acquire(&snap->seq);
+
+		v->count = READ_ONCE(snap->count);
+		v->total = READ_ONCE(snap->total);
+		v->min = READ_ONCE(snap->min);
+		v->max = READ_ONCE(snap->max);
+		v->sq.lo = READ_ONCE(snap->sq.lo);
+		v->sq.hi = READ_ONCE(snap->sq.hi);
+
+		smp_rmb();
+	} while ((seq & 1) || seq != READ_ONCE(snap->seq));
+
+	v->seq = seq;
+}
+
+/*
+ * The live view redraws its lines in place, so it has to know how
+ * many terminal rows they took. The thread lines stay within 80
+ * columns, the detail lines (-vv) wrap if there are many percentiles
+ * or tails. Returns the rows of a line of len columns.
+ */
+static unsigned int display_rows(int len)
+{
+	struct winsize ws;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0 || !ws.ws_col ||
+	    len <= ws.ws_col)
+		return 1;
+
+	return (len + ws.ws_col - 1) / ws.ws_col;
+}
+
+/* Ends a line with the characters of the escape sequence left out */
+static unsigned int display_eol(int len)
+{
+	printf(" " VT100_ERASE_EOL "\n");
+	return display_rows(len + 1);
+}
+
+/* The last closed window of thread i */
+static int display_window(struct window_data *wd, unsigned int i)
+{
+	struct window_summary w;
+
+	pthread_mutex_lock(&wd->lock);
+	w = wd->last[i];
+	pthread_mutex_unlock(&wd->lock);
+
+	if (!w.count)
+		return printf("%18s W: -", "");
+	return printf("%18s W: Min:%6" PRIu64 " Avg:%8.2f P99:%6" PRIu64
+		      " Max:%6" PRIu64, "", w.min, (double)w.total / w.count,
+		      w.p99, w.max);
+}
+
+/* Min, standard deviation, percentiles and tail counts */
+static int display_details(uint64_t count, uint64_t total, uint64_t min,
+			   struct sum_sq sq, struct histogram *h)
+{
+	uint64_t val[MAX_PERCENTILES];
+	unsigned int i;
+	int len;
+
+	len = printf("%18s Min:%10" PRIu64 " SD:%8.2f", "", count ? min : 0,
+		     stats_stddev(count, total, sq));
+	histogram_percentiles(h, percentiles, val, num_percentiles);
+	for (i = 0; i < num_percentiles; i++)
+		len += printf(" P%g:%6" PRIu64, percentiles[i], val[i]);
+	for (i = 0; i < num_tails; i++)
+		len += printf(" >=%" PRIu64 ":%6" PRIu64, tails[i],
+			      histogram_count_from(h, tails[i]));
+	return len;
+}
+
+/* The highest of the --percentiles */
+static int display_percentile(struct histogram *h)
+{
+	if (!num_percentiles)
+		return 0;
+	return printf(" P%g:%6" PRIu64, percentiles[num_percentiles - 1],
+		      histogram_percentile(h, percentiles[num_percentiles - 1]));
+}
+
+/*
+ * One line per thread and one for all threads, each followed by the
+ * detail lines if asked for. The histograms are read while the
+ * workers update them, the percentiles may be a few samples behind
+ * the counters. Returns the number of terminal rows written.
+ */
+static unsigned int __display_stats(struct stats **s, int details)
+{
+	struct stats_total t = { 0 };
+	struct stats_snapshot v;
+	unsigned int i, rows = 0;
+	int len;
+
+	for (i = 0; i < num_threads; i++) {
+		snapshot_read(s[i], &v);
+		stats_total_add(&t, v.count, v.total, v.min, v.max, v.sq);
+		len = printf("T:%2u (%5lu) A:%2u C:%10" PRIu64
+			     " Avg:%8.2f Max:%10" PRIu64,
+			     i, (long)s[i]->tid, s[i]->affinity,
+			     v.count,
+			     v.count ? (double) v.total / (double) v.count : 0,
+			     v.max);
+		len += display_percentile(s[i]->hist);
+		if (s[i]->rb)
+			len += printf(" D:%u", ringbuffer_overflow(s[i]->rb));
+		else if (s[i]->sf)
+			len += printf(" D:%" PRIu64,
+				      sample_file_dropped(s[i]->sf));
+		if (num_groups > 1)
+			len += printf(" G:%s", s[i]->group->name);
+		rows += display_eol(len);
+
+		if (!details)
+			continue;
+		rows += display_eol(display_details(v.count, v.total, v.min,
+						    v.sq, s[i]->hist));
+		if (windows)
+			rows += display_eol(display_window(windows, i));
+	}
+
+	total_hist_update(s);
+	len = printf("All             C:%10" PRIu64 " Avg:%8.2f Max:%10" PRIu64,
+		     t.count,
+		     t.count ? (double) t.total / (double) t.count : 0,
+		     t.max);
+	len += display_percentile(total_hist);
+	rows += display_eol(len);
+	if (details)
+		rows += display_eol(display_details(t.count, t.total, t.min,
+						    t.sq, total_hist));
+
+	return rows;
+}
+
+static void display_groups(void)
+{
+	struct group *g;
+	unsigned int i;
+
+	for (i = 0; i < num_groups; i++) {
+		g = &groups[i];
+		printf("group %s: cpus ", g->name);
+		cpuset_fprint(stdout, &g->cpus);
+		printf(" mode %s interval %u priority %d threads/cpu %u\n",
+		       group_mode_name(g), g->interval_us, g->priority,
+		       g->threads);
+	}
+}
+
+static void display_overhead(struct stats **s)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_threads; i++) {
+		/* Not calibrated, see worker_setup() */
+		if (!s[i]->overhead)
+			continue;
+		printf("T:%2u overhead [ns] Min:%6" PRIu64 " Avg:%8.2f"
+			" P99:%6" PRIu64 " Max:%8" PRIu64 "%s\n",
+			i, s[i]->overhead_min,
+			(double)s[i]->overhead_total / CALIBRATION_LOOPS,
+			histogram_percentile(s[i]->overhead, 99),
+			s[i]->overhead_max,
+			subtract_overhead ? " (subtracted)" : "");
+	}
+}
+
+/* One row per waker CPU, one column per wakee CPU */
+static void display_wakeup_table(struct wakeup_matrix *m, const char *title,
+				 double p)
+{
+	struct wakeup_cell *c;
+	unsigned int src, dst;
+	uint64_t val;
+
+	printf("%-6s", title);
+	for (dst = 0; dst < m->n; dst++)
+		printf(" %7u", m->cpus[dst]);
+	printf("\n");
+
+	for (src = 0; src < m->n; src++) {
+		printf("%6u", m->cpus[src]);
+		for (dst = 0; dst < m->n; dst++) {
+			c = wakeup_cell(m, src, dst);
+			if (!c->count) {
+				printf(" %7s", "-");
+				continue;
+			}
+			val = p ? histogram_percentile(c->hist, p) : c->max;
+			printf(" %7" PRIu64, val);
+		}
+		printf("\n");
+	}
+}
+
+static void display_wakeup(struct wakeup_matrix *m)
+{
+	printf("wakeup latency [%s] via %s, rows: waker CPU, columns: "
+	       "wakee CPU\n", interval_resolution == 1 ? "ns" : "us",
+	       wakeup_ops_name(m->ops));
+	display_wakeup_table(m, "P50", 50);
+	display_wakeup_table(m, "P99", 99);
+	display_wakeup_table(m, "Max", 0);
+}
+
+static void dump_wakeup(FILE *f, struct system_info *sysinfo,
+			struct wakeup_matrix *m)
+{
+	struct wakeup_cell *c;
+	unsigned int src, dst;
+
+	fprintf(f, "{\n");
+	dump_sysinfo(f, sysinfo, 0);
+	fprintf(f, "  \"wakeup\": {\n");
+	fprintf(f, "    \"mechanism\": \"%s\",\n", wakeup_ops_name(m->ops));
+	fprintf(f, "    \"interval_us\": %u,\n", sleep_interval_us);
+	fprintf(f, "    \"priority\": %u,\n", priority);
+	fprintf(f, "    \"matrix\": {\n");
+	for (src = 0; src < m->n; src++) {
+		fprintf(f, "      \"%u\": {\n", m->cpus[src]);
+		for (dst = 0; dst < m->n; dst++) {
+			c = wakeup_cell(m, src, dst);
+			fprintf(f, "        \"%u\": {\n", m->cpus[dst]);
+			fprintf(f, "          \"relation\": \"%s\",\n",
+				wakeup_cpu_relation(m->cpus[src], m->cpus[dst]));
+			if (c->hist) {
+				dump_histogram(f, c->hist, "          ");
+				fprintf(f, "          \"p50\": %" PRIu64 ",\n",
+					histogram_percentile(c->hist, 50));
+				fprintf(f, "          \"p99\": %" PRIu64 ",\n",
+					histogram_percentile(c->hist, 99));
+				fprintf(f, "          \"p99.9\": %" PRIu64 ",\n",
+					histogram_percentile(c->hist, 99.9));
+			}
+			fprintf(f, "          \"count\": %" PRIu64 ",\n",
+				c->count);
+			fprintf(f, "          \"min\": %" PRIu64 ",\n",
+				c->count ? c->min : 0);
+			fprintf(f, "          \"max\": %" PRIu64 ",\n", c->max);
+			fprintf(f, "          \"avg\": %.2f\n",
+				c->count ? (double)c->total / c->count : 0.0);
+			fprintf(f, "        }%s\n", dst == m->n - 1 ? "" : ",");
+		}
+		fprintf(f, "      }%s\n", src == m->n - 1 ? "" : ",");
+	}
+	fprintf(f, "    }\n");
 	fprintf(f, "  }\n");
 	fprintf(f, "}\n");
 }
 
-static void __display_stats(struct stats *s)
+/* Runs the wakeup matrix instead of the measurement groups */
+static void wakeup_measure(const char *dir, struct system_info *sysinfo)
+{
+	struct wakeup_params p;
+	struct wakeup_matrix *m;
+	FILE *rfd;
+
+	if (!CPU_COUNT(&wakeup_affinity))
+		wakeup_affinity = affinity;
+
+	p.loops = max_loops ? max_loops : WAKEUP_LOOPS;
+	p.interval_us = sleep_interval_us;
+	p.resolution = interval_resolution;
+	p.priority = priority;
+	p.digits = hist_digits;
+	p.stop = &jd_shutdown;
+
+	m = wakeup_matrix_run(&wakeup_affinity, wakeup_mode, &p);
+
+	printf("\n");
+	display_wakeup(m);
+
+	if (dir) {
+		rfd = jd_fopen(dir, "results.json", "w");
+		if (rfd) {
+			dump_wakeup(rfd, sysinfo, m);
+			fclose(rfd);
+		} else {
+			warn_handler("Couldn't create results.json");
+		}
+	}
+
+	wakeup_matrix_free(m);
+}
+
+static void *display_stats(void *arg)
+{
+	struct stats **s = arg;
+	unsigned int rows = 0;
+
+	while (!READ_ONCE(jd_shutdown)) {
+		if (rows)
+			printf(VT100_CURSOR_UP, rows);
+
+		rows = __display_stats(s, live_details);
+
+		fflush(stdout);
+		usleep(100 * 1000); /* 100 ms interval */
+	}
+
+	return NULL;
+}
+
+typedef void (*store_fn)(struct record_data *rec, unsigned int cpu,
+			 uint64_t *ts, uint64_t *val, unsigned int n);
+typedef void (*flush_fn)(struct record_data *rec);
+
+/*
+ * Hands all buffered samples in batches to out(). Between two passes
+ * it waits for the doorbell of the rings. After the workers are done
+ * one last pass picks up what is left.
+ */
+static void store_loop(struct record_data *rec, store_fn out, flush_fn flush)
+{
+	struct timespec timeout = { 0, STORE_TIMEOUT_MS * 1000000 };
+	struct stats **s = rec->stats;
+	uint64_t ts[STORE_BATCH], val[STORE_BATCH];
+	unsigned int i, n;
+	int done;
+
+	do {
+		done = READ_ONCE(rec->done);
+
+		for (i = 0; i < num_threads; i++) {
+			do {
+				n = ringbuffer_read_batch(s[i]->rb, ts, val,
+							  STORE_BATCH);
+				if (n)
+					out(rec, i, ts, val, n);
+				rec->stored[i] += n;
+			} while (n == STORE_BATCH);
+		}
+
+		if (flush)
+			flush(rec);
+
+		if (!done)
+			jd_futex_wait(&rb_doorbell, &timeout);
+	} while (!done);
+}
+
+static void store_index_entry(struct record_data *rec)
+{
+	if (fwrite(&rec->idx_cur, sizeof(rec->idx_cur), 1, rec->idx) != 1)
+		err_handler(errno, "fwrite()");
+}
+
+static inline void store_index_add(struct record_data *rec, uint64_t ts)
+{
+	struct jd_samples_index_entry *e = &rec->idx_cur;
+
+	if (!(rec->idx_records % JD_SAMPLES_INDEX_RECORDS)) {
+		e->min_ts = ts;
+		e->max_ts = ts;
+	} else if (ts < e->min_ts) {
+		e->min_ts = ts;
+	} else if (ts > e->max_ts) {
+		e->max_ts = ts;
+	}
+
+	if (!(++rec->idx_records % JD_SAMPLES_INDEX_RECORDS))
+		store_index_entry(rec);
+}
+
+static void store_file_samples(struct record_data *rec, unsigned int cpu,
+			       uint64_t *ts, uint64_t *val, unsigned int n)
+{
+	struct latency_sample sp[STORE_BATCH];
+	struct timespec t;
+	unsigned int i;
+
+	/* The writer discards everything after a write error */
+	if (block_writer_error(rec->bw)) {
+		rec->write_dropped[cpu] += n;
+		return;
+	}
+
+	if (rec->jdc) {
+		for (i = 0; i < n; i++)
+			jdc_writer_add(rec->jdc, cpu, ts[i], val[i]);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		t = ns_to_ts(ts[i]);
+		sp[i].cpuid = cpu;
+		memcpy(&sp[i].ts, &t, sizeof(sp[i].ts));
+		memcpy(&sp[i].val, &val[i], sizeof(sp[i].val));
+		store_index_add(rec, ts[i]);
+	}
+
+	block_writer_add(rec->bw, sp, n * sizeof(struct latency_sample));
+}
+
+static void store_file_flush(struct record_data *rec)
+{
+	block_writer_flush(rec->bw);
+}
+
+/*
+ * Header of samples.raw, also embedded into samples.jdc and
+ * samples.N.raw. Only valid once all workers are set up.
+ */
+static struct jd_samples_header *samples_header_create(struct stats **s)
+{
+	struct jd_samples_header *h;
+	struct timespec real;
+	uint32_t len;
+	unsigned int i;
+
+	len = jd_samples_header_size(num_threads);
+	h = calloc(1, len);
+	if (!h)
+		err_handler(ENOMEM, "calloc()");
+
+	memcpy(h->magic, JD_SAMPLES_MAGIC, sizeof(h->magic));
+	h->version = JD_SAMPLES_VERSION;
+	h->header_size = len;
+	h->record_size = sizeof(struct latency_sample);
+	h->resolution_ns = interval_resolution;
+	h->clock_id = CLOCK_MONOTONIC;
+	h->nr_threads = num_threads;
+	h->start_ns = clock_monotonic_ns();
+	clock_gettime(CLOCK_REALTIME, &real);
+	h->start_realtime_ns = ts_to_ns(real);
+
+	for (i = 0; i < num_threads; i++) {
+		h->threads[i].cpu = s[i]->affinity;
+		h->threads[i].interval_us = s[i]->group->interval_us;
+	}
+
+	return h;
+}
+
+static void store_index_header(struct record_data *rec)
+{
+	struct jd_samples_index_header h;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, JD_SAMPLES_INDEX_MAGIC, sizeof(h.magic));
+	h.version = JD_SAMPLES_INDEX_VERSION;
+	h.records = JD_SAMPLES_INDEX_RECORDS;
+
+	if (fwrite(&h, sizeof(h), 1, rec->idx) != 1)
+		err_handler(errno, "fwrite()");
+}
+
+static void store_jdc_write(void *arg, const void *data, size_t len)
+{
+	block_writer_add(arg, data, len);
+}
+
+static void store_file(struct record_data *rec)
+{
+	store_loop(rec, store_file_samples, store_file_flush);
+	if (rec->jdc)
+		jdc_writer_close(rec->jdc);
+	block_writer_close(rec->bw);
+
+	if (rec->idx) {
+		if (rec->idx_records % JD_SAMPLES_INDEX_RECORDS)
+			store_index_entry(rec);
+		fclose(rec->idx);
+		rec->idx = NULL;
+	}
+}
+
+/* UDP socket for sending to server:port, *sa is allocated */
+static int net_socket(const char *server, const char *port,
+		      struct sockaddr **sa, socklen_t *salen)
+{
+	struct addrinfo hints, *res, *tmp;
+	int err, sk;
+
+	bzero(&hints, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+
+	err = getaddrinfo(server, port, &hints, &res);
+	if (err < 0)
+		err_handler(err, "getaddrinfo()");
+
+	tmp = res;
+	do {
+		sk = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (sk >= 0)
+			break;
+		res = res->ai_next;
+	} while (res);
+	if (sk < 0)
+		err_handler(ENOENT, "no server");
+
+	*sa = malloc(res->ai_addrlen);
+	if (!*sa)
+		err_handler(ENOMEM, "malloc()");
+	memcpy(*sa, res->ai_addr, res->ai_addrlen);
+	*salen = res->ai_addrlen;
+
+	freeaddrinfo(tmp);
+
+	return sk;
+}
+
+/* Waits until the socket buffer has room again */
+static int store_network_wait(struct record_data *rec)
+{
+	struct pollfd pfd = { .fd = rec->sk, .events = POLLOUT };
+	int ret;
+
+	rec->send_stalls++;
+	do {
+		ret = poll(&pfd, 1, NET_SEND_TIMEOUT_MS);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret > 0;
+}
+
+/* Sends the queued packets with as few system calls as possible */
+static void store_network_flush(struct record_data *rec)
+{
+	unsigned int i, sent = 0, dropped = 0;
+	int ret;
+
+	while (sent < rec->queued) {
+		ret = sendmmsg(rec->sk, rec->msgs + sent, rec->queued - sent, 0);
+		if (ret > 0) {
+			sent += ret;
+			continue;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+		    store_network_wait(rec))
+			continue;
+
+		/* Drop the packet which can't be sent and try the rest */
+		if (!rec->packets_dropped)
+			warn_handler("sendmmsg() failed: %s",
+				     strerror(ret < 0 ? errno : EIO));
+		i = rec->queue[sent].hdr.cpuid;
+		rec->send_dropped[i] += rec->queue[sent].hdr.count;
+		rec->packets_dropped++;
+		dropped++;
+		sent++;
+	}
+
+	rec->packets_sent += rec->queued - dropped;
+	rec->queued = 0;
+}
+
+static void store_network_queue(struct record_data *rec, unsigned int cpu,
+				uint32_t flags)
+{
+	struct jd_packet *p = &rec->open[cpu];
+	struct jd_packet *q = &rec->queue[rec->queued];
+
+	p->hdr.flags = flags;
+	memcpy(q, p, sizeof(p->hdr) +
+	       p->hdr.count * sizeof(struct latency_sample));
+	rec->iov[rec->queued].iov_len = sizeof(p->hdr) +
+		p->hdr.count * sizeof(struct latency_sample);
+	rec->queued++;
+
+	p->hdr.seq++;
+	p->hdr.count = 0;
+
+	if (rec->queued == NET_BATCH)
+		store_network_flush(rec);
+}
+
+static void store_network_samples(struct record_data *rec, unsigned int cpu,
+				  uint64_t *ts, uint64_t *val, unsigned int n)
+{
+	struct jd_packet *p = &rec->open[cpu];
+	struct latency_sample *sp;
+	struct timespec t;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		t = ns_to_ts(ts[i]);
+		sp = &p->samples[p->hdr.count];
+		sp->cpuid = cpu;
+		memcpy(&sp->ts, &t, sizeof(sp->ts));
+		memcpy(&sp->val, &val[i], sizeof(sp->val));
+		if (++p->hdr.count == SAMPLES_PER_PACKET)
+			store_network_queue(rec, cpu, 0);
+	}
+}
+
+static void store_network_setup(struct record_data *rec)
+{
+	unsigned int i;
+
+	rec->open = calloc(num_threads, sizeof(*rec->open));
+	rec->queue = calloc(NET_BATCH, sizeof(*rec->queue));
+	rec->msgs = calloc(NET_BATCH, sizeof(*rec->msgs));
+	rec->iov = calloc(NET_BATCH, sizeof(*rec->iov));
+	rec->send_dropped = calloc(num_threads, sizeof(*rec->send_dropped));
+	if (!rec->open || !rec->queue || !rec->msgs || !rec->iov ||
+	    !rec->send_dropped)
+		err_handler(ENOMEM, "calloc()");
+
+	for (i = 0; i < num_threads; i++) {
+		rec->open[i].hdr.magic = JD_PACKET_MAGIC;
+		rec->open[i].hdr.version = JD_PACKET_VERSION;
+		rec->open[i].hdr.sender = rec->sender;
+		rec->open[i].hdr.cpuid = i;
+		rec->open[i].hdr.resolution_ns = interval_resolution;
+	}
+
+	for (i = 0; i < NET_BATCH; i++) {
+		rec->iov[i].iov_base = &rec->queue[i];
+		rec->msgs[i].msg_hdr.msg_iov = &rec->iov[i];
+		rec->msgs[i].msg_hdr.msg_iovlen = 1;
+		rec->msgs[i].msg_hdr.msg_name = rec->sa;
+		rec->msgs[i].msg_hdr.msg_namelen = rec->salen;
+	}
+}
+
+static void store_network(struct record_data *rec)
+{
+	unsigned int i;
+	int err, sk;
+
+	sk = net_socket(rec->server, rec->port, &rec->sa, &rec->salen);
+
+	err = fcntl(sk, F_SETFL, O_NONBLOCK, 1);
+	if (err < 0)
+		err_handler(errno, "fcntl");
+
+	rec->sk = sk;
+	store_network_setup(rec);
+	store_loop(rec, store_network_samples, store_network_flush);
+
+	/* The partially filled packets, marked as the last ones */
+	for (i = 0; i < num_threads; i++)
+		store_network_queue(rec, i, JD_PACKET_LAST);
+	store_network_flush(rec);
+
+	close(sk);
+	free(rec->iov);
+	free(rec->msgs);
+	free(rec->queue);
+	free(rec->open);
+	free(rec->sa);
+}
+
+/* Keeps the I/O thread off the measured CPUs if there are others */
+static void io_thread_attr(pthread_attr_t *attr, int verbose)
+{
+	cpu_set_t allowed, mask;
+	int err;
+
+	pthread_attr_init(attr);
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		err_handler(errno, "sched_getaffinity()");
+	CPU_XOR(&mask, &allowed, &affinity);
+	CPU_AND(&mask, &mask, &allowed);
+	if (!CPU_COUNT(&mask)) {
+		if (verbose)
+			printf("io thread: no free CPU, sharing the measured ones\n");
+		return;
+	}
+
+	err = pthread_attr_setaffinity_np(attr, sizeof(mask), &mask);
+	if (err)
+		err_handler(err, "pthread_attr_setaffinity_np()");
+
+	if (verbose) {
+		printf("io thread affinity: ");
+		cpuset_fprint(stdout, &mask);
+		printf("\n");
+	}
+}
+
+/*
+ * With --mmap the workers write into the sample files themselves,
+ * this thread only replaces the windows they have filled up.
+ */
+static void *map_samples(void *arg)
+{
+	struct timespec timeout = { 0, STORE_TIMEOUT_MS * 1000000 };
+	struct stats **s = arg;
+	unsigned int i;
+
+	while (!READ_ONCE(mmap_done)) {
+		for (i = 0; i < num_threads; i++)
+			sample_file_service(s[i]->sf);
+
+		jd_futex_wait(&rb_doorbell, &timeout);
+	}
+
+	return NULL;
+}
+
+static void *store_samples(void *arg)
+{
+	struct record_data *rec = arg;
+	if (rec->bw)
+		store_file(rec);
+	else
+		store_network(rec);
+
+	return NULL;
+}
+
+/* Non empty buckets of ws, counts above 32 bit are split */
+static unsigned int window_buckets(struct window_data *wd,
+				   struct window_stats *ws)
+{
+	struct histogram *h = ws->hist;
+	unsigned int i, n = 0;
+	uint64_t c;
+
+	for (i = 0; i < h->size; i++) {
+		for (c = h->buckets[i]; c; c -= wd->buckets[n++].count) {
+			if (n == wd->max_buckets) {
+				wd->max_buckets = wd->max_buckets ?
+					wd->max_buckets * 2 : 256;
+				wd->buckets = realloc(wd->buckets,
+						      wd->max_buckets *
+						      sizeof(*wd->buckets));
+				if (!wd->buckets)
+					err_handler(ENOMEM, "realloc()");
+			}
+			wd->buckets[n].idx = i;
+			wd->buckets[n].count = c > UINT32_MAX ? UINT32_MAX : c;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Sends the histogram of a window, split into as many packets as
+ * needed. The first pass only counts the packets.
+ */
+static void window_send(struct window_data *wd, unsigned int cpu,
+			struct window_stats *ws, uint64_t start, uint64_t end,
+			int last)
+{
+	union {
+		struct jd_hist_header hdr;
+		uint8_t data[JD_HIST_PACKET_SIZE];
+	} pkt;
+	struct jd_hist_header *h = &pkt.hdr;
+	unsigned int nr_buckets, b, o, nb, no, room, pass;
+	size_t len;
+
+	nr_buckets = window_buckets(wd, ws);
+
+	memset(h, 0, sizeof(*h));
+	h->magic = JD_HIST_MAGIC;
+	h->version = JD_HIST_VERSION;
+	h->flags = last ? JD_HIST_LAST : 0;
+	h->sender = wd->sender;
+	h->cpuid = cpu;
+	h->cpu = wd->stats[cpu]->affinity;
+	h->resolution_ns = interval_resolution;
+	h->seq = wd->win_seq[cpu];
+	h->start_ns = start;
+	h->length_ns = end - start;
+	h->realtime_ns = start + wd->realtime_offset;
+	h->max_value = ws->hist->max_value;
+	h->digits = ws->hist->digits;
+
+	for (pass = 0; pass < 2; pass++) {
+		b = o = 0;
+		h->part = 0;
+		do {
+			room = JD_HIST_PACKET_SIZE - sizeof(*h);
+			nb = nr_buckets - b;
+			if (nb > room / sizeof(struct jd_hist_bucket))
+				nb = room / sizeof(struct jd_hist_bucket);
+			room -= nb * sizeof(struct jd_hist_bucket);
+			no = ws->nr_outliers - o;
+			if (no > room / sizeof(struct jd_hist_outlier))
+				no = room / sizeof(struct jd_hist_outlier);
+
+			if (pass) {
+				h->nr_buckets = nb;
+				h->nr_outliers = no;
+				len = sizeof(*h);
+				memcpy(pkt.data + len, wd->buckets + b,
+				       nb * sizeof(struct jd_hist_bucket));
+				len += nb * sizeof(struct jd_hist_bucket);
+				memcpy(pkt.data + len, ws->outliers + o,
+				       no * sizeof(struct jd_hist_outlier));
+				len += no * sizeof(struct jd_hist_outlier);
+
+				if (send(wd->sk, pkt.data, len, 0) < 0) {
+					if (!wd->send_errors)
+						warn_handler("send() failed: %s",
+							     strerror(errno));
+					wd->send_errors++;
+				} else {
+					wd->packets_sent++;
+				}
+
+				/* The counters are only sent once */
+				if (!h->part) {
+					h->count = 0;
+					h->total = 0;
+					h->min = 0;
+					h->max = 0;
+					h->overflow = 0;
+					h->outliers_dropped = 0;
+				}
+			}
+
+			b += nb;
+			o += no;
+			h->part++;
+		} while (b < nr_buckets || o < ws->nr_outliers);
+
+		h->nr_parts = h->part;
+		h->count = ws->count;
+		h->total = ws->total;
+		h->min = ws->count ? ws->min : 0;
+		h->max = ws->max;
+		h->overflow = ws->hist->overflow;
+		h->outliers_dropped = ws->outliers_dropped;
+	}
+
+}
+
+/* Appends one line per window to windows.jsonl */
+static void window_log(struct window_data *wd, unsigned int cpu,
+		       struct window_stats *ws, uint64_t start, uint64_t end)
+{
+	struct histogram *h = ws->hist;
+	FILE *f = wd->log;
+	uint64_t real = start + wd->realtime_offset;
+	uint64_t pval[MAX_PERCENTILES];
+	unsigned int i, comma;
+
+	fprintf(f, "{\"type\": \"window\", \"thread\": %u, \"cpu\": %u, "
+		"\"group\": ", cpu, wd->stats[cpu]->affinity);
+	jd_json_fputs(f, wd->stats[cpu]->group->name);
+	fprintf(f, ", \"seq\": %" PRIu64 ", ", wd->win_seq[cpu]);
+	fprintf(f, "\"start\": %" PRIu64 ".%09" PRIu64 ", "
+		"\"start_ns\": %" PRIu64 ", \"length_ns\": %" PRIu64 ", ",
+		real / NSEC_PER_SEC, real % NSEC_PER_SEC, start, end - start);
+	fprintf(f, "\"count\": %" PRIu64 ", \"min\": %" PRIu64 ", "
+		"\"avg\": %.2f, \"max\": %" PRIu64 ", "
+		"\"overflow\": %" PRIu64 ", ",
+		ws->count, ws->count ? ws->min : 0,
+		ws->count ? (double)ws->total / ws->count : 0.0,
+		ws->max, h->overflow);
+
+	histogram_percentiles(h, percentiles, pval, num_percentiles);
+	fprintf(f, "\"percentiles\": {");
+	for (i = 0; i < num_percentiles; i++)
+		fprintf(f, "%s\"%g\": %" PRIu64, i ? ", " : "",
+			percentiles[i], pval[i]);
+	fprintf(f, "}, ");
+
+	fprintf(f, "\"histogram\": {");
+	for (i = 0, comma = 0; i < h->size; i++) {
+		if (!h->buckets[i])
+			continue;
+		fprintf(f, "%s\"%" PRIu64 "\": %" PRIu64, comma ? ", " : "",
+			histogram_bucket_low(h, i), h->buckets[i]);
+		comma = 1;
+	}
+	fprintf(f, "}, ");
+
+	fprintf(f, "\"outliers\": [");
+	for (i = 0; i < ws->nr_outliers; i++)
+		fprintf(f, "%s[%" PRIu64 ", %" PRIu64 "]", i ? ", " : "",
+			ws->outliers[i].ts, ws->outliers[i].val);
+	fprintf(f, "], \"outliers_dropped\": %u}\n", ws->outliers_dropped);
+}
+
+/* Hands a closed window to all consumers */
+static void window_emit(struct window_data *wd, unsigned int cpu,
+			struct window_stats *ws, uint64_t end, int last)
+{
+	struct window_summary *sum = &wd->last[cpu];
+	uint64_t start = wd->win_start[cpu];
+
+	if (wd->log)
+		window_log(wd, cpu, ws, start, end);
+	if (wd->server)
+		window_send(wd, cpu, ws, start, end, last);
+
+	pthread_mutex_lock(&wd->lock);
+	sum->count = ws->count;
+	sum->total = ws->total;
+	sum->min = ws->min;
+	sum->max = ws->max;
+	sum->p99 = ws->count ? histogram_percentile(ws->hist, 99) : 0;
+	pthread_mutex_unlock(&wd->lock);
+
+	wd->win_start[cpu] = end;
+	wd->win_seq[cpu]++;
+	wd->windows++;
+}
+
+/*
+ * Picks up the windows the workers have closed. At the end, when the
+ * workers have stopped, the windows still open are handed on as the
+ * last ones.
+ */
+static void window_collect(struct window_data *wd, int final)
+{
+	struct window_stats *ws;
+	struct window *w;
+	unsigned int i;
+
+	for (i = 0; i < num_threads; i++) {
+		w = wd->stats[i]->win;
+
+		ws = window_get(w);
+		if (ws) {
+			window_emit(wd, i, ws,
+				    wd->start_ns + ws->epoch * window_ns, 0);
+			window_put(w, ws);
+		}
+
+		if (final) {
+			ws = window_get_current(w);
+			window_emit(wd, i, ws, clock_monotonic_ns(), 1);
+			window_put(w, ws);
+		}
+	}
+
+	/* A crash loses at most the windows which are still open */
+	if (wd->log)
+		fflush(wd->log);
+}
+
+/*
+ * Advances the window epoch at every window boundary, measured from
+ * the start of the workers, and collects the closed windows at least
+ * every STORE_TIMEOUT_MS.
+ */
+static void *window_thread(void *arg)
+{
+	struct window_data *wd = arg;
+	uint64_t now, next, wake;
+	struct timespec ts;
+
+	next = wd->start_ns + window_ns;
+	while (!READ_ONCE(wd->done)) {
+		now = clock_monotonic_ns();
+		if (now >= next) {
+			WRITE_ONCE(window_epoch,
+				   (now - wd->start_ns) / window_ns);
+			next = wd->start_ns +
+				(window_epoch + 1) * window_ns;
+		}
+
+		window_collect(wd, 0);
+
+		wake = now + STORE_TIMEOUT_MS * 1000000ULL;
+		ts = ns_to_ts(wake < next ? wake : next);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+
+	window_collect(wd, 1);
+
+	return NULL;
+}
+
+static void window_setup(struct window_data *wd, struct stats **s)
+{
+	struct sockaddr *sa;
+	socklen_t salen;
+	struct timespec mono, real;
+	unsigned int i;
+
+	wd->stats = s;
+	wd->win_start = calloc(num_threads, sizeof(*wd->win_start));
+	wd->win_seq = calloc(num_threads, sizeof(*wd->win_seq));
+	wd->last = calloc(num_threads, sizeof(*wd->last));
+	if (!wd->win_start || !wd->win_seq || !wd->last)
+		err_handler(ENOMEM, "calloc()");
+	pthread_mutex_init(&wd->lock, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	wd->start_ns = ts_to_ns(mono);
+	wd->realtime_offset = ts_to_ns(real) - ts_to_ns(mono);
+	for (i = 0; i < num_threads; i++)
+		wd->win_start[i] = wd->start_ns;
+
+	if (wd->log) {
+		fprintf(wd->log, "{\"type\": \"start\", \"version\": 1, "
+			"\"start\": %" PRIu64 ".%09" PRIu64 ", "
+			"\"start_ns\": %" PRIu64 ", \"window_ns\": %" PRIu64
+			", \"threads\": %u, \"resolution_in_ns\": %u, "
+			"\"histogram_digits\": %u}\n",
+			(uint64_t)real.tv_sec, (uint64_t)real.tv_nsec,
+			wd->start_ns, window_ns, num_threads,
+			interval_resolution, hist_digits);
+		fflush(wd->log);
+	}
+
+	/* The window thread may block, it doesn't hold up any worker */
+	if (wd->server) {
+		wd->sk = net_socket(wd->server, wd->port, &sa, &salen);
+		if (connect(wd->sk, sa, salen) < 0)
+			err_handler(errno, "connect()");
+		free(sa);
+	}
+}
+
+static void window_cleanup(struct window_data *wd)
+{
+	if (wd->server)
+		close(wd->sk);
+	if (wd->log)
+		fclose(wd->log);
+	pthread_mutex_destroy(&wd->lock);
+	free(wd->last);
+	free(wd->buckets);
+	free(wd->win_seq);
+	free(wd->win_start);
+}
+
+/* Reads the clock after a wakeup and returns the latency */
+static inline uint64_t sample_read(struct timespec *now, uint64_t *now_tsc,
+				   struct timespec next, uint64_t next_tsc)
+{
+	int err;
+
+	if (use_tsc) {
+		/*
+		 * Only the difference is scaled here, the timestamp
+		 * itself is converted when it is handed to the
+		 * ringbuffer.
+		 */
+		*now_tsc = tsc_read();
+		if (*now_tsc <= next_tsc)
+			return 0;
+		return tsc_conv(&tsc_to_units, *now_tsc - next_tsc);
+	}
+
+	err = clock_gettime(CLOCK_MONOTONIC, now);
+	if (err)
+		err_handler(err, "clock_gettime()");
+
+	return ts_sub(*now, next);
+}
+
+/* CLOCK_MONOTONIC timestamp of a sample in ns */
+static inline uint64_t sample_ts(struct timespec now, uint64_t now_tsc)
+{
+	return use_tsc ? tsc_to_mono(&tsc_cal, now_tsc) : ts_to_ns(now);
+}
+
+/*
+ * Compares the TSC of the worker's CPU against CLOCK_MONOTONIC. The
+ * timestamps and latencies are worthless once it has drifted away.
+ */
+static void __attribute__((noinline)) tsc_drift_check(struct stats *s,
+						       uint64_t now_tsc)
+{
+	int64_t offset, prev;
+
+	s->tsc_check_next = now_tsc + tsc_check_period;
+
+	offset = tsc_offset(&tsc_cal);
+	prev = s->tsc_drift;
+	if (llabs(offset) <= llabs(prev))
+		return;
+	s->tsc_drift = offset;
+
+	if (llabs(offset) > TSC_DRIFT_STOP_NS) {
+		warn_handler("TSC on CPU %u drifted by %" PRId64 " ns, "
+			     "stopping", s->affinity, offset);
+		WRITE_ONCE(jd_shutdown, 1);
+	} else if (llabs(offset) > TSC_DRIFT_WARN_NS &&
+		   llabs(prev) <= TSC_DRIFT_WARN_NS) {
+		warn_handler("TSC on CPU %u drifted by %" PRId64 " ns",
+			     s->affinity, offset);
+	}
+}
+
+/* Accounts a sample, everything the worker does besides waiting */
+static inline void sample_record(struct stats *s, struct timespec now,
+				 uint64_t now_tsc, uint64_t diff)
+{
+	if (diff > s->max)
+		s->max = diff;
+
+	if (diff < s->min)
+		s->min = diff;
+
+	s->count++;
+	s->total += diff;
+	sum_sq_add(&s->sq, diff);
+
+	histogram_add(s->hist, diff);
+	snapshot_publish(s);
+
+	if (use_tsc && now_tsc >= s->tsc_check_next)
+		tsc_drift_check(s, now_tsc);
+
+	if (s->win) {
+		window_tick(s->win);
+		window_add(s->win, diff);
+		if (diff >= outlier_threshold)
+			window_outlier(s->win, sample_ts(now, now_tsc), diff);
+	}
+
+	if (s->rb)
+		ringbuffer_write(s->rb, sample_ts(now, now_tsc), diff);
+	else if (s->sf)
+		sample_file_write(s->sf, sample_ts(now, now_tsc), diff);
+}
+
+/*
+ * Runs the code of the measurement loop back to back without
+ * sleeping. The time between two clock reads is the cost of one
+ * iteration and thus the lower bound of any latency we report.
+ */
+static void calibrate_overhead(struct stats *s)
+{
+	struct stats tmp;
+	struct timespec now, prev;
+	uint64_t now_tsc = 0, prev_tsc = 0;
+	uint64_t diff, gap;
+	unsigned int i;
+
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.min = UINT64_MAX;
+	tmp.tsc_check_next = UINT64_MAX;
+	tmp.rb = s->rb;
+	tmp.hist = histogram_create(hist_digits,
+				NSEC_PER_SEC / interval_resolution);
+	s->overhead = histogram_create(hist_digits, NSEC_PER_SEC);
+	if (!tmp.hist || !s->overhead)
+		err_handler(ENOMEM, "histogram_create()");
+
+	s->overhead_min = UINT64_MAX;
+
+	clock_gettime(CLOCK_MONOTONIC, &prev);
+	if (use_tsc)
+		prev_tsc = tsc_read();
+
+	for (i = 0; i < CALIBRATION_LOOPS; i++) {
+		diff = sample_read(&now, &now_tsc, prev, prev_tsc);
+		sample_record(&tmp, now, now_tsc, diff);
+
+		if (use_tsc)
+			gap = tsc_conv(&tsc_cal.to_ns, now_tsc - prev_tsc);
+		else
+			gap = ts_to_ns(now) - ts_to_ns(prev);
+
+		histogram_add(s->overhead, gap);
+		if (gap < s->overhead_min)
+			s->overhead_min = gap;
+		if (gap > s->overhead_max)
+			s->overhead_max = gap;
+		s->overhead_total += gap;
+
+		prev = now;
+		prev_tsc = now_tsc;
+	}
+
+	s->overhead_floor = s->overhead_min / interval_resolution;
+
+	/* Drop the samples written during calibration */
+	if (s->rb)
+		ringbuffer_reset(s->rb);
+	histogram_free(tmp.hist);
+}
+
+/*
+ * Common setup of all workers, returns the worker's stats when the
+ * measurement starts.
+ */
+static struct stats *worker_setup(struct worker_init *init,
+				  struct timer *timer)
+{
+	struct stats *s;
+	sigset_t mask;
+
+	/* Don't handle any signals */
+	sigfillset(&mask);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+		err_handler(errno, "sigprocmask()");
+
+	/*
+	 * The thread is already pinned (see start_worker()), so the
+	 * first touch places all memory on the local node, including
+	 * the stats entry itself.
+	 */
+	s = aligned_alloc(JD_CACHELINE_SIZE, sizeof(*s));
+	if (!s)
+		err_handler(errno, "aligned_alloc()");
+	memset(s, 0, sizeof(*s));
+
+	s->pid = pthread_self();
+	s->tid = __gettid();
+	s->id = init->id;
+	s->affinity = init->affinity;
+	s->group = init->group;
+	s->timer = init->timer;
+	s->min = UINT64_MAX;
+	s->snap.min = UINT64_MAX;
+	s->node = jd_cpu_node();
+	s->rb_node = -1;
+	*init->stats = s;
+
+	/* Latencies above one second go into the overflow bucket */
+	s->hist = histogram_create(hist_digits,
+				NSEC_PER_SEC / interval_resolution);
+	if (!s->hist)
+		err_handler(ENOMEM, "histogram_create()");
+	s->hist_node = jd_mem_node(s->hist->buckets);
+
+	if (ringbuffer_size) {
+		s->rb = ringbuffer_create(ringbuffer_size);
+		if (!s->rb)
+			err_handler(ENOMEM, "ringbuffer_create()");
+		s->rb_node = ringbuffer_mem_node(s->rb);
+		ringbuffer_set_doorbell(s->rb, &rb_doorbell,
+					ringbuffer_size / RB_WATERMARK_DIV);
+	}
+
+	if (window_ns) {
+		s->win = window_create(hist_digits,
+				       NSEC_PER_SEC / interval_resolution,
+				       &window_epoch);
+		if (!s->win)
+			err_handler(ENOMEM, "window_create()");
+	}
+
+	if (mmap_dir) {
+		s->sf = sample_file_open(mmap_dir, s->id, num_threads,
+					 MMAP_WINDOW, &rb_doorbell);
+		if (!s->sf)
+			err_handler(errno, "Could not create samples.%u.raw",
+				    s->id);
+		s->rb_node = jd_mem_node(s->sf->cur);
+	}
+
+	/* The hwlat detector reads the clock itself, it has no timer */
+	if (s->group->mode != MODE_HWLAT)
+		timer_init(timer, s->timer);
+
+	if (use_tsc) {
+		s->tsc_offset = tsc_offset(&tsc_cal);
+		if (llabs(s->tsc_offset) > TSC_DRIFT_WARN_NS)
+			warn_handler("TSC on CPU %u is off by %" PRId64 " ns",
+				     s->affinity, s->tsc_offset);
+		s->tsc_drift = s->tsc_offset;
+	}
+
+	if (s->group->mode != MODE_HWLAT)
+		calibrate_overhead(s);
+
+	if (use_tsc)
+		s->tsc_check_next = tsc_read() + tsc_check_period;
+
+	pthread_barrier_wait(&start_barrier);
+
+	return s;
+}
+
+static void *worker(void *arg)
+{
+	struct stats *s;
+	struct timespec now, next, interval;
+	struct timer timer;
+	uint64_t now_tsc = 0, next_tsc = 0;
+	uint64_t diff;
+	int err;
+
+	s = worker_setup(arg, &timer);
+
+	interval.tv_sec = 0;
+	interval.tv_nsec = s->group->interval_us * NSEC_PER_US;
+
+	err = clock_gettime(CLOCK_MONOTONIC, &now);
+	if (err)
+		err_handler(err, "clock_gettime()");
+
+	next = now;
+
+	while (!READ_ONCE(jd_shutdown)) {
+		next = ts_add(next, interval);
+
+		if (use_tsc)
+			next_tsc = tsc_from_mono(&tsc_cal, ts_to_ns(next));
+
+		timer_wait(&timer, &next);
+
+		diff = sample_read(&now, &now_tsc, next, next_tsc);
+		if (subtract_overhead)
+			diff -= diff < s->overhead_floor ?
+				diff : s->overhead_floor;
+
+		sample_record(s, now, now_tsc, diff);
+
+		if (diff > break_val) {
+			stop_tracer(diff);
+			WRITE_ONCE(jd_shutdown, 1);
+		}
+
+		if (max_loops > 0 && s->count >= max_loops)
+			break;
+	}
+
+	timer_cleanup(&timer);
+
+	return NULL;
+}
+
+/*
+ * Detects hardware and firmware induced stalls (e.g. SMIs) the way the
+ * kernel's hwlat tracer does, but with interrupts enabled: the clock
+ * is read in a tight loop and every gap between two reads above
+ * hwlat_threshold is recorded. The sample timestamp is the start of
+ * the gap.
+ */
+static void *hwlat_worker(void *arg)
 {
-	unsigned int i;
+	struct stats *s;
+	struct timespec start, window, ts = { 0, 0 };
+	uint64_t now, prev, end, gap, threshold;
+	uint64_t spin, diff;
 
-	for (i = 0; i < num_threads; i++) {
-		printf("T:%2u (%5lu) A:%2u C:%10" PRIu64
-			" Min:%10" PRIu64 " Avg:%8.2f Max:%10" PRIu64 " "
-			VT100_ERASE_EOL "\n",
-			i, (long)s[i].tid, s[i].affinity,
-			s[i].count,
-			s[i].min,
-			(double) s[i].total / (double) s[i].count,
-			s[i].max);
-	}
-}
+	s = worker_setup(arg, NULL);
 
-static void *display_stats(void *arg)
-{
-	struct stats *s = arg;
-	unsigned int i;
+	/* Compare in raw clock units, only detected gaps are converted */
+	threshold = hwlat_threshold * interval_resolution;
+	if (use_tsc)
+		threshold = tsc_conv(&tsc_cal.from_ns, threshold);
 
-	for (i = 0; i < num_threads; i++)
-		printf("\n");
+	window.tv_sec = HWLAT_WINDOW / 1000;
+	window.tv_nsec = (HWLAT_WINDOW % 1000) * 1000000;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	while (!READ_ONCE(jd_shutdown)) {
-		printf(VT100_CURSOR_UP, num_threads);
+		end = ts_to_ns(start) + HWLAT_WIDTH * 1000000ULL;
+		if (use_tsc)
+			end = tsc_from_mono(&tsc_cal, end);
+
+		spin = clock_monotonic_ns();
+		prev = use_tsc ? tsc_read() : spin;
+		do {
+			now = use_tsc ? tsc_read() : clock_monotonic_ns();
+			gap = now - prev;
+
+			if (gap > threshold) {
+				if (use_tsc) {
+					diff = tsc_conv(&tsc_to_units, gap);
+				} else {
+					diff = gap / interval_resolution;
+					ts = ns_to_ts(prev);
+				}
+				sample_record(s, ts, prev, diff);
+
+				if (diff > break_val) {
+					stop_tracer(diff);
+					WRITE_ONCE(jd_shutdown, 1);
+				}
+			}
 
-		__display_stats(s);
+			prev = now;
+		} while (now < end && !READ_ONCE(jd_shutdown));
 
-		fflush(stdout);
-		usleep(100 * 1000); /* 100 ms interval */
+		s->spin_time += clock_monotonic_ns() - spin;
+
+		/* Gaps are rare, don't let a window wait for one */
+		if (s->win)
+			window_tick(s->win);
+
+		start = ts_add(start, window);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &start, NULL);
 	}
 
 	return NULL;
 }
 
-static void store_file(struct record_data *rec)
+/* Number of periods used to find the period boundaries */
+#define DL_GRID_PERIODS		16
+
+/* CLOCK_MONOTONIC in ns from the clock the samples are taken with */
+static inline uint64_t sample_now(void)
 {
-	struct stats *s = rec->stats;
-	struct latency_sample sample;
 	struct timespec ts;
-	uint64_t val;
-	unsigned int i;
 
-	while (!READ_ONCE(jd_shutdown)) {
-		for (i = 0; i < num_threads; i++) {
-			sample.cpuid = i;
-			while (!ringbuffer_read(s[i].rb, &ts, &val)) {
-				memcpy(&sample.ts, &ts, sizeof(sample.ts));
-				memcpy(&sample.val, &val, sizeof(sample.val));
-				fwrite(&sample, sizeof(struct latency_sample), 1, rec->fd);
-			}
-		}
+	if (use_tsc)
+		return tsc_to_mono(&tsc_cal, tsc_read());
 
-		usleep(DEFAULT_INTERVAL);
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts_to_ns(ts);
 }
 
-static void store_network(struct record_data *rec)
+/*
+ * Runs with a SCHED_DEADLINE reservation with period and deadline set
+ * to the interval. sched_yield() gives up the remaining runtime and
+ * the thread is woken up at the start of the next period.
+ *
+ * The kernel keeps the periods on a fixed grid from the first
+ * sched_yield() on. The grid is taken from the earliest of the first
+ * DL_GRID_PERIODS wakeups and is only ever moved if a wakeup is seen
+ * before its boundary. The latency is the full delay from the boundary
+ * the thread asked for, a wakeup in a later period is counted in
+ * dl_missed but not folded back into the period. A period in which
+ * the thread ran longer than its runtime is counted in dl_throttled.
+ */
+static void *deadline_worker(void *arg)
 {
-	struct latency_sample sp[SAMPLES_PER_PACKET];
-	struct addrinfo hints, *res, *tmp;
-	struct sockaddr *sa;
-	socklen_t salen;
-	int err, sk, len;
-	unsigned int i, c;
-	struct stats *s = rec->stats;
-	struct timespec ts;
-	uint64_t val;
-
-	bzero(&hints, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_DGRAM;
-	hints.ai_protocol = IPPROTO_UDP;
+	struct stats *s;
+	struct sched_attr attr;
+	struct timespec now, next;
+	struct timer timer;
+	uint64_t now_tsc = 0, next_tsc = 0;
+	uint64_t diff, period_ns, runtime_ns, origin, boundary, t, k;
+	int err;
 
-	err = getaddrinfo(rec->server, rec->port, &hints, &res);
-	if (err < 0)
-		err_handler(err, "getaddrinfo()");
+	s = worker_setup(arg, &timer);
+
+	period_ns = (uint64_t)s->group->interval_us * NSEC_PER_US;
+	runtime_ns = (uint64_t)s->group->dl_runtime_us * NSEC_PER_US;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.sched_policy = SCHED_DEADLINE;
+	attr.sched_flags = SCHED_FLAG_DL_OVERRUN;
+	attr.sched_runtime = runtime_ns;
+	attr.sched_deadline = period_ns;
+	attr.sched_period = period_ns;
+
+	if (syscall(SYS_sched_setattr, 0, &attr, 0) < 0) {
+		err = errno;
+		if (err == EPERM || err == EBUSY)
+			fprintf(stderr, "SCHED_DEADLINE admission failed. "
+				"Pinned deadline tasks need an exclusive "
+				"cpuset or sched_rt_runtime_us set to -1\n");
+		err_handler(err, "sched_setattr()");
+	}
 
-	tmp = res;
-	do {
-		sk = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if (sk >= 0)
-			break;
-		res = res->ai_next;
-	} while (res);
-	if (sk < 0)
-		err_handler(ENOENT, "no server");
+	/* Start at a period boundary and find the grid */
+	sched_yield();
+	origin = sample_now();
+	for (k = 1; k < DL_GRID_PERIODS && !READ_ONCE(jd_shutdown); k++) {
+		sched_yield();
+		t = sample_now() - k * period_ns;
+		if (t < origin)
+			origin = t;
+	}
+	k--;
 
-	sa = malloc(res->ai_addrlen);
-	memcpy(sa, res->ai_addr, res->ai_addrlen);
-	salen = res->ai_addrlen;
+	while (!READ_ONCE(jd_shutdown)) {
+		k++;
+		boundary = origin + k * period_ns;
+		next = ns_to_ts(boundary);
+
+		if (use_tsc)
+			next_tsc = tsc_from_mono(&tsc_cal, boundary);
+
+		sched_yield();
+
+		diff = sample_read(&now, &now_tsc, next, next_tsc);
+		t = sample_ts(now, now_tsc);
+
+		if (t < boundary) {
+			/* The grid is earlier than we thought */
+			origin -= boundary - t;
+			diff = 0;
+		} else if (t - boundary >= period_ns) {
+			/* Woken up in a later period */
+			s->dl_missed += (t - boundary) / period_ns;
+			k += (t - boundary) / period_ns;
+		}
 
-	freeaddrinfo(tmp);
+		if (subtract_overhead)
+			diff -= diff < s->overhead_floor ?
+				diff : s->overhead_floor;
 
-	err = fcntl(sk, F_SETFL, O_NONBLOCK, 1);
-	if (err < 0)
-		err_handler(errno, "fcntl");
+		sample_record(s, now, now_tsc, diff);
 
-	c = 0;
-	while (!READ_ONCE(jd_shutdown)) {
-		for (i = 0; i < num_threads; i++) {
-			while (!ringbuffer_read(s[i].rb, &ts, &val)) {
-				sp[c].cpuid = i;
-				memcpy(&sp[c].ts, &ts, sizeof(sp[c].ts));
-				memcpy(&sp[c].val, &val, sizeof(sp[c].val));
-				if (c == SAMPLES_PER_PACKET - 1) {
-					len = sendto(sk, (const void *)sp, sizeof(sp), 0,
-						sa, salen);
-					if (len < 0)
-						perror("sendto");
-					c = 0;
-				} else
-					c++;
-			}
+		if (diff > break_val) {
+			stop_tracer(diff);
+			WRITE_ONCE(jd_shutdown, 1);
 		}
 
-		usleep(DEFAULT_INTERVAL);
-	}
+		if (max_loops > 0 && s->count >= max_loops)
+			break;
 
-	close(sk);
-}
+		/* The reservation is throttled once the runtime is used up */
+		if (sample_now() - t > runtime_ns)
+			s->dl_throttled++;
+	}
 
-static void *store_samples(void *arg)
-{
-	struct record_data *rec = arg;
-	if (rec->fd)
-		store_file(rec);
-	else
-		store_network(rec);
+	timer_cleanup(&timer);
 
 	return NULL;
 }
 
-static void *worker(void *arg)
+static void start_worker(struct worker_init *init, pthread_attr_t *attr)
 {
-	struct stats *s = arg;
-	struct timespec now, next, interval;
-	sigset_t mask;
-	uint64_t diff;
+	struct group *g = init->group;
+	void *(*fn)(void *);
+	struct sched_param sched;
+	pthread_t pid;
+	cpu_set_t mask;
 	int err;
 
-	/* Don't handle any signals */
-	sigfillset(&mask);
-	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
-		err_handler(errno, "sigprocmask()");
+	CPU_ZERO(&mask);
+	CPU_SET(init->affinity, &mask);
 
-	s->tid = __gettid();
+	err = pthread_attr_setaffinity_np(attr, sizeof(mask), &mask);
+	if (err)
+		err_handler(err, "pthread_attr_setaffinity_np()");
 
-	interval.tv_sec = 0;
-	interval.tv_nsec = sleep_interval_us * NSEC_PER_US;
+	/*
+	 * Deadline workers switch to SCHED_DEADLINE themselves,
+	 * it can't be set through the thread attributes.
+	 */
+	if (g->mode == MODE_DEADLINE) {
+		err = pthread_attr_setschedpolicy(attr, SCHED_OTHER);
+		sched.sched_priority = 0;
+	} else {
+		err = pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+		sched.sched_priority = g->priority;
+	}
+	if (err)
+		err_handler(err, "pthread_attr_setschedpolicy()");
 
-	err = clock_gettime(CLOCK_MONOTONIC, &now);
+	err = pthread_attr_setschedparam(attr, &sched);
 	if (err)
-		err_handler(err, "clock_gettime()");
+		err_handler(err, "pthread_attr_setschedparam()");
 
-	next = now;
+	err = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+	if (err)
+		err_handler(err, "pthread_attr_setinheritsched()");
 
-	while (!READ_ONCE(jd_shutdown)) {
-		next = ts_add(next, interval);
+	if (g->mode == MODE_HWLAT)
+		fn = hwlat_worker;
+	else if (g->mode == MODE_DEADLINE)
+		fn = deadline_worker;
+	else
+		fn = worker;
+
+	err = pthread_create(&pid, attr, fn, init);
+	if (err) {
+		if (err == EPERM)
+			fprintf(stderr, "No permission to set the "
+				"scheduling policy and/or priority\n");
+		else if (err == EINVAL)
+			fprintf(stderr, "Invalid settings in thread attributes. "
+				"Check your affinity mask\n");
+		err_handler(err, "pthread_create()");
+	}
+}
 
-		err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
-					&next, NULL);
-		if (err)
-			err_handler(err, "clock_nanosleep()");
+static void start_measuring(struct stats **s, struct record_data *rec)
+{
+	struct worker_init *init;
+	pthread_attr_t attr;
+	unsigned int i, g, cpu, n, t;
+	struct group *grp;
+	int err;
 
-		err = clock_gettime(CLOCK_MONOTONIC, &now);
-		if (err)
-			err_handler(err, "clock_gettime()");
+	if (rec)
+		ringbuffer_size = 1024 * 1024;
+
+	init = calloc(num_threads, sizeof(*init));
+	if (!init)
+		err_handler(ENOMEM, "calloc()");
+
+	err = pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+	if (err)
+		err_handler(err, "pthread_barrier_init()");
+
+	pthread_attr_init(&attr);
 
-		/* Update the statistics */
-		diff = ts_sub(now, next);
-		if (diff > s->max)
-			s->max = diff;
+	for (g = 0, i = 0; g < num_groups; g++) {
+		grp = &groups[g];
+		grp->first = i;
 
-		if (diff < s->min)
-			s->min = diff;
+		for (cpu = 0, n = 0; n < (unsigned) CPU_COUNT(&grp->cpus); cpu++) {
+			if (!CPU_ISSET(cpu, &grp->cpus))
+				continue;
+			n++;
+
+			for (t = 0; t < grp->threads; t++, i++) {
+				init[i].stats = &s[i];
+				init[i].group = grp;
+				/* Backends are handed out round robin */
+				init[i].timer = grp->timers[(i - grp->first) %
+							    grp->num_timers];
+				init[i].affinity = cpu;
+				init[i].id = i;
+				start_worker(&init[i], &attr);
+			}
+		}
 
-		s->count++;
-		s->total += diff;
+		grp->count = i - grp->first;
+	}
 
-		if (diff < s->hist_size)
-			s->hist[diff]++;
+	pthread_attr_destroy(&attr);
 
-		if (s->rb)
-			ringbuffer_write(s->rb, now, diff);
+	/* Wait until all workers have set up their buffers, all groups
+	 * start at the same time */
+	pthread_barrier_wait(&start_barrier);
+	pthread_barrier_destroy(&start_barrier);
+	free(init);
+}
 
-		if (diff > break_val) {
-			stop_tracer(diff);
-			WRITE_ONCE(jd_shutdown, 1);
+static void group_parse_timers(struct group *g, const char *list)
+{
+	char *tmp, *str, *saveptr;
+
+	g->timers = NULL;
+	g->num_timers = 0;
+
+	tmp = jd_strdup(list);
+	for (str = strtok_r(tmp, ",", &saveptr); str;
+	     str = strtok_r(NULL, ",", &saveptr)) {
+		g->timers = realloc(g->timers,
+				(g->num_timers + 1) * sizeof(*g->timers));
+		if (!g->timers)
+			err_handler(ENOMEM, "realloc()");
+		g->timers[g->num_timers] = timer_ops_find(str);
+		if (!g->timers[g->num_timers])
+			err_abort("Invalid value for timer. Valid values are "
+				  "nanosleep, timerfd, signal and busy\n");
+		g->num_timers++;
+	}
+	free(tmp);
+
+	if (!g->num_timers)
+		err_abort("No timer given\n");
+}
+
+/*
+ * Parses a group specification, e.g.
+ *   name=isolated:cpus=2-3:interval=100:priority=90:threads=2
+ * Keys which are not given are taken from the command line options.
+ */
+static void group_parse(struct group *g, char *spec, const char *timer)
+{
+	char *key, *val, *saveptr;
+	long num;
+
+	memset(g, 0, sizeof(*g));
+	g->cpus = affinity;
+	g->mode = MODE_TIMER;
+	g->policy = sched_policy;
+	g->interval_us = sleep_interval_us;
+	g->priority = priority;
+	g->dl_runtime_us = dl_runtime_us;
+	g->threads = 1;
+
+	for (key = strtok_r(spec, ": \t\n", &saveptr); key;
+	     key = strtok_r(NULL, ": \t\n", &saveptr)) {
+		val = strchr(key, '=');
+		if (!val)
+			err_abort("Invalid group key '%s', expecting key=value\n",
+				  key);
+		*val++ = '\0';
+
+		if (!strcmp(key, "name")) {
+			g->name = jd_strdup(val);
+		} else if (!strcmp(key, "cpus")) {
+			CPU_ZERO(&g->cpus);
+			if (cpuset_parse(&g->cpus, val) < 0)
+				err_abort("Invalid group cpus '%s'\n", val);
+		} else if (!strcmp(key, "interval")) {
+			num = parse_dec(val);
+			if (num < 1)
+				err_abort("Invalid group interval '%s'\n", val);
+			g->interval_us = num;
+		} else if (!strcmp(key, "priority")) {
+			num = parse_dec(val);
+			if (num < 1 || num > 98)
+				err_abort("Invalid group priority '%s'. "
+					  "Valid range is [1..98]\n", val);
+			g->priority = num;
+		} else if (!strcmp(key, "policy")) {
+			if (!strcmp(val, "fifo"))
+				g->policy = SCHED_FIFO;
+			else if (!strcmp(val, "deadline"))
+				g->policy = SCHED_DEADLINE;
+			else
+				err_abort("Invalid group policy '%s'\n", val);
+		} else if (!strcmp(key, "mode")) {
+			if (!strcmp(val, "hwlat"))
+				g->mode = MODE_HWLAT;
+			else if (strcmp(val, "timer"))
+				err_abort("Invalid group mode '%s'\n", val);
+		} else if (!strcmp(key, "dl-runtime")) {
+			num = parse_dec(val);
+			if (num < 1)
+				err_abort("Invalid group dl-runtime '%s'\n", val);
+			g->dl_runtime_us = num;
+		} else if (!strcmp(key, "threads")) {
+			num = parse_dec(val);
+			if (num < 1)
+				err_abort("Invalid group threads '%s'\n", val);
+			g->threads = num;
+		} else if (!strcmp(key, "timer")) {
+			timer = val;
+		} else {
+			err_abort("Unknown group key '%s'\n", key);
 		}
+	}
 
-		if (max_loops > 0 && s->count >= max_loops)
-			break;
+	group_parse_timers(g, timer);
+}
+
+/* Checks a parsed group and fills in the derived values */
+static void group_finish(struct group *g, unsigned int idx)
+{
+	if (!g->name) {
+		if (asprintf(&g->name, "group%u", idx) < 0)
+			err_handler(errno, "asprintf()");
 	}
 
-	return NULL;
+	if (!CPU_COUNT(&g->cpus))
+		err_abort("Group %s has no CPUs\n", g->name);
+
+	if (g->mode != MODE_HWLAT && g->policy == SCHED_DEADLINE) {
+		g->mode = MODE_DEADLINE;
+		if (!g->dl_runtime_us)
+			g->dl_runtime_us = g->interval_us / 10;
+		/* The kernel refuses runtimes below 1024 ns */
+		if (g->dl_runtime_us < 2)
+			g->dl_runtime_us = 2;
+		if (g->dl_runtime_us > g->interval_us)
+			err_abort("Group %s: dl-runtime can't be longer than "
+				  "the interval\n", g->name);
+		deadline_used = 1;
+	}
 }
 
-static void start_measuring(struct stats *s, struct record_data *rec)
+static struct group *group_add(void)
 {
-	struct sched_param sched;
-	pthread_attr_t attr;
-	cpu_set_t mask;
-	unsigned int i, t;
-	int err;
+	groups = realloc(groups, (num_groups + 1) * sizeof(*groups));
+	if (!groups)
+		err_handler(ENOMEM, "realloc()");
 
-	pthread_attr_init(&attr);
+	return &groups[num_groups++];
+}
 
-	for (i = 0, t = 0; i < num_threads; i++) {
-		CPU_ZERO(&mask);
+static char **group_specs;
+static unsigned int num_group_specs;
 
-		/*
-		 * Skip unset cores. will not crash as long as
-		 * num_threads <= CPU_COUNT(&affinity)
-		 */
-		while (!CPU_ISSET(t, &affinity))
-			t++;
+static void group_spec_add(char *spec)
+{
+	group_specs = realloc(group_specs,
+			(num_group_specs + 1) * sizeof(*group_specs));
+	if (!group_specs)
+		err_handler(ENOMEM, "realloc()");
+	group_specs[num_group_specs++] = spec;
+}
 
-		CPU_SET(t, &mask);
+/* One group per non empty, non comment line */
+static void job_file_load(const char *path)
+{
+	char *line = NULL, *p;
+	size_t n = 0;
+	FILE *fd;
 
-		/* Don't stay on the same core in next loop */
-		s[i].affinity = t++;
-		s[i].min = UINT64_MAX;
-		s[i].hist_size = NSEC_PER_SEC / interval_resolution / 1000;
-		s[i].hist = calloc(s[i].hist_size, sizeof(uint64_t));
-		if (!s[i].hist)
-			err_handler(errno, "calloc()");
+	fd = fopen(path, "r");
+	if (!fd)
+		err_handler(errno, "Could not open job file '%s'", path);
+
+	while (getline(&line, &n, fd) > 0) {
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+		for (p = line; *p == ' ' || *p == '\t' || *p == '\n'; p++)
+			/* skip whitespace */ ;
+		if (*p)
+			group_spec_add(jd_strdup(p));
+	}
 
-		if (rec) {
-			s[i].rb = ringbuffer_create(1024 * 1024);
-			if (!s[i].rb)
-				err_handler(ENOMEM, "ringbuffer_create()");
-		}
+	free(line);
+	fclose(fd);
+}
 
-		err = pthread_attr_setaffinity_np(&attr, sizeof(mask), &mask);
-		if (err)
-			err_handler(err, "pthread_attr_setaffinity_np()");
+/*
+ * --hwlat isn't limited by sched_getaffinity() like the default
+ * affinity, so an offline CPU would only fail in pthread_create().
+ */
+static void hwlat_check_online(void)
+{
+	cpu_set_t online, cpus;
+	char *buf;
+	int ret;
+
+	ret = sysfs_load_str("/sys/devices/system/cpu/online", &buf);
+	if (ret < 0)
+		err_handler(-ret, "Couldn't read the online CPUs");
+
+	CPU_ZERO(&online);
+	cpuset_parse(&online, buf);
+	free(buf);
+
+	CPU_AND(&cpus, &hwlat_affinity, &online);
+	if (!CPU_EQUAL(&cpus, &hwlat_affinity))
+		err_abort("Invalid value for hwlat. "
+			  "Not all CPUs are online\n");
+}
 
-		err = pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
-		if (err)
-			err_handler(err, "pthread_attr_setschedpolicy()");
+static void setup_groups(const char *timer)
+{
+	struct group *g;
+	cpu_set_t cpus;
+	unsigned int i, j;
+	char spec[16];
+
+	if (num_group_specs) {
+		if (CPU_COUNT(&hwlat_affinity))
+			err_abort("--hwlat can't be combined with --group, "
+				  "use a group with mode=hwlat\n");
+		for (i = 0; i < num_group_specs; i++)
+			group_parse(group_add(), group_specs[i], timer);
+	} else {
+		/* Built from the command line options */
+		CPU_XOR(&cpus, &affinity, &hwlat_affinity);
+		CPU_AND(&cpus, &cpus, &affinity);
+		if (CPU_COUNT(&cpus)) {
+			g = group_add();
+			strcpy(spec, "name=default");
+			group_parse(g, spec, timer);
+			g->cpus = cpus;
+		}
 
-		sched.sched_priority = priority;
-		err = pthread_attr_setschedparam(&attr, &sched);
-		if (err)
-			err_handler(err, "pthread_attr_setschedparam()");
+		if (CPU_COUNT(&hwlat_affinity)) {
+			g = group_add();
+			strcpy(spec, "mode=hwlat");
+			group_parse(g, spec, timer);
+			g->name = jd_strdup("hwlat");
+			g->cpus = hwlat_affinity;
+		}
+	}
 
-		err = pthread_attr_setinheritsched(&attr,
-						PTHREAD_EXPLICIT_SCHED);
-		if (err)
-			err_handler(err, "pthread_attr_setinheritsched()");
+	num_threads = 0;
+	CPU_ZERO(&affinity);
+	for (i = 0; i < num_groups; i++) {
+		group_finish(&groups[i], i);
+		num_threads += CPU_COUNT(&groups[i].cpus) * groups[i].threads;
+		CPU_OR(&affinity, &affinity, &groups[i].cpus);
+	}
 
-		err = pthread_create(&s[i].pid, &attr, &worker, &s[i]);
-		if (err) {
-			if (err == EPERM)
-				fprintf(stderr, "No permission to set the "
-					"scheduling policy and/or priority\n");
-			else if (err == EINVAL)
-				fprintf(stderr, "Invalid settings in thread attributes. "
-					"Check your affinity mask\n");
-			err_handler(err, "pthread_create()");
+	/* The spinning detector starves everything else on its CPUs */
+	for (i = 0; i < num_groups; i++) {
+		if (groups[i].mode != MODE_HWLAT)
+			continue;
+		for (j = 0; j < num_groups; j++) {
+			if (j == i)
+				continue;
+			CPU_AND(&cpus, &groups[i].cpus, &groups[j].cpus);
+			if (CPU_COUNT(&cpus))
+				warn_handler("hwlat group %s shares CPUs with "
+					     "group %s", groups[i].name,
+					     groups[j].name);
 		}
 	}
+}
 
-	pthread_attr_destroy(&attr);
+static void groups_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_groups; i++) {
+		free(groups[i].name);
+		free(groups[i].timers);
+	}
+	free(groups);
+}
+
+/* --tail 50,100,500 */
+static void parse_tails(char *str)
+{
+	char *tok, *saveptr;
+	long int val;
+
+	num_tails = 0;
+	for (tok = strtok_r(str, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		val = parse_dec(tok);
+		if (val <= 0)
+			err_abort("Invalid tail threshold '%s'. "
+				  "Valid range is [1..]\n", tok);
+		if (num_tails == MAX_TAILS)
+			err_abort("Too many tail thresholds, at most %u\n",
+				  MAX_TAILS);
+		if (num_tails && (uint64_t)val <= tails[num_tails - 1])
+			err_abort("Tail thresholds must be ascending\n");
+		tails[num_tails++] = val;
+	}
 }
 
 static struct option long_options[] = {
@@ -480,6 +2803,33 @@ static struct option long_options[] = {
 	{ "break",	required_argument,	0,	'b' },
 	{ "nsec",	no_argument,		0,	'N' },
 	{ "interval",	required_argument,	0,	'i' },
+	{ "digits",	required_argument,	0,	 0  },
+	{ "timer",	required_argument,	0,	 0  },
+	{ "clock",	required_argument,	0,	 0  },
+	{ "subtract-overhead", no_argument,	0,	 0  },
+	{ "hwlat",	required_argument,	0,	 0  },
+	{ "policy",	required_argument,	0,	 0  },
+	{ "dl-runtime",	required_argument,	0,	 0  },
+	{ "hwlat-threshold", required_argument,	0,	 0  },
+	{ "direct-io",	no_argument,		0,	 0  },
+	{ "mmap",	no_argument,		0,	 0  },
+	{ "compress",	no_argument,		0,	 0  },
+	{ "sender-id",	required_argument,	0,	 0  },
+	{ "stream-hist", required_argument,	0,	 0  },
+	{ "window",	required_argument,	0,	 0  },
+	{ "outlier",	required_argument,	0,	 0  },
+	{ "percentiles", required_argument,	0,	 0  },
+	{ "tail",	required_argument,	0,	 0  },
+	{ "baseline",	required_argument,	0,	 0  },
+	{ "regression",	required_argument,	0,	 0  },
+	{ "regression-slack", required_argument, 0,	 0  },
+	{ "ks-alpha",	required_argument,	0,	 0  },
+	{ "ks-min-d",	required_argument,	0,	 0  },
+	{ "allow-missing", no_argument,		0,	 0  },
+	{ "wakeup",	required_argument,	0,	 0  },
+	{ "wakeup-cpus", required_argument,	0,	 0  },
+	{ "group",	required_argument,	0,	 0  },
+	{ "job",	required_argument,	0,	 0  },
 	{ "output",	required_argument,	0,	'o' },
 
 	{ "affinity",	required_argument,	0,	'a' },
@@ -494,7 +2844,7 @@ static void __attribute__((noreturn)) usage(int status)
 	printf("\n");
 	printf("General usage:\n");
 	printf("  -h, --help            Print this help\n");
-	printf("  -v, --verbose         Print live statistics\n");
+	printf("  -v, --verbose         Print live statistics, twice for details\n");
 	printf("      --version         Print version of jitterdebugger\n");
 	printf("  -o, --output DIR      Store collected data into DIR\n");
 	printf("  -c, --command CMD	Execute CMD (workload) in background\n");
@@ -508,8 +2858,60 @@ static void __attribute__((noreturn)) usage(int status)
 	printf("  -N, --nsec            Meassurement in nano seconds\n");
 	printf("  -i, --interval TIME   Sleep interval for sampling threads in microseconds\n");
 	printf("                        or nano seconds (see -N/--nsec)\n");
+	printf("      --digits N        Significant digits of the histogram [%u..%u]. Default: 2\n",
+	       HISTOGRAM_MIN_DIGITS, HISTOGRAM_MAX_DIGITS);
+	printf("      --timer LIST      Wakeup mechanism: nanosleep, timerfd, signal or busy.\n");
+	printf("                        A comma separated list is assigned round robin\n");
+	printf("                        to the threads. Default: nanosleep\n");
+	printf("      --clock CLOCK     Time source for the measurement: monotonic or tsc.\n");
+	printf("                        Default: monotonic\n");
+	printf("      --subtract-overhead\n");
+	printf("                        Subtract the calibrated overhead of the measurement\n");
+	printf("                        loop from all latencies\n");
+	printf("      --hwlat CPUSET    Detect hardware/firmware stalls on CPUSET by busy\n");
+	printf("                        spinning instead of measuring timer wakeups\n");
+	printf("      --hwlat-threshold VALUE\n");
+	printf("                        Smallest gap recorded by --hwlat, in micro or\n");
+	printf("                        nano seconds (see -N/--nsec). Default: 10 us\n");
+	printf("      --wakeup MECH     Measure the wakeup latency between all pairs of CPUs\n");
+	printf("                        instead. MECH is futex, eventfd or condvar.\n");
+	printf("                        -l is the number of wakeups per pair. Default: %u\n",
+	       WAKEUP_LOOPS);
+	printf("      --wakeup-cpus CPUSET\n");
+	printf("                        CPUs of the wakeup matrix. Default: affinity\n");
 	printf("  -n			Send samples to host:port\n");
+	printf("      --stream-hist HOST:PORT\n");
+	printf("                        Send the histogram of every window to HOST:PORT\n");
+	printf("      --window TIME     Report every window of TIME: appended to\n");
+	printf("                        DIR/windows.jsonl, shown with -v and sent with\n");
+	printf("                        --stream-hist. Append 'm', 'h' or 'd' to specify\n");
+	printf("                        minutes, hours or days. Default: %us\n",
+	       WINDOW_DEFAULT);
+	printf("      --outlier VALUE   Send the samples >= VALUE with their window\n");
+	printf("      --percentiles LIST\n");
+	printf("                        Comma separated, ascending percentiles reported in\n");
+	printf("                        results.json, windows.jsonl and with -v.\n");
+	printf("                        Default: 50,90,99,99.9,99.99\n");
+	printf("      --tail LIST       Count the samples >= each latency of the comma\n");
+	printf("                        separated, ascending LIST\n");
+	printf("      --baseline FILE   Compare the run with the results.json FILE (or\n");
+	printf("                        FILE/results.json), exit with 2 on a regression\n");
+	printf("      --regression LIST Comma separated P:PCT, a percentile P may grow by\n");
+	printf("                        at most PCT percent. Default: 99:10,99.99:20\n");
+	printf("      --regression-slack VALUE\n");
+	printf("                        Percentiles may also grow by VALUE. Default: 0\n");
+	printf("      --ks-alpha ALPHA  Significance of the Kolmogorov-Smirnov test,\n");
+	printf("                        0 disables it. Default: 0.001\n");
+	printf("      --ks-min-d D      Smallest KS distance D+ counted as regression.\n");
+	printf("                        Default: 0.05\n");
+	printf("      --allow-missing   CPUs of the baseline may be missing in the run\n");
+	printf("      --sender-id ID    Identify the -n and --stream-hist streams with ID.\n");
+	printf("                        Default: PID\n");
 	printf("  -s			Store samples into --output DIR\n");
+	printf("      --direct-io       Write the samples with O_DIRECT, bypassing the page cache\n");
+	printf("      --mmap            With -s, every thread writes its samples directly into\n");
+	printf("                        a memory mapped DIR/samples.N.raw\n");
+	printf("      --compress        With -s, write the compressed DIR/samples.jdc\n");
 	printf("\n");
 	printf("Threads: \n");
 	printf("  -a, --affinity CPUSET Core affinity specification\n");
@@ -517,6 +2919,16 @@ static void __attribute__((noreturn)) usage(int status)
 	printf("                        cores on a 8-core system.\n");
 	printf("                        May also be set in hexadecimal with '0x' prefix\n");
 	printf("  -p, --priority PRI    Worker thread priority. [1..98]\n");
+	printf("      --policy POLICY   Scheduling policy of the workers: fifo or deadline.\n");
+	printf("                        deadline uses the interval as period. Default: fifo\n");
+	printf("      --dl-runtime TIME Runtime of the deadline reservation in microseconds\n");
+	printf("                        Default: 10%% of the interval\n");
+	printf("      --group SPEC      Add a measurement group, may be repeated. SPEC is a\n");
+	printf("                        ':' separated list of key=value with the keys name,\n");
+	printf("                        cpus, interval, priority, policy, mode (timer|hwlat),\n");
+	printf("                        threads (per CPU), timer and dl-runtime.\n");
+	printf("                        Unset keys default to the options above\n");
+	printf("      --job FILE        Read group specifications from FILE, one per line\n");
 
 	exit(status);
 }
@@ -526,24 +2938,43 @@ int main(int argc, char *argv[])
 	struct sigaction sa;
 	unsigned int i;
 	int c, fd, err;
-	struct stats *s;
+	struct stats **s;
 	pthread_t pid, iopid;
+	pthread_attr_t attr;
 	cpu_set_t affinity_available, affinity_set;
 	int long_idx;
 	long val;
 	struct record_data *rec = NULL;
+	struct window_data *wd = NULL;
+	struct jd_samples_header *hdr;
+	pthread_t wpid;
 	FILE *rfd = NULL;
 	struct system_info *sysinfo;
+	int64_t tsc_drift = 0;
+	struct jd_compare_params compare;
+	struct jd_dists baseline, run;
+	int ret = 0;
 
 	/* Command line options */
 	unsigned int opt_duration = 0;
 	char *opt_dir = NULL;
 	char *opt_cmd = NULL;
 	char *opt_net = NULL;
+	char *opt_hist = NULL;
+	unsigned int opt_window = 0;
+	char *opt_timer = "nanosleep";
+	const char *fn;
 	int opt_samples = 0;
+	int opt_direct = 0;
+	int opt_mmap = 0;
+	int opt_compress = 0;
+	long opt_sender = -1;
 	int opt_verbose = 0;
+	char *opt_baseline = NULL;
+	char *endptr;
 
 	CPU_ZERO(&affinity_set);
+	jd_compare_init(&compare);
 
 	while (1) {
 		c = getopt_long(argc, argv, "c:n:sp:vD:l:b:Ni:o:a:h", long_options,
@@ -557,6 +2988,152 @@ int main(int argc, char *argv[])
 				printf("jitterdebugger %s\n",
 					JD_VERSION);
 				exit(0);
+			} else if (!strcmp(long_options[long_idx].name, "digits")) {
+				val = parse_dec(optarg);
+				if (val < HISTOGRAM_MIN_DIGITS ||
+				    val > HISTOGRAM_MAX_DIGITS)
+					err_abort("Invalid value for digits. "
+						  "Valid range is [%u..%u]\n",
+						  HISTOGRAM_MIN_DIGITS,
+						  HISTOGRAM_MAX_DIGITS);
+				hist_digits = val;
+			} else if (!strcmp(long_options[long_idx].name, "timer")) {
+				opt_timer = optarg;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "subtract-overhead")) {
+				subtract_overhead = 1;
+			} else if (!strcmp(long_options[long_idx].name, "hwlat")) {
+				val = cpuset_parse(&hwlat_affinity, optarg);
+				if (val < 0)
+					err_abort("Invalid value for hwlat. "
+						  "Valid range is [0..]\n");
+			} else if (!strcmp(long_options[long_idx].name,
+					   "hwlat-threshold")) {
+				val = parse_dec(optarg);
+				if (val <= 0)
+					err_abort("Invalid value for hwlat-threshold. "
+						  "Valid range is [1..]\n");
+				hwlat_threshold = val;
+			} else if (!strcmp(long_options[long_idx].name, "policy")) {
+				if (!strcmp(optarg, "deadline"))
+					sched_policy = SCHED_DEADLINE;
+				else if (!strcmp(optarg, "fifo"))
+					sched_policy = SCHED_FIFO;
+				else
+					err_abort("Invalid value for policy. "
+						  "Valid values are fifo and "
+						  "deadline\n");
+			} else if (!strcmp(long_options[long_idx].name,
+					   "dl-runtime")) {
+				val = parse_dec(optarg);
+				if (val < 1)
+					err_abort("Invalid value for dl-runtime. "
+						  "Valid range is [1..]\n");
+				dl_runtime_us = val;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "direct-io")) {
+				opt_direct = 1;
+			} else if (!strcmp(long_options[long_idx].name, "mmap")) {
+				opt_mmap = 1;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "compress")) {
+				opt_compress = 1;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "sender-id")) {
+				val = parse_dec(optarg);
+				if (val < 0 || val > UINT32_MAX)
+					err_abort("Invalid value for sender-id. "
+						  "Valid range is [0..%u]\n",
+						  UINT32_MAX);
+				opt_sender = val;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "stream-hist")) {
+				opt_hist = optarg;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "window")) {
+				val = parse_time(optarg);
+				if (val <= 0)
+					err_abort("Invalid value for window. "
+						  "Valid postfixes are 'd', "
+						  "'h', 'm', 's'\n");
+				opt_window = val;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "outlier")) {
+				val = parse_dec(optarg);
+				if (val <= 0)
+					err_abort("Invalid value for outlier. "
+						  "Valid range is [1..]\n");
+				outlier_threshold = val;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "percentiles")) {
+				val = parse_percentiles(optarg, percentiles,
+							MAX_PERCENTILES);
+				if (val < 0)
+					err_abort("Invalid value for percentiles. "
+						  "Expected at most %u ascending "
+						  "values in (0..100]\n",
+						  MAX_PERCENTILES);
+				num_percentiles = val;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "tail")) {
+				parse_tails(optarg);
+			} else if (!strcmp(long_options[long_idx].name,
+					   "baseline")) {
+				opt_baseline = optarg;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "regression")) {
+				if (jd_compare_parse_limits(&compare, optarg))
+					err_abort("Invalid value for regression. "
+						  "Expected at most %u P:PCT "
+						  "with ascending P\n",
+						  JD_COMPARE_MAX);
+			} else if (!strcmp(long_options[long_idx].name,
+					   "regression-slack")) {
+				val = parse_dec(optarg);
+				if (val < 0)
+					err_abort("Invalid value for regression-slack. "
+						  "Valid range is [0..]\n");
+				compare.slack = val;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "ks-alpha")) {
+				compare.ks_alpha = strtod(optarg, &endptr);
+				if (*endptr || !(compare.ks_alpha >= 0 &&
+						 compare.ks_alpha < 1))
+					err_abort("Invalid value for ks-alpha. "
+						  "Valid range is [0..1)\n");
+			} else if (!strcmp(long_options[long_idx].name,
+					   "ks-min-d")) {
+				compare.ks_min_d = strtod(optarg, &endptr);
+				if (*endptr || !(compare.ks_min_d >= 0 &&
+						 compare.ks_min_d <= 1))
+					err_abort("Invalid value for ks-min-d. "
+						  "Valid range is [0..1]\n");
+			} else if (!strcmp(long_options[long_idx].name,
+					   "allow-missing")) {
+				compare.allow_missing = 1;
+			} else if (!strcmp(long_options[long_idx].name, "wakeup")) {
+				wakeup_mode = wakeup_ops_find(optarg);
+				if (!wakeup_mode)
+					err_abort("Invalid value for wakeup. "
+						  "Valid values are futex, "
+						  "eventfd and condvar\n");
+			} else if (!strcmp(long_options[long_idx].name,
+					   "wakeup-cpus")) {
+				val = cpuset_parse(&wakeup_affinity, optarg);
+				if (val < 0)
+					err_abort("Invalid value for wakeup-cpus. "
+						  "Valid range is [0..]\n");
+			} else if (!strcmp(long_options[long_idx].name, "group")) {
+				group_spec_add(optarg);
+			} else if (!strcmp(long_options[long_idx].name, "job")) {
+				job_file_load(optarg);
+			} else if (!strcmp(long_options[long_idx].name, "clock")) {
+				if (!strcmp(optarg, "tsc"))
+					use_tsc = 1;
+				else if (strcmp(optarg, "monotonic"))
+					err_abort("Invalid value for clock. "
+						  "Valid values are monotonic "
+						  "and tsc\n");
 			}
 			break;
 		case 'o':
@@ -579,7 +3156,7 @@ int main(int argc, char *argv[])
 			priority = val;
 			break;
 		case 'v':
-			opt_verbose = 1;
+			opt_verbose++;
 			break;
 		case 'D':
 			val = parse_time(optarg);
@@ -645,15 +3222,73 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (wakeup_mode && (opt_net || opt_samples || opt_hist || opt_window))
+		err_abort("Samples are not recorded with --wakeup\n");
+
+	live_details = opt_verbose > 1;
+
+	if (opt_window && !opt_hist && !opt_dir && !opt_verbose)
+		err_abort("--window needs -o, -v or --stream-hist\n");
+
+	if (outlier_threshold != UINT64_MAX && !opt_window && !opt_hist)
+		err_abort("--outlier needs --window or --stream-hist\n");
+
+	if (opt_baseline) {
+		if (wakeup_mode)
+			err_abort("--baseline is not supported with --wakeup\n");
+		err = jd_dists_load(&baseline, opt_baseline);
+		if (err)
+			err_abort("Couldn't read baseline '%s': %s\n",
+				  opt_baseline, strerror(-err));
+	}
+
+	if (opt_window || opt_hist) {
+		wd = calloc(1, sizeof(*wd));
+		if (!wd)
+			err_handler(ENOMEM, "calloc()");
+
+		if (opt_hist) {
+			wd->server = strtok(opt_hist, " :");
+			wd->port = strtok(NULL, " :");
+			if (!wd->server || !wd->port)
+				err_abort("Invalid server name and/or port "
+					  "string\n");
+			wd->sender = opt_sender < 0 ? getpid() : opt_sender;
+		}
+
+		if (opt_dir) {
+			wd->log = jd_fopen(opt_dir, "windows.jsonl", "w");
+			if (!wd->log)
+				err_handler(errno, "Couldn't create windows.jsonl");
+		}
+
+		window_ns = (uint64_t)(opt_window ? opt_window : WINDOW_DEFAULT) *
+			NSEC_PER_SEC;
+		windows = wd;
+	}
+
+	if (opt_compress && !opt_samples)
+		err_abort("--compress needs -s\n");
+
+	if (opt_mmap) {
+		if (!opt_samples || !opt_dir)
+			err_abort("--mmap needs -s and -o\n");
+		/* No ringbuffers and no I/O thread */
+		if (opt_compress)
+			err_abort("--mmap and --compress can't be combined\n");
+		mmap_dir = opt_dir;
+		opt_samples = 0;
+	}
+
 	if (opt_net || opt_samples) {
 		if (opt_net && opt_samples) {
 			fprintf(stdout, "Can't use both options -s or -n together\n");
 			exit(1);
 		}
 
-		rec = malloc(sizeof(*rec));
+		rec = calloc(1, sizeof(*rec));
 		if (!rec)
-			err_handler(ENOMEM, "malloc()");
+			err_handler(ENOMEM, "calloc()");
 
 		if (opt_net) {
 			rec->server = strtok(opt_net, " :");
@@ -663,16 +3298,12 @@ int main(int argc, char *argv[])
 				fprintf(stdout, "Invalid server name and/or port string\n");
 				exit(1);
 			}
+			rec->sender = opt_sender < 0 ? getpid() : opt_sender;
 		}
 
-		if (opt_samples) {
-			if (!opt_dir) {
-				fprintf(stdout, "-o/--output is needed with -s option\n");
-				exit(1);
-			}
-			rec->fd = jd_fopen(opt_dir, "samples.raw", "w");
-			if (!rec->fd)
-				err_handler(errno, "Couldn't create samples.raw file");
+		if (opt_samples && !opt_dir) {
+			fprintf(stdout, "-o/--output is needed with -s option\n");
+			exit(1);
 		}
 	}
 
@@ -718,38 +3349,155 @@ int main(int argc, char *argv[])
 		affinity = affinity_available;
 	}
 
+	/* The hwlat CPUs are always measured */
+	if (CPU_COUNT(&hwlat_affinity))
+		hwlat_check_online();
+	CPU_OR(&affinity, &affinity, &hwlat_affinity);
+	if (!hwlat_threshold)
+		hwlat_threshold = HWLAT_THRESHOLD / interval_resolution;
+
+	if (wakeup_mode) {
+		err = start_workload(opt_cmd);
+		if (err < 0)
+			err_handler(errno, "starting workload failed");
+
+		wakeup_measure(opt_dir, sysinfo);
+
+		stop_workload();
+		if (opt_dir)
+			free_system_info(sysinfo);
+		goto out;
+	}
+
+	setup_groups(opt_timer);
+
+	if (deadline_used) {
+		sa.sa_handler = sigxcpu_handler;
+		if (sigaction(SIGXCPU, &sa, NULL) < 0)
+			err_handler(errno, "sigaction()");
+	}
+
 	if (opt_verbose) {
 		printf("affinity: ");
 		cpuset_fprint(stdout, &affinity);
 		printf("\n");
+		display_groups();
+	}
+
+	if (use_tsc) {
+		if (tsc_check())
+			err_abort("Can't use the TSC as clock\n");
+		tsc_calibrate(&tsc_cal);
+		tsc_conv_init(&tsc_to_units, NSEC_PER_SEC,
+			      tsc_cal.hz * interval_resolution);
+		tsc_check_period = tsc_conv(&tsc_cal.from_ns, TSC_CHECK_NS);
+		if (opt_verbose)
+			printf("tsc: %" PRIu64 " Hz\n", tsc_cal.hz);
 	}
 
-	num_threads = CPU_COUNT(&affinity);
-	s = calloc(num_threads, sizeof(struct stats));
+	/* The entries are allocated by the workers, see worker_setup() */
+	s = calloc(num_threads, sizeof(*s));
 	if (!s)
-		err_handler(errno, "calloc()");
+		err_handler(ENOMEM, "calloc()");
+
+	total_hist = histogram_create(hist_digits,
+				      NSEC_PER_SEC / interval_resolution);
+	if (!total_hist)
+		err_handler(ENOMEM, "histogram_create()");
+
+	/* The flusher needs the final affinity, see io_thread_attr() */
+	if (opt_samples) {
+		fn = opt_compress ? "samples.jdc" : "samples.raw";
+		io_thread_attr(&attr, 0);
+		rec->bw = block_writer_open(opt_dir, fn, opt_direct, &attr);
+		if (!rec->bw)
+			err_handler(errno, "Couldn't create %s file", fn);
+		pthread_attr_destroy(&attr);
+	}
 
 	err = start_workload(opt_cmd);
 	if (err < 0)
 		err_handler(errno, "starting workload failed");
 
 	start_measuring(s, rec);
+	hdr = samples_header_create(s);
+
+	if (mmap_dir) {
+		for (i = 0; i < num_threads; i++)
+			sample_file_write_header(s[i]->sf, hdr);
+
+		io_thread_attr(&attr, opt_verbose);
+		err = pthread_create(&iopid, &attr, map_samples, s);
+		if (err)
+			err_handler(err, "pthread_create()");
+		pthread_attr_destroy(&attr);
+	}
 
 	if (opt_net || opt_samples) {
 		rec->stats = s;
-		err = pthread_create(&iopid, NULL, store_samples, rec);
+		rec->stored = calloc(num_threads, sizeof(*rec->stored));
+		if (!rec->stored)
+			err_handler(ENOMEM, "calloc()");
+		if (opt_samples) {
+			rec->write_dropped = calloc(num_threads,
+					sizeof(*rec->write_dropped));
+			if (!rec->write_dropped)
+				err_handler(ENOMEM, "calloc()");
+		}
+		if (opt_samples && opt_compress) {
+			rec->jdc = jdc_writer_create(hdr, store_jdc_write,
+						     rec->bw);
+			if (!rec->jdc)
+				err_handler(ENOMEM, "jdc_writer_create()");
+		} else if (opt_samples) {
+			block_writer_add(rec->bw, hdr, hdr->header_size);
+			rec->idx = jd_fopen(opt_dir, "samples.idx", "w");
+			if (!rec->idx)
+				err_handler(errno, "Couldn't create samples.idx file");
+			store_index_header(rec);
+		}
+		io_thread_attr(&attr, opt_verbose);
+		err = pthread_create(&iopid, &attr, store_samples, rec);
+		if (err)
+			err_handler(err, "pthread_create()");
+		pthread_attr_destroy(&attr);
+	}
+
+	if (wd) {
+		window_setup(wd, s);
+		io_thread_attr(&attr, 0);
+		err = pthread_create(&wpid, &attr, window_thread, wd);
 		if (err)
 			err_handler(err, "pthread_create()");
+		pthread_attr_destroy(&attr);
 	}
 
 	if (opt_verbose) {
+		display_overhead(s);
 		err = pthread_create(&pid, NULL, display_stats, s);
 		if (err)
 			err_handler(err, "pthread_create()");
 	}
 
+	/*
+	 * The hwlat workers don't count loops. Stop them when all
+	 * timer workers are done.
+	 */
+	for (i = 0, c = 0; i < num_threads; i++) {
+		if (s[i]->group->mode == MODE_HWLAT)
+			continue;
+		err = pthread_join(s[i]->pid, NULL);
+		if (err)
+			err_handler(err, "pthread_join()");
+		c++;
+	}
+	if (c)
+		WRITE_ONCE(jd_shutdown, 1);
+
 	for (i = 0; i < num_threads; i++) {
-		err = pthread_join(s[i].pid, NULL);
+		if (s[i]->group->mode != MODE_HWLAT)
+			continue;
+		err = pthread_join(s[i]->pid, NULL);
 		if (err)
 			err_handler(err, "pthread_join()");
 	}
@@ -757,14 +3505,58 @@ int main(int argc, char *argv[])
 	WRITE_ONCE(jd_shutdown, 1);
 	stop_workload();
 
+	if (use_tsc) {
+		/* Compare the calibration against CLOCK_MONOTONIC again */
+		tsc_drift = tsc_offset(&tsc_cal);
+		if (llabs(tsc_drift) > TSC_DRIFT_WARN_NS)
+			warn_handler("TSC drifted by %" PRId64 " ns against "
+				     "CLOCK_MONOTONIC", tsc_drift);
+	}
+
+	if (wd) {
+		/* Send the windows which are still open */
+		WRITE_ONCE(wd->done, 1);
+		err = pthread_join(wpid, NULL);
+		if (err)
+			err_handler(err, "pthread_join()");
+	}
+
+	if (mmap_dir) {
+		WRITE_ONCE(mmap_done, 1);
+		jd_futex_wake(&rb_doorbell);
+
+		err = pthread_join(iopid, NULL);
+		if (err)
+			err_handler(err, "pthread_join()");
+
+		for (i = 0; i < num_threads; i++) {
+			sample_file_close(s[i]->sf);
+			if (sample_file_dropped(s[i]->sf))
+				warn_handler("Thread %u dropped %" PRIu64
+					     " samples, no mapping window was "
+					     "ready", i,
+					     sample_file_dropped(s[i]->sf));
+		}
+	}
+
 	if (rec) {
+		/* Let the I/O thread pick up the last samples and stop */
+		WRITE_ONCE(rec->done, 1);
+		jd_futex_wake(&rb_doorbell);
+
 		err = pthread_join(iopid, NULL);
 		if (err)
 			err_handler(err, "pthread_join()");
 
-		if (rec->fd)
-			fclose(rec->fd);
-		free(rec);
+		if (rec->bw && opt_verbose)
+			display_writer(rec);
+
+		for (i = 0; i < num_threads; i++) {
+			if (ringbuffer_overflow(s[i]->rb))
+				warn_handler("Thread %u dropped %u samples, the "
+					     "ringbuffer was full", i,
+					     ringbuffer_overflow(s[i]->rb));
+		}
 	}
 
 	if (opt_verbose) {
@@ -773,7 +3565,7 @@ int main(int argc, char *argv[])
 			err_handler(err, "pthread_join()");
 	} else {
 		printf("\n");
-		__display_stats(s);
+		__display_stats(s, 1);
 	}
 
 	printf("\n");
@@ -781,7 +3573,7 @@ int main(int argc, char *argv[])
 	if (opt_dir) {
 		rfd = jd_fopen(opt_dir, "results.json", "w");
 		if (rfd) {
-			dump_stats(rfd, sysinfo, s);
+			dump_stats(rfd, sysinfo, s, rec, wd, tsc_drift);
 			fclose(rfd);
 		} else {
 			warn_handler("Couldn't create results.json");
@@ -791,23 +3583,64 @@ int main(int argc, char *argv[])
 
 	if (opt_verbose && break_val != UINT_MAX) {
 		for (i = 0; i < num_threads; i++) {
-			if (s[i].max > break_val) {
+			if (s[i]->max > break_val) {
 				const char *unit = "us";
 				if (interval_resolution == 1)
 					unit = "ns";
 				printf("Thread %lu on CPU %u hit %" PRIu64 " %s latency\n",
-					(long)s[i].tid, i, s[i].max, unit);
+					(long)s[i]->tid, i, s[i]->max, unit);
 			}
 		}
 	}
 
+	if (opt_baseline) {
+		memset(&run, 0, sizeof(run));
+		run.resolution_ns = interval_resolution;
+		run.digits = hist_digits;
+		for (i = 0; i < num_threads; i++)
+			jd_dist_add_histogram(jd_dists_cpu(&run, s[i]->affinity),
+					      s[i]->hist, interval_resolution);
+		jd_dists_finish(&run);
+
+		printf("\n");
+		if (jd_compare(&baseline, &run, &compare))
+			ret = 2;
+		jd_dists_free(&run);
+		jd_dists_free(&baseline);
+	}
+
 	for (i = 0; i < num_threads; i++) {
-		free(s[i].hist);
-		if (s[i].rb)
-			ringbuffer_free(s[i].rb);
+		histogram_free(s[i]->hist);
+		if (s[i]->overhead)
+			histogram_free(s[i]->overhead);
+		if (s[i]->rb)
+			ringbuffer_free(s[i]->rb);
+		if (s[i]->sf)
+			sample_file_free(s[i]->sf);
+		if (s[i]->win)
+			window_free(s[i]->win);
+		free(s[i]);
 	}
 	free(s);
+	free(hdr);
+	histogram_free(total_hist);
+	groups_free();
+	if (rec) {
+		if (rec->jdc)
+			jdc_writer_free(rec->jdc);
+		if (rec->bw)
+			block_writer_free(rec->bw);
+		free(rec->stored);
+		free(rec->write_dropped);
+		free(rec->send_dropped);
+		free(rec);
+	}
+	if (wd) {
+		window_cleanup(wd);
+		free(wd);
+	}
 
+out:
 	if (tracemark_fd > 0)
 		close(tracemark_fd);
 
@@ -816,5 +3649,5 @@ int main(int argc, char *argv[])
 
 	c_states_enable(fd);
 
-	return 0;
+	return ret;
 }
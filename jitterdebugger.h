@@ -5,13 +5,16 @@
 
 #include <stdint.h>
 #include <sched.h>
+#include <pthread.h>
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #define JD_VERSION "0.3"
 
-// Results in a 1400 bytes payload per UDP packet
+#define JD_CACHELINE_SIZE	64
+
+// Results in a 1432 bytes payload per UDP packet
 #define SAMPLES_PER_PACKET 50
 
 #define READ_ONCE(x)							\
@@ -28,18 +31,333 @@
 	__u.__v;							\
 })
 
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define smp_rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+
 struct latency_sample {
 	uint32_t cpuid;
 	struct timespec ts;
 	uint64_t val;
 } __attribute__((packed));
 
+/*
+ * UDP sample stream (-n). Every packet carries the samples of one
+ * thread. seq counts the packets of a thread, so a receiver can
+ * detect lost packets. The last packet of a thread has
+ * JD_PACKET_LAST set and may be empty.
+ */
+#define JD_PACKET_MAGIC		0x3150444a	/* "JDP1" */
+#define JD_PACKET_VERSION	1
+#define JD_PACKET_LAST		0x1
+
+struct jd_packet_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t count;		/* samples in this packet */
+	uint32_t sender;
+	uint32_t cpuid;		/* thread of the samples */
+	uint64_t seq;
+	uint32_t resolution_ns;
+	uint32_t flags;
+};
+
+struct jd_packet {
+	struct jd_packet_header hdr;
+	struct latency_sample samples[SAMPLES_PER_PACKET];
+};
+
+/*
+ * UDP histogram stream (--stream-hist). At the end of every window
+ * each thread sends the histogram of that window. The header is
+ * followed by nr_buckets struct jd_hist_bucket (only the non empty
+ * buckets) and nr_outliers struct jd_hist_outlier. A window which
+ * doesn't fit into one packet is split into nr_parts packets, the
+ * counters of the header are only valid in part 0. seq counts the
+ * windows of a thread. The last window of a thread has JD_HIST_LAST
+ * set.
+ */
+#define JD_HIST_MAGIC		0x3148444a	/* "JDH1" */
+#define JD_HIST_VERSION		1
+#define JD_HIST_LAST		0x1
+#define JD_HIST_PACKET_SIZE	1432
+
+struct jd_hist_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t flags;
+	uint32_t sender;
+	uint32_t cpuid;		/* thread */
+	uint32_t cpu;		/* the thread is running on */
+	uint32_t resolution_ns;
+	uint64_t seq;
+	uint64_t start_ns;	/* CLOCK_MONOTONIC */
+	uint64_t length_ns;
+	uint64_t realtime_ns;	/* CLOCK_REALTIME at start_ns */
+	uint64_t count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	uint64_t overflow;
+	uint64_t max_value;	/* histogram_create() parameters */
+	uint32_t digits;
+	uint16_t part;
+	uint16_t nr_parts;
+	uint16_t nr_buckets;
+	uint16_t nr_outliers;
+	uint32_t outliers_dropped;
+};
+
+struct jd_hist_bucket {
+	uint32_t idx;
+	uint32_t count;
+};
+
+struct jd_hist_outlier {
+	uint64_t ts;		/* ns, CLOCK_MONOTONIC */
+	uint64_t val;
+};
+
+/*
+ * samples.raw starts with this header, padded to header_size. The
+ * records (struct latency_sample) follow, so the record area can be
+ * mapped directly. cpuid of a record is an index into threads[].
+ */
+#define JD_SAMPLES_MAGIC	"JDSAMPLE"
+#define JD_SAMPLES_VERSION	1
+#define JD_SAMPLES_ALIGN	4096
+
+struct jd_samples_thread {
+	uint32_t cpu;
+	uint32_t interval_us;
+};
+
+struct jd_samples_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;	/* offset of the first record */
+	uint32_t record_size;
+	uint32_t resolution_ns;	/* unit of latency_sample.val */
+	uint32_t clock_id;	/* clock of latency_sample.ts */
+	uint32_t nr_threads;
+	uint64_t start_ns;	/* clock_id time when recording started */
+	uint64_t start_realtime_ns;
+	struct jd_samples_thread threads[];
+};
+
+static inline uint32_t jd_samples_header_size(uint32_t nr_threads)
+{
+	size_t len = sizeof(struct jd_samples_header) +
+		nr_threads * sizeof(struct jd_samples_thread);
+
+	return (len + JD_SAMPLES_ALIGN - 1) & ~(size_t)(JD_SAMPLES_ALIGN - 1);
+}
+
+/*
+ * Sparse time index of samples.raw (samples.idx). Entry i covers the
+ * records [i * records, (i + 1) * records) and holds the lowest and
+ * highest timestamp of them. The threads are drained in batches, so
+ * the records are only roughly ordered by time.
+ */
+#define JD_SAMPLES_INDEX_MAGIC		"JDSINDEX"
+#define JD_SAMPLES_INDEX_VERSION	1
+#define JD_SAMPLES_INDEX_RECORDS	4096
+
+struct jd_samples_index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t records;	/* per entry */
+};
+
+struct jd_samples_index_entry {
+	uint64_t min_ts;	/* ns */
+	uint64_t max_ts;
+};
+
 struct ringbuffer;
 
 struct ringbuffer *ringbuffer_create(unsigned int size);
 void ringbuffer_free(struct ringbuffer *rb);
-int ringbuffer_read(struct ringbuffer *rb, struct timespec *ts, uint64_t *val);
-int ringbuffer_write(struct ringbuffer *rb, struct timespec ts, uint64_t val);
+int ringbuffer_mem_node(struct ringbuffer *rb);
+void ringbuffer_reset(struct ringbuffer *rb);
+unsigned int ringbuffer_read_batch(struct ringbuffer *rb, uint64_t *ts_ns,
+				   uint64_t *val, unsigned int max);
+int ringbuffer_write(struct ringbuffer *rb, uint64_t ts_ns, uint64_t val);
+void ringbuffer_set_doorbell(struct ringbuffer *rb, uint32_t *doorbell,
+			     unsigned int watermark);
+uint32_t ringbuffer_overflow(struct ringbuffer *rb);
+
+#define HISTOGRAM_MIN_DIGITS	1
+#define HISTOGRAM_MAX_DIGITS	3
+
+struct histogram {
+	unsigned int digits;
+	unsigned int sub_bucket_bits;
+	unsigned int size;
+	uint64_t max_value;
+	uint64_t overflow;
+	uint64_t *buckets;
+};
+
+struct histogram *histogram_create(unsigned int digits, uint64_t max_value);
+void histogram_free(struct histogram *h);
+uint64_t histogram_bucket_low(struct histogram *h, unsigned int idx);
+uint64_t histogram_bucket_high(struct histogram *h, unsigned int idx);
+uint64_t histogram_percentile(struct histogram *h, double p);
+void histogram_percentiles(struct histogram *h, const double *p,
+			   uint64_t *val, unsigned int n);
+uint64_t histogram_count_from(struct histogram *h, uint64_t val);
+int histogram_merge(struct histogram *dst, struct histogram *src);
+void histogram_reset(struct histogram *h);
+
+static inline unsigned int histogram_index(struct histogram *h, uint64_t val)
+{
+	unsigned int half = h->sub_bucket_bits - 1;
+	uint64_t mask = (2ULL << half) - 1;
+	unsigned int shift;
+
+	/* values below 2^sub_bucket_bits map 1:1 to a bucket */
+	shift = 63 - __builtin_clzll(val | mask) - half;
+
+	return (shift << half) + (unsigned int)(val >> shift);
+}
+
+static inline void histogram_add(struct histogram *h, uint64_t val)
+{
+	unsigned int idx = histogram_index(h, val);
+
+	if (idx < h->size)
+		h->buckets[idx]++;
+	else
+		h->overflow++;
+}
+
+/* Wakeup mechanisms for the measurement loop, see jd_timer.c */
+struct timer_ops;
+
+struct timer {
+	const struct timer_ops *ops;
+	int fd;
+	int epfd;
+	timer_t id;
+	int signo;
+};
+
+const struct timer_ops *timer_ops_find(const char *name);
+const char *timer_ops_name(const struct timer_ops *ops);
+void timer_init(struct timer *t, const struct timer_ops *ops);
+void timer_wait(struct timer *t, const struct timespec *next);
+void timer_cleanup(struct timer *t);
+
+/* Cross CPU wakeup latency matrix, see jd_wakeup.c */
+struct wakeup_ops;
+
+struct wakeup_cell {
+	struct histogram *hist;
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t total;
+};
+
+struct wakeup_matrix {
+	const struct wakeup_ops *ops;
+	unsigned int n;
+	unsigned int *cpus;
+	struct wakeup_cell *cells;	/* n * n, indexed [src * n + dst] */
+};
+
+struct wakeup_params {
+	unsigned int loops;		/* per pair */
+	unsigned int interval_us;
+	unsigned int resolution;	/* ns per unit */
+	int priority;
+	unsigned int digits;
+	int *stop;
+};
+
+const struct wakeup_ops *wakeup_ops_find(const char *name);
+const char *wakeup_ops_name(const struct wakeup_ops *ops);
+struct wakeup_matrix *wakeup_matrix_run(cpu_set_t *cpus,
+					const struct wakeup_ops *ops,
+					struct wakeup_params *p);
+void wakeup_matrix_free(struct wakeup_matrix *m);
+const char *wakeup_cpu_relation(unsigned int a, unsigned int b);
+
+static inline struct wakeup_cell *wakeup_cell(struct wakeup_matrix *m,
+					      unsigned int src,
+					      unsigned int dst)
+{
+	return &m->cells[src * m->n + dst];
+}
+
+/* Invariant TSC as low overhead time source, see jd_tsc.c */
+struct tsc_conv {
+	uint64_t mult;
+	unsigned int shift;
+};
+
+struct tsc_calibration {
+	uint64_t hz;
+	uint64_t tsc0;		/* TSC value at ns0 */
+	uint64_t ns0;		/* CLOCK_MONOTONIC in ns */
+	struct tsc_conv to_ns;
+	struct tsc_conv from_ns;
+};
+
+uint64_t clock_monotonic_ns(void);
+void tsc_conv_init(struct tsc_conv *c, uint64_t num, uint64_t den);
+int tsc_check(void);
+void tsc_calibrate(struct tsc_calibration *c);
+int64_t tsc_offset(struct tsc_calibration *c);
+
+/* (v * mult) >> shift with a 128 bit intermediate, 0 < shift < 64 */
+static inline uint64_t tsc_conv(const struct tsc_conv *c, uint64_t v)
+{
+#if defined(__SIZEOF_INT128__)
+	return ((unsigned __int128)v * c->mult) >> c->shift;
+#else
+	uint64_t vl = (uint32_t)v, vh = v >> 32;
+	uint64_t ml = (uint32_t)c->mult, mh = c->mult >> 32;
+	uint64_t ll = vl * ml, lh = vl * mh, hl = vh * ml;
+	uint64_t mid, lo, hi;
+
+	mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+	lo = (mid << 32) | (uint32_t)ll;
+	hi = vh * mh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+
+	return (hi << (64 - c->shift)) | (lo >> c->shift);
+#endif
+}
+
+static inline uint64_t tsc_read(void)
+{
+#if defined(__x86_64__)
+	unsigned int aux;
+
+	return __builtin_ia32_rdtscp(&aux);
+#else
+	return 0;
+#endif
+}
+
+/* Convert between TSC and CLOCK_MONOTONIC ns */
+static inline uint64_t tsc_to_mono(const struct tsc_calibration *c,
+				   uint64_t tsc)
+{
+	if (tsc >= c->tsc0)
+		return c->ns0 + tsc_conv(&c->to_ns, tsc - c->tsc0);
+	return c->ns0 - tsc_conv(&c->to_ns, c->tsc0 - tsc);
+}
+
+static inline uint64_t tsc_from_mono(const struct tsc_calibration *c,
+				     uint64_t ns)
+{
+	if (ns >= c->ns0)
+		return c->tsc0 + tsc_conv(&c->from_ns, ns - c->ns0);
+	return c->tsc0 - tsc_conv(&c->from_ns, c->ns0 - ns);
+}
 
 void _err_handler(int error, char *format, ...)
 	__attribute__((format(printf, 2, 3)));
@@ -61,6 +379,7 @@ void _warn_handler(char *format, ...)
 
 long int parse_num(const char *str, int base, size_t *len);
 long int parse_time(const char *str);
+int parse_percentiles(char *str, double *p, unsigned int max);
 
 static inline long int parse_dec(const char *str)
 {
@@ -69,10 +388,232 @@ static inline long int parse_dec(const char *str)
 
 int sysfs_load_str(const char *path, char **buf);
 
+void jd_futex_wake(uint32_t *addr);
+int jd_futex_wait(uint32_t *addr, const struct timespec *timeout);
+
+/* NUMA helpers */
+void jd_prefault(void *addr, size_t len);
+int jd_cpu_node(void);
+int jd_mem_node(void *addr);
+
 /* cpu_set_t helpers */
 void cpuset_fprint(FILE *f, cpu_set_t *set);
 ssize_t cpuset_parse(cpu_set_t *set, const char *str);
 
+/* Memory mapped per thread sample files, see jd_mmap.c */
+struct mmap_sample {
+	uint64_t ts;		/* CLOCK_MONOTONIC in ns */
+	uint64_t val;
+};
+
+struct sample_file {
+	/* Worker */
+	struct mmap_sample *cur;
+	uint32_t pos;
+	uint32_t cap;		/* samples per window */
+	uint32_t windows;	/* completed windows */
+	uint64_t dropped;
+
+	/* Exchanged with the mapper thread */
+	struct mmap_sample *next __attribute__((aligned(JD_CACHELINE_SIZE)));
+	struct mmap_sample *retired;
+
+	/* Mapper thread */
+	off_t next_off;
+	off_t data_off;		/* room for struct jd_samples_header */
+	int fd;
+	uint32_t *doorbell;
+	uint64_t remaps;	/* windows moved behind the end */
+	uint64_t remap_ns;	/* time spent moving them */
+};
+
+struct sample_file *sample_file_open(const char *path, unsigned int id,
+				     unsigned int nr_threads,
+				     unsigned int window, uint32_t *doorbell);
+void sample_file_write_header(struct sample_file *f,
+			      const struct jd_samples_header *hdr);
+int sample_file_switch(struct sample_file *f);
+void sample_file_service(struct sample_file *f);
+uint64_t sample_file_count(struct sample_file *f);
+uint64_t sample_file_dropped(struct sample_file *f);
+void sample_file_close(struct sample_file *f);
+void sample_file_free(struct sample_file *f);
+
+static inline int sample_file_write(struct sample_file *f, uint64_t ts,
+				    uint64_t val)
+{
+	if (f->pos == f->cap && sample_file_switch(f))
+		return 1;
+
+	f->cur[f->pos].ts = ts;
+	f->cur[f->pos].val = val;
+	WRITE_ONCE(f->pos, f->pos + 1);
+
+	return 0;
+}
+
+/* Per thread statistics of a time window, see jd_window.c */
+#define WINDOW_OUTLIERS		64
+
+struct window_stats {
+	struct histogram *hist;
+	uint64_t count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	uint32_t epoch;		/* epoch which closed the window */
+	uint32_t nr_outliers;
+	uint32_t outliers_dropped;
+	struct jd_hist_outlier outliers[WINDOW_OUTLIERS];
+};
+
+struct window {
+	struct window_stats buf[2];
+	unsigned int cur;	/* filled by the worker */
+	uint32_t epoch;		/* last epoch seen by the worker */
+	uint32_t *clock;		/* advanced by the window thread */
+
+	/* Exchanged with the window thread, index of the closed buffer */
+	int ready __attribute__((aligned(JD_CACHELINE_SIZE)));
+};
+
+struct window *window_create(unsigned int digits, uint64_t max_value,
+			     uint32_t *clock);
+void window_free(struct window *w);
+struct window_stats *window_get(struct window *w);
+struct window_stats *window_get_current(struct window *w);
+void window_put(struct window *w, struct window_stats *ws);
+
+/*
+ * Called by the worker before it adds a sample. When the epoch has
+ * moved on the filled buffer is handed over and the other one is
+ * used. If the window thread hasn't returned the other buffer yet,
+ * the current one is kept and covers several windows.
+ */
+static inline void window_tick(struct window *w)
+{
+	uint32_t epoch = READ_ONCE(*w->clock);
+
+	if (epoch == w->epoch)
+		return;
+	w->epoch = epoch;
+
+	if (smp_load_acquire(&w->ready) >= 0)
+		return;
+
+	w->buf[w->cur].epoch = epoch;
+	smp_store_release(&w->ready, (int)w->cur);
+	w->cur ^= 1;
+}
+
+static inline void window_add(struct window *w, uint64_t val)
+{
+	struct window_stats *ws = &w->buf[w->cur];
+
+	if (val > ws->max)
+		ws->max = val;
+	if (val < ws->min)
+		ws->min = val;
+	ws->count++;
+	ws->total += val;
+	histogram_add(ws->hist, val);
+}
+
+static inline void window_outlier(struct window *w, uint64_t ts, uint64_t val)
+{
+	struct window_stats *ws = &w->buf[w->cur];
+
+	if (ws->nr_outliers == WINDOW_OUTLIERS) {
+		ws->outliers_dropped++;
+		return;
+	}
+	ws->outliers[ws->nr_outliers].ts = ts;
+	ws->outliers[ws->nr_outliers].val = val;
+	ws->nr_outliers++;
+}
+
+/* Large block writer for samples.raw, see jd_writer.c */
+struct block_writer;
+
+struct block_writer *block_writer_open(const char *path, const char *filename,
+				       int direct, const pthread_attr_t *attr);
+void block_writer_add(struct block_writer *bw, const void *data, size_t len);
+void block_writer_flush(struct block_writer *bw);
+void block_writer_close(struct block_writer *bw);
+void block_writer_free(struct block_writer *bw);
+uint64_t block_writer_bytes(struct block_writer *bw);
+uint64_t block_writer_ns(struct block_writer *bw);
+uint64_t block_writer_wall_ns(struct block_writer *bw);
+int block_writer_error(struct block_writer *bw);
+uint64_t block_writer_lost(struct block_writer *bw);
+int block_writer_direct(struct block_writer *bw);
+
+/* Compressed sample file samples.jdc, see jd_compress.c */
+#define JDC_MAGIC		0x3143444a	/* "JDC1" */
+#define JDC_BLOCK_MAGIC		0x4b4c4244	/* "DBLK" */
+#define JDC_VERSION		2
+
+/*
+ * Since version 2 the struct jd_samples_header of the recording
+ * follows, header_size bytes. Its record_size is the one of the
+ * decoded struct latency_sample.
+ */
+struct jdc_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t block_samples;
+	uint32_t header_size;
+};
+
+struct jdc_block_header {
+	uint32_t magic;
+	uint32_t cpuid;
+	uint32_t count;
+	uint32_t size;		/* payload bytes following the header */
+	uint64_t first_ts;	/* ns */
+	uint64_t last_ts;
+	uint64_t min;
+	uint64_t max;
+};
+
+struct jdc_index_entry {
+	uint64_t offset;	/* of the block header */
+	struct jdc_block_header hdr;
+};
+
+struct jdc_trailer {
+	uint64_t index_offset;
+	uint32_t nr_blocks;
+	uint32_t magic;
+};
+
+typedef void (*jdc_write_fn)(void *arg, const void *data, size_t len);
+
+struct jdc_writer;
+
+struct jdc_writer *jdc_writer_create(const struct jd_samples_header *hdr,
+				     jdc_write_fn write, void *arg);
+void jdc_writer_add(struct jdc_writer *w, unsigned int cpu, uint64_t ts,
+		    uint64_t val);
+void jdc_writer_close(struct jdc_writer *w);
+void jdc_writer_free(struct jdc_writer *w);
+
+struct jdc_reader;
+
+struct jdc_reader *jdc_reader_open(FILE *fd);
+void jdc_reader_close(struct jdc_reader *r);
+typedef int (*jdc_block_filter)(void *arg,
+				const struct jdc_block_header *hdr);
+
+void jdc_reader_set_filter(struct jdc_reader *r, jdc_block_filter filter,
+			   void *arg);
+uint64_t jdc_reader_count(struct jdc_reader *r);
+unsigned int jdc_reader_threads(struct jdc_reader *r);
+uint64_t jdc_reader_last_ts(struct jdc_reader *r);
+const struct jd_samples_header *jdc_reader_header(struct jdc_reader *r);
+size_t jdc_reader_read(struct jdc_reader *r, struct latency_sample *buf,
+		       size_t n);
+
 int start_workload(const char *cmd);
 void stop_workload(void);
 
@@ -98,12 +639,116 @@ struct jd_samples_info {
 	unsigned int cpus_online;
 };
 
+/*
+ * Reads the samples of a jitterdebugger --output directory, either
+ * from samples.raw or from the per thread samples.N.raw files written
+ * with --mmap. See jittersamples.c
+ */
+struct jd_samples_reader;
+
+size_t jd_samples_read(struct jd_samples_reader *r,
+		       struct latency_sample *buf, size_t n);
+uint64_t jd_samples_count(struct jd_samples_reader *r);
+const struct jd_samples_header *jd_samples_header(struct jd_samples_reader *r);
+unsigned int jd_samples_threads(struct jd_samples_reader *r);
+
 struct jd_samples_ops {
 	const char *name;
 	const char *format;
-	int (*output)(struct jd_samples_info *info, FILE *input);
+	int (*output)(struct jd_samples_info *info,
+		      struct jd_samples_reader *reader);
 };
 
+/* Multi sender receiver for jittersamples --listen, see jd_collector.c */
+int jd_collect(const char *port, const char *dir, unsigned int threads,
+	       unsigned int senders, int *stop,
+	       void (*export)(const char *dir, void *arg), void *arg);
+
+/* Merge of many results.json for jittersamples --merge, see jd_merge.c */
+struct jd_merge_params {
+	const char *output;	/* combined results.json or NULL */
+	unsigned int jobs;	/* parser threads */
+	unsigned int top;	/* rows of the ranking tables */
+	const double *percentiles;
+	unsigned int num_percentiles;
+};
+
+int jd_merge(char **paths, unsigned int n, struct jd_merge_params *p);
+
+/* Comparison with a baseline results.json, see jd_compare.c */
+#define JD_COMPARE_MAX		16
+
+struct jd_compare_params {
+	double percentiles[JD_COMPARE_MAX];
+	double limits[JD_COMPARE_MAX];	/* allowed increase in % */
+	unsigned int num_percentiles;
+	uint64_t slack;		/* allowed increase in latency units */
+	double ks_alpha;	/* 0 disables the KS test */
+	double ks_min_d;	/* smallest D+ counted as regression */
+	int allow_missing;	/* baseline CPUs may be missing in the run */
+};
+
+struct jd_dist_bucket {
+	uint64_t val;		/* ns */
+	uint64_t count;
+};
+
+struct jd_dist {
+	unsigned int cpu;
+	uint64_t count;
+	unsigned int nr;
+	unsigned int size;
+	struct jd_dist_bucket *b;
+};
+
+struct jd_dists {
+	unsigned int resolution_ns;
+	unsigned int digits;	/* of the histograms */
+	unsigned int nr;
+	struct jd_dist *cpu;
+};
+
+void jd_compare_init(struct jd_compare_params *p);
+int jd_compare_parse_limits(struct jd_compare_params *p, char *str);
+struct jd_dist *jd_dists_cpu(struct jd_dists *d, unsigned int cpu);
+void jd_dist_add(struct jd_dist *d, uint64_t val, uint64_t count);
+void jd_dist_add_histogram(struct jd_dist *d, struct histogram *h,
+			   unsigned int resolution_ns);
+void jd_dists_finish(struct jd_dists *d);
+void jd_dists_free(struct jd_dists *d);
+int jd_dists_load(struct jd_dists *d, const char *path);
+int jd_compare(struct jd_dists *base, struct jd_dists *run,
+	       struct jd_compare_params *p);
+
+/* JSON reader, see jd_json.c */
+enum jd_json_type {
+	JD_JSON_NULL,
+	JD_JSON_BOOL,
+	JD_JSON_NUMBER,
+	JD_JSON_STRING,
+	JD_JSON_ARRAY,
+	JD_JSON_OBJECT,
+};
+
+struct jd_json {
+	enum jd_json_type type;
+	char *key;		/* member name inside an object */
+	char *str;
+	double num;
+	uint64_t u64;		/* integers, exact */
+	struct jd_json *child;	/* first member or element */
+	struct jd_json *next;
+};
+
+struct jd_json *jd_json_parse(const char *buf, size_t len);
+struct jd_json *jd_json_load(const char *path);
+void jd_json_free(struct jd_json *j);
+struct jd_json *jd_json_get(struct jd_json *j, const char *key);
+uint64_t jd_json_u64(struct jd_json *j, uint64_t def);
+double jd_json_num(struct jd_json *j, double def);
+const char *jd_json_str(struct jd_json *j);
+void jd_json_fputs(FILE *f, const char *s);
+
 int jd_samples_register(struct jd_samples_ops *ops);
 void jd_samples_unregister(struct jd_samples_ops *ops);
 
@@ -13,6 +13,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <netdb.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include "jitterdebugger.h"
@@ -49,9 +50,10 @@ static void read_online_cpus(struct jd_samples_info *info)
 static void dump_samples(const char *port)
 {
 	struct addrinfo hints, *res, *tmp;
-	struct latency_sample sp[SAMPLES_PER_PACKET];
+	struct jd_packet p;
+	uint64_t *next_seq = NULL;
+	unsigned int nr_seq = 0;
 	ssize_t len;
-	size_t wlen;
 	int err, sk;
 
 	bzero(&hints, sizeof(struct addrinfo));
@@ -80,19 +82,505 @@ static void dump_samples(const char *port)
 	freeaddrinfo(tmp);
 
 	while (1) {
-		len = recvfrom(sk, sp, sizeof(sp), 0, NULL, NULL);
-		if (len != sizeof(sp)) {
-			warn_handler("UDP packet has wrong size\n");
+		len = recvfrom(sk, &p, sizeof(p), 0, NULL, NULL);
+		if (len < (ssize_t)sizeof(p.hdr) ||
+		    p.hdr.magic != JD_PACKET_MAGIC ||
+		    p.hdr.version != JD_PACKET_VERSION ||
+		    p.hdr.count > SAMPLES_PER_PACKET ||
+		    len != (ssize_t)(sizeof(p.hdr) +
+				     p.hdr.count * sizeof(struct latency_sample))) {
+			warn_handler("Invalid UDP packet");
 			continue;
 		}
-		wlen = fwrite(sp, sizeof(sp), 1, stdout);
-		if (wlen != sizeof(sp))
+
+		if (p.hdr.cpuid >= nr_seq) {
+			next_seq = realloc(next_seq,
+					   (p.hdr.cpuid + 1) * sizeof(*next_seq));
+			if (!next_seq)
+				err_handler(ENOMEM, "realloc()");
+			memset(next_seq + nr_seq, 0,
+			       (p.hdr.cpuid + 1 - nr_seq) * sizeof(*next_seq));
+			nr_seq = p.hdr.cpuid + 1;
+		}
+		if (p.hdr.seq != next_seq[p.hdr.cpuid])
+			warn_handler("Sender %u thread %u: %" PRId64
+				     " packets lost", p.hdr.sender,
+				     p.hdr.cpuid,
+				     (int64_t)(p.hdr.seq - next_seq[p.hdr.cpuid]));
+		next_seq[p.hdr.cpuid] = p.hdr.seq + 1;
+
+		if (p.hdr.count &&
+		    fwrite(p.samples, sizeof(struct latency_sample),
+			   p.hdr.count, stdout) != p.hdr.count)
 			err_handler(errno, "fwrite()");
+		if (p.hdr.flags & JD_PACKET_LAST)
+			fflush(stdout);
 	}
 
 	close(sk);
 }
 
+/* Which samples to export, see sample_wanted() */
+/*
+ * --from and --to. CLOCK_MONOTONIC values are used as they are, wall
+ * clock values are converted with the start time in the samples
+ * header, see resolve_time().
+ */
+enum time_type {
+	TIME_MONOTONIC,
+	TIME_EPOCH,		/* ns since 1970 */
+	TIME_OF_DAY,		/* ns since local midnight */
+};
+
+struct time_arg {
+	enum time_type type;
+	uint64_t ns;
+};
+
+struct sample_filter {
+	uint64_t threshold;
+	struct time_arg from_arg;
+	struct time_arg to_arg;
+	uint64_t from;		/* CLOCK_MONOTONIC ns */
+	uint64_t to;
+	cpu_set_t cpus;		/* --cpu, see thread_filter() */
+	cpu_set_t threads;	/* CPUID of the samples */
+	int all_cpus;
+};
+
+struct jd_samples_reader {
+	struct sample_filter f;
+
+	FILE *raw;		/* samples.raw */
+	struct jd_samples_header *hdr;	/* NULL for files without header */
+	off_t data_off;		/* of the first record */
+
+	/* samples.idx, only loaded for a time range */
+	uint64_t *chunks;	/* selected index entries */
+	uint64_t nr_chunks;
+	uint64_t next_chunk;
+	uint32_t chunk_records;
+	uint32_t chunk_left;
+
+	FILE *jdc_fd;		/* samples.jdc */
+	struct jdc_reader *jdc;
+
+	FILE **files;		/* samples.N.raw, N is the thread */
+	unsigned int nr_files;
+	unsigned int cur;
+
+	uint64_t count;
+};
+
+static uint64_t file_size(FILE *fd)
+{
+	struct stat st;
+
+	if (fstat(fileno(fd), &st) < 0)
+		err_handler(errno, "fstat()");
+
+	return st.st_size;
+}
+
+static inline uint64_t sample_ts(struct latency_sample *s)
+{
+	return (uint64_t)s->ts.tv_sec * 1000000000 + s->ts.tv_nsec;
+}
+
+static int sample_wanted(struct sample_filter *f, struct latency_sample *s)
+{
+	uint64_t ts = sample_ts(s);
+
+	if (s->val < f->threshold || ts < f->from || ts > f->to)
+		return 0;
+
+	return f->all_cpus || (s->cpuid < CPU_SETSIZE &&
+			       CPU_ISSET(s->cpuid, &f->threads));
+}
+
+static int filter_has_range(struct sample_filter *f)
+{
+	return f->from || f->to != UINT64_MAX;
+}
+
+static void check_header(const struct jd_samples_header *h, const char *name,
+			 uint32_t record_size)
+{
+	if (memcmp(h->magic, JD_SAMPLES_MAGIC, sizeof(h->magic)))
+		err_abort("Corrupted %s header", name);
+	if (h->version != JD_SAMPLES_VERSION)
+		err_abort("Unsupported %s version %u", name, h->version);
+	if (h->record_size != record_size)
+		err_abort("Unsupported %s record size %u", name,
+			  h->record_size);
+}
+
+/*
+ * Reads the header of samples.raw or samples.N.raw and leaves the
+ * file at the first record. Files written before the header was
+ * introduced start with the first record, NULL is returned for them.
+ */
+static struct jd_samples_header *read_header(FILE *fd, const char *name,
+					     uint32_t record_size)
+{
+	struct jd_samples_header h, *hdr;
+
+	if (fread(&h, sizeof(h), 1, fd) != 1 ||
+	    memcmp(h.magic, JD_SAMPLES_MAGIC, sizeof(h.magic))) {
+		rewind(fd);
+		return NULL;
+	}
+
+	check_header(&h, name, record_size);
+	if (h.header_size < jd_samples_header_size(h.nr_threads))
+		err_abort("Corrupted %s header", name);
+
+	hdr = malloc(h.header_size);
+	if (!hdr)
+		err_handler(ENOMEM, "malloc()");
+
+	rewind(fd);
+	if (fread(hdr, h.header_size, 1, fd) != 1)
+		err_handler(EIO, "Could not read %s header", name);
+
+	return hdr;
+}
+
+/* The header embedded into samples.jdc, owned by the reader */
+static struct jd_samples_header *jdc_header(struct jdc_reader *jdc)
+{
+	const struct jd_samples_header *h = jdc_reader_header(jdc);
+	struct jd_samples_header *hdr;
+
+	if (!h)
+		return NULL;
+
+	check_header(h, "samples.jdc", sizeof(struct latency_sample));
+	if (h->header_size < jd_samples_header_size(h->nr_threads))
+		err_abort("Corrupted samples.jdc header");
+
+	hdr = malloc(h->header_size);
+	if (!hdr)
+		err_handler(ENOMEM, "malloc()");
+	memcpy(hdr, h, h->header_size);
+
+	return hdr;
+}
+
+/*
+ * Selects the index entries which overlap with the time range.
+ * Returns 0 when there is no usable index, samples.raw is then read
+ * completely.
+ */
+static int load_index(struct jd_samples_reader *r, const char *dir,
+		      uint64_t records)
+{
+	struct jd_samples_index_header h;
+	struct jd_samples_index_entry e[256];
+	uint64_t nr_entries, i = 0;
+	size_t j, nr;
+	FILE *fd;
+
+	fd = jd_fopen(dir, "samples.idx", "r");
+	if (!fd)
+		return 0;
+
+	if (fread(&h, sizeof(h), 1, fd) != 1 ||
+	    memcmp(h.magic, JD_SAMPLES_INDEX_MAGIC, sizeof(h.magic)) ||
+	    h.version != JD_SAMPLES_INDEX_VERSION || !h.records)
+		goto invalid;
+
+	nr_entries = (file_size(fd) - sizeof(h)) / sizeof(e[0]);
+	if (nr_entries != (records + h.records - 1) / h.records)
+		goto invalid;
+
+	r->chunks = malloc((nr_entries ? nr_entries : 1) * sizeof(*r->chunks));
+	if (!r->chunks)
+		err_handler(ENOMEM, "malloc()");
+	r->chunk_records = h.records;
+
+	while ((nr = fread(e, sizeof(e[0]), 256, fd))) {
+		for (j = 0; j < nr; j++, i++) {
+			if (e[j].max_ts >= r->f.from && e[j].min_ts <= r->f.to)
+				r->chunks[r->nr_chunks++] = i;
+		}
+	}
+	fclose(fd);
+
+	r->count = r->nr_chunks * r->chunk_records;
+	return 1;
+
+invalid:
+	warn_handler("Ignoring invalid samples.idx in '%s'", dir);
+	fclose(fd);
+	return 0;
+}
+
+static int jdc_filter(void *arg, const struct jdc_block_header *hdr)
+{
+	struct sample_filter *f = arg;
+
+	if (hdr->max < f->threshold || hdr->last_ts < f->from ||
+	    hdr->first_ts > f->to)
+		return 0;
+
+	return f->all_cpus || (hdr->cpuid < CPU_SETSIZE &&
+			       CPU_ISSET(hdr->cpuid, &f->threads));
+}
+
+static uint64_t mmap_file_ts(FILE *fd, off_t off, uint64_t idx)
+{
+	struct mmap_sample ms;
+
+	if (fseeko(fd, off + idx * sizeof(ms), SEEK_SET) < 0 ||
+	    fread(&ms, sizeof(ms), 1, fd) != 1)
+		err_handler(EIO, "Could not read sample %" PRIu64, idx);
+
+	return ms.ts;
+}
+
+/*
+ * The samples of a per thread file are ordered by time, find the
+ * first one not before 'from' and leave the file there.
+ */
+static void mmap_file_seek(FILE *fd, off_t off, uint64_t from)
+{
+	uint64_t lo = 0, hi, mid;
+
+	hi = (file_size(fd) - off) / sizeof(struct mmap_sample);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (mmap_file_ts(fd, off, mid) < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (fseeko(fd, off + lo * sizeof(struct mmap_sample), SEEK_SET) < 0)
+		err_handler(errno, "fseeko()");
+}
+
+static struct jd_samples_reader *reader_open(const char *dir,
+					     struct sample_filter *f)
+{
+	struct jd_samples_reader *r;
+	struct jd_samples_header *hdr;
+	uint64_t size;
+	char *fn;
+	FILE *fd;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		err_handler(ENOMEM, "calloc()");
+	r->f = *f;
+
+	r->raw = jd_fopen(dir, "samples.raw", "r");
+	if (r->raw) {
+		r->hdr = read_header(r->raw, "samples.raw",
+				     sizeof(struct latency_sample));
+		size = file_size(r->raw);
+		if (r->hdr) {
+			r->data_off = r->hdr->header_size;
+			size -= r->hdr->header_size;
+		}
+		r->count = size / sizeof(struct latency_sample);
+		if (filter_has_range(f) && r->hdr)
+			load_index(r, dir, r->count);
+		return r;
+	}
+
+	r->jdc_fd = jd_fopen(dir, "samples.jdc", "r");
+	if (r->jdc_fd) {
+		r->jdc = jdc_reader_open(r->jdc_fd);
+		if (!r->jdc)
+			err_handler(EINVAL, "Invalid samples.jdc in '%s'", dir);
+		r->hdr = jdc_header(r->jdc);
+		jdc_reader_set_filter(r->jdc, jdc_filter, &r->f);
+		r->count = jdc_reader_count(r->jdc);
+		return r;
+	}
+
+	while (1) {
+		if (asprintf(&fn, "samples.%u.raw", r->nr_files) < 0)
+			err_handler(errno, "asprintf()");
+		fd = jd_fopen(dir, fn, "r");
+		free(fn);
+		if (!fd)
+			break;
+
+		/* All files carry the same header */
+		hdr = read_header(fd, "samples.N.raw",
+				  sizeof(struct mmap_sample));
+		if (!r->nr_files) {
+			r->hdr = hdr;
+			r->data_off = hdr ? hdr->header_size : 0;
+		} else {
+			if (!hdr != !r->hdr ||
+			    (hdr && hdr->header_size != r->data_off))
+				err_abort("samples.%u.raw doesn't match "
+					  "samples.0.raw", r->nr_files);
+			free(hdr);
+		}
+
+		r->files = realloc(r->files, (r->nr_files + 1) * sizeof(FILE *));
+		if (!r->files)
+			err_handler(ENOMEM, "realloc()");
+		r->files[r->nr_files++] = fd;
+		r->count += (file_size(fd) - r->data_off) /
+			sizeof(struct mmap_sample);
+		if (fseeko(fd, r->data_off, SEEK_SET) < 0)
+			err_handler(errno, "fseeko()");
+		if (f->from)
+			mmap_file_seek(fd, r->data_off, f->from);
+	}
+
+	if (!r->nr_files)
+		err_handler(ENOENT, "No samples.raw or samples.0.raw in '%s'",
+			    dir);
+
+	return r;
+}
+
+static void reader_close(struct jd_samples_reader *r)
+{
+	unsigned int i;
+
+	if (r->raw)
+		fclose(r->raw);
+	free(r->hdr);
+	free(r->chunks);
+	if (r->jdc)
+		jdc_reader_close(r->jdc);
+	if (r->jdc_fd)
+		fclose(r->jdc_fd);
+	for (i = 0; i < r->nr_files; i++)
+		fclose(r->files[i]);
+	free(r->files);
+	free(r);
+}
+
+/* samples.raw, only the index entries which overlap the time range */
+static size_t read_chunks(struct jd_samples_reader *r,
+			  struct latency_sample *buf, size_t n)
+{
+	uint64_t rec;
+	size_t nr;
+
+	while (1) {
+		if (!r->chunk_left) {
+			if (r->next_chunk == r->nr_chunks)
+				return 0;
+
+			rec = r->chunks[r->next_chunk++] * r->chunk_records;
+			if (fseeko(r->raw, r->data_off +
+				   rec * sizeof(struct latency_sample),
+				   SEEK_SET) < 0)
+				err_handler(errno, "fseeko()");
+			r->chunk_left = r->chunk_records;
+		}
+
+		if (n > r->chunk_left)
+			n = r->chunk_left;
+		nr = fread(buf, sizeof(struct latency_sample), n, r->raw);
+		r->chunk_left = nr ? r->chunk_left - nr : 0;
+		if (nr)
+			return nr;
+	}
+}
+
+static size_t reader_read(struct jd_samples_reader *r,
+			  struct latency_sample *buf, size_t n)
+{
+	struct mmap_sample ms[256];
+	size_t i, nr;
+
+	if (r->chunks)
+		return read_chunks(r, buf, n);
+	if (r->raw)
+		return fread(buf, sizeof(struct latency_sample), n, r->raw);
+	if (r->jdc)
+		return jdc_reader_read(r->jdc, buf, n);
+
+	if (n > 256)
+		n = 256;
+
+	for (; r->cur < r->nr_files; r->cur++) {
+		if (!r->f.all_cpus &&
+		    (r->cur >= CPU_SETSIZE ||
+		     !CPU_ISSET(r->cur, &r->f.threads)))
+			continue;
+
+		nr = fread(ms, sizeof(struct mmap_sample), n,
+			   r->files[r->cur]);
+		if (!nr)
+			continue;
+
+		for (i = 0; i < nr; i++) {
+			buf[i].cpuid = r->cur;
+			buf[i].ts.tv_sec = ms[i].ts / 1000000000;
+			buf[i].ts.tv_nsec = ms[i].ts % 1000000000;
+			buf[i].val = ms[i].val;
+		}
+
+		/* The rest of the file is past the time range */
+		if (ms[nr - 1].ts > r->f.to)
+			r->cur++;
+
+		return nr;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns up to n samples. The per thread files and the blocks of
+ * samples.jdc are read one after the other, the samples are only
+ * ordered by time within a thread. Samples which don't pass the
+ * filter are dropped.
+ */
+size_t jd_samples_read(struct jd_samples_reader *r,
+		       struct latency_sample *buf, size_t n)
+{
+	size_t i, j, nr;
+
+	while (1) {
+		nr = reader_read(r, buf, n);
+		if (!nr)
+			return 0;
+
+		for (i = 0, j = 0; i < nr; i++) {
+			if (sample_wanted(&r->f, &buf[i]))
+				buf[j++] = buf[i];
+		}
+		if (j)
+			return j;
+	}
+}
+
+const struct jd_samples_header *jd_samples_header(struct jd_samples_reader *r)
+{
+	return r->hdr;
+}
+
+/*
+ * Number of threads, the cpuid of every sample is below it. 0 for
+ * samples.raw files without header, their cpuid is the CPU.
+ */
+unsigned int jd_samples_threads(struct jd_samples_reader *r)
+{
+	if (r->hdr)
+		return r->hdr->nr_threads;
+	if (r->jdc)
+		return jdc_reader_threads(r->jdc);
+	return r->nr_files;
+}
+
+/* Upper bound of the samples jd_samples_read() will return */
+uint64_t jd_samples_count(struct jd_samples_reader *r)
+{
+	return r->count;
+}
+
 struct jd_slist jd_samples_plugins = {
 	NULL,
 };
@@ -109,39 +597,464 @@ void jd_samples_unregister(struct jd_samples_ops *ops)
 	jd_slist_remove(&jd_samples_plugins, ops);
 }
 
+/* Rows of the --merge rankings */
+#define MERGE_TOP		10
+#define MAX_PERCENTILES		16
+
 static struct option long_options[] = {
 	{ "help",	no_argument,		0,	'h' },
 	{ "version",	no_argument,		0,	 0  },
 	{ "format",	required_argument,	0,	'f' },
 	{ "listen",	required_argument,	0,	'l' },
+	{ "threshold",	required_argument,	0,	't' },
+	{ "from",	required_argument,	0,	 0  },
+	{ "to",		required_argument,	0,	 0  },
+	{ "cpu",	required_argument,	0,	 0  },
+	{ "listen-threads", required_argument,	0,	 0  },
+	{ "senders",	required_argument,	0,	 0  },
+	{ "merge",	no_argument,		0,	'm' },
+	{ "merge-output", required_argument,	0,	 0  },
+	{ "jobs",	required_argument,	0,	'j' },
+	{ "top",	required_argument,	0,	 0  },
+	{ "percentiles", required_argument,	0,	 0  },
+	{ "compare",	required_argument,	0,	 0  },
+	{ "regression",	required_argument,	0,	 0  },
+	{ "regression-slack", required_argument, 0,	 0  },
+	{ "ks-alpha",	required_argument,	0,	 0  },
+	{ "ks-min-d",	required_argument,	0,	 0  },
+	{ "allow-missing", no_argument,		0,	 0  },
 	{ 0, },
 };
 
+/*
+ * Parses SEC[.FRAC] into ns. With end the parsing stops at the first
+ * character which doesn't belong to the number.
+ */
+static int parse_seconds(const char *str, uint64_t *ns, const char **end)
+{
+	uint64_t sec = 0, frac = 0, scale = 1000000000;
+	const char *p = str;
+
+	if (*p < '0' || *p > '9')
+		return -EINVAL;
+	for (; *p >= '0' && *p <= '9'; p++)
+		sec = sec * 10 + *p - '0';
+
+	if (*p == '.') {
+		for (p++; *p >= '0' && *p <= '9'; p++) {
+			if (scale > 1) {
+				scale /= 10;
+				frac += (*p - '0') * scale;
+			}
+		}
+	}
+	if (end)
+		*end = p;
+	else if (*p)
+		return -EINVAL;
+
+	*ns = sec * 1000000000 + frac;
+	return 0;
+}
+
+/* Parses HH:MM[:SS[.FRAC]] into ns since midnight */
+static int parse_time_of_day(const char *str, uint64_t *ns)
+{
+	uint64_t hh, mm, ss = 0;
+	const char *p;
+
+	if (parse_seconds(str, &hh, &p) || *p != ':' || hh % 1000000000)
+		return -EINVAL;
+	if (parse_seconds(p + 1, &mm, &p) || mm % 1000000000)
+		return -EINVAL;
+	if (*p == ':' && parse_seconds(p + 1, &ss, &p))
+		return -EINVAL;
+	if (*p)
+		return -EINVAL;
+
+	hh /= 1000000000;
+	mm /= 1000000000;
+	if (hh > 23 || mm > 59 || ss >= 60ULL * 1000000000)
+		return -EINVAL;
+
+	*ns = (hh * 3600 + mm * 60) * 1000000000 + ss;
+	return 0;
+}
+
+#define NSEC_PER_SEC		1000000000ULL
+#define NSEC_PER_DAY		(24 * 3600 * NSEC_PER_SEC)
+
+/*
+ * CLOCK_REALTIME ns of the local time of day tod, days after the day
+ * of real. mktime() takes care of daylight saving time.
+ */
+static uint64_t local_time(uint64_t real, uint64_t tod, int days)
+{
+	time_t t = real / NSEC_PER_SEC;
+	struct tm tm;
+
+	if (!localtime_r(&t, &tm))
+		err_handler(errno, "localtime_r()");
+	tm.tm_mday += days;
+	tm.tm_hour = tod / NSEC_PER_SEC / 3600;
+	tm.tm_min = tod / NSEC_PER_SEC / 60 % 60;
+	tm.tm_sec = tod / NSEC_PER_SEC % 60;
+	tm.tm_isdst = -1;
+	t = mktime(&tm);
+	if (t == (time_t)-1)
+		err_handler(EINVAL, "mktime()");
+
+	return (uint64_t)t * NSEC_PER_SEC + tod % NSEC_PER_SEC;
+}
+
+/* Parses the local YYYY-MM-DDTHH:MM[:SS[.FRAC]] into ns since the epoch */
+static int parse_date_time(const char *str, uint64_t *ns)
+{
+	unsigned int year, mon, day;
+	uint64_t tod;
+	struct tm tm;
+	time_t t;
+	int n = 0;
+
+	if (sscanf(str, "%4u-%2u-%2u%n", &year, &mon, &day, &n) != 3 ||
+	    (str[n] != 'T' && str[n] != ' '))
+		return -EINVAL;
+	if (year < 1970 || mon < 1 || mon > 12 || day < 1 || day > 31 ||
+	    parse_time_of_day(str + n + 1, &tod))
+		return -EINVAL;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = year - 1900;
+	tm.tm_mon = mon - 1;
+	tm.tm_mday = day;
+	tm.tm_isdst = -1;
+	t = mktime(&tm);
+	if (t == (time_t)-1 || tm.tm_mday != (int)day)
+		return -EINVAL;
+
+	*ns = local_time((uint64_t)t * NSEC_PER_SEC, tod, 0);
+	return 0;
+}
+
+/*
+ * --from/--to: SEC[.FRAC] on CLOCK_MONOTONIC as printed in the CSV
+ * output, @SEC[.FRAC] since the epoch, a local date and time
+ * YYYY-MM-DDTHH:MM[:SS[.FRAC]] or a local HH:MM[:SS[.FRAC]]
+ */
+static int parse_time_arg(const char *str, struct time_arg *t)
+{
+	if (*str == '@') {
+		t->type = TIME_EPOCH;
+		return parse_seconds(str + 1, &t->ns, NULL);
+	}
+	if (strchr(str, '-')) {
+		t->type = TIME_EPOCH;
+		return parse_date_time(str, &t->ns);
+	}
+	if (strchr(str, ':')) {
+		t->type = TIME_OF_DAY;
+		return parse_time_of_day(str, &t->ns);
+	}
+	t->type = TIME_MONOTONIC;
+	return parse_seconds(str, &t->ns, NULL);
+}
+
 static void __attribute__((noreturn)) usage(int status)
 {
 	printf("jittersamples [options] [DIR]\n");
+	printf("jittersamples --merge [options] DIR|FILE...\n");
+	printf("jittersamples --compare BASELINE [options] DIR|FILE\n");
 	printf("  DIR			Directory generated by jitterdebugger --output\n");
 	printf("\n");
 	printf("Usage:\n");
 	printf("  -h, --help		Print this help\n");
 	printf("      --version		Print version of jittersamples\n");
 	printf("  -f, --format FMT	Exporting samples in format [csv, hdf5]\n");
-	printf("  -l, --listen PORT	Listen on PORT, dump samples to stdout\n");
+	printf("  -l, --listen PORT	Listen on PORT, dump samples to stdout or, with DIR,\n");
+	printf("			store them in DIR/HOST-SENDER in format FMT. The\n");
+	printf("			--stream-hist windows are added up into\n");
+	printf("			DIR/HOST-SENDER/results.json\n");
+	printf("      --listen-threads N Receive with N threads. Default: 1\n");
+	printf("      --senders N	Stop listening after N senders have finished\n");
+	printf("  -t, --threshold VAL	Only export samples with a latency of at least VAL\n");
+	printf("      --from TIME	Only export samples taken at or after TIME\n");
+	printf("      --to TIME		Only export samples taken at or before TIME.\n");
+	printf("			TIME is SEC[.FRAC] on CLOCK_MONOTONIC as in the\n");
+	printf("			CSV output, @SEC[.FRAC] since the epoch, the local\n");
+	printf("			YYYY-MM-DDTHH:MM[:SS[.FRAC]] or the local time of\n");
+	printf("			day HH:MM[:SS[.FRAC]] for recordings of up to a day\n");
+	printf("      --cpu CPUSET	Only export samples of the threads on CPUSET\n");
+	printf("\n");
+	printf("Merging:\n");
+	printf("  -m, --merge		Merge the histograms of the results.json in every\n");
+	printf("			DIR (or of the DIR/*/results.json) or FILE per CPU,\n");
+	printf("			per host and overall and rank the worst hosts and CPUs\n");
+	printf("      --merge-output FILE\n");
+	printf("			Write the merged results to FILE\n");
+	printf("  -j, --jobs N		Parse with N threads. Default: online CPUs\n");
+	printf("      --top N		Rows of the rankings. Default: %u\n",
+	       MERGE_TOP);
+	printf("      --percentiles LIST Comma separated, ascending percentiles,\n");
+	printf("			the highest ranks. Default: 50,90,99,99.9,99.99\n");
+	printf("\n");
+	printf("Comparing:\n");
+	printf("      --compare BASELINE Compare the results.json in DIR or FILE with the\n");
+	printf("			results.json BASELINE, exit with 2 on a regression\n");
+	printf("      --regression LIST	Comma separated P:PCT, a percentile P may grow by\n");
+	printf("			at most PCT percent. Default: 99:10,99.99:20\n");
+	printf("      --regression-slack VALUE\n");
+	printf("			Percentiles may also grow by VALUE. Default: 0\n");
+	printf("      --ks-alpha ALPHA	Significance of the Kolmogorov-Smirnov test,\n");
+	printf("			0 disables it. Default: 0.001\n");
+	printf("      --ks-min-d D	Smallest KS distance D+ counted as regression.\n");
+	printf("			Default: 0.05\n");
+	printf("      --allow-missing	CPUs of the baseline may be missing in the run\n");
 
 	exit(status);
 }
 
+struct export_args {
+	const char *format;
+	struct sample_filter *filter;
+};
+
+static struct jd_samples_ops *find_plugin(const char *format)
+{
+	struct jd_slist *list;
+
+	for (list = jd_samples_plugins.next; list; list = list->next) {
+		struct jd_samples_ops *plugin = list->data;
+
+		if (!strcmp(plugin->format, format))
+			return plugin;
+	}
+
+	return NULL;
+}
+
+/*
+ * Converts a --from/--to value into CLOCK_MONOTONIC ns. A time of day
+ * is taken on the day after the start of the recording if it falls
+ * into the recording there, otherwise on the day of the start, so
+ * recordings running over midnight work as expected. It would be
+ * ambiguous for recordings of more than a day, last_ts is the
+ * CLOCK_MONOTONIC timestamp of the last sample.
+ */
+static uint64_t resolve_time(const struct time_arg *t,
+			     const struct jd_samples_header *hdr,
+			     uint64_t last_ts, const char *dir)
+{
+	uint64_t start, end, real;
+
+	if (t->type == TIME_MONOTONIC)
+		return t->ns;
+
+	if (!hdr || !hdr->start_realtime_ns || hdr->clock_id != CLOCK_MONOTONIC)
+		err_abort("The samples in '%s' have no wall clock start time, "
+			  "use CLOCK_MONOTONIC seconds for --from and --to\n",
+			  dir);
+
+	start = hdr->start_realtime_ns;
+	if (t->type == TIME_EPOCH) {
+		real = t->ns;
+	} else {
+		if (last_ts > hdr->start_ns + NSEC_PER_DAY)
+			err_abort("The samples in '%s' span more than a day, "
+				  "use YYYY-MM-DDTHH:MM[:SS] for --from and "
+				  "--to\n", dir);
+		end = start;
+		if (last_ts > hdr->start_ns)
+			end += last_ts - hdr->start_ns;
+		real = local_time(start, t->ns, 0);
+		if (real < start && local_time(start, t->ns, 1) <= end)
+			real = local_time(start, t->ns, 1);
+	}
+
+	/* Before the clock started */
+	if (real + hdr->start_ns < start)
+		return 0;
+
+	return real - start + hdr->start_ns;
+}
+
+/* CLOCK_MONOTONIC ns of the last sample in the file */
+static uint64_t last_record_ts(FILE *fd, off_t data_off, size_t size)
+{
+	struct latency_sample ls;
+	struct mmap_sample ms;
+	uint64_t n = (file_size(fd) - data_off) / size;
+
+	if (!n || fseeko(fd, data_off + (n - 1) * size, SEEK_SET) < 0)
+		return 0;
+	if (size == sizeof(ms))
+		return fread(&ms, size, 1, fd) == 1 ? ms.ts : 0;
+	return fread(&ls, size, 1, fd) == 1 ? sample_ts(&ls) : 0;
+}
+
+/*
+ * The header of the samples in dir or NULL and the timestamp of the
+ * last sample. samples.raw is written in batches per thread, its last
+ * record is only a few ms before the end.
+ */
+static struct jd_samples_header *load_header(const char *dir,
+					     uint64_t *last_ts)
+{
+	struct sample_filter all = { .to = UINT64_MAX, .all_cpus = 1 };
+	struct jd_samples_header *hdr;
+	struct jd_samples_reader *r;
+	uint64_t ts;
+	unsigned int i;
+
+	r = reader_open(dir, &all);
+	hdr = r->hdr;
+	r->hdr = NULL;
+
+	*last_ts = 0;
+	if (r->raw)
+		*last_ts = last_record_ts(r->raw, r->data_off,
+					  sizeof(struct latency_sample));
+	else if (r->jdc)
+		*last_ts = jdc_reader_last_ts(r->jdc);
+	for (i = 0; i < r->nr_files; i++) {
+		ts = last_record_ts(r->files[i], r->data_off,
+				    sizeof(struct mmap_sample));
+		if (ts > *last_ts)
+			*last_ts = ts;
+	}
+	reader_close(r);
+
+	return hdr;
+}
+
+/*
+ * --cpu selects CPUs, the samples carry the thread index. The header
+ * maps the threads to their CPUs, files without one only have the
+ * thread index.
+ */
+static void thread_filter(struct sample_filter *f,
+			  const struct jd_samples_header *hdr, const char *dir)
+{
+	unsigned int i;
+
+	if (f->all_cpus)
+		return;
+
+	if (!hdr) {
+		warn_handler("The samples in '%s' have no header, --cpu "
+			     "selects the thread index", dir);
+		f->threads = f->cpus;
+		return;
+	}
+
+	CPU_ZERO(&f->threads);
+	for (i = 0; i < hdr->nr_threads && i < CPU_SETSIZE; i++) {
+		if (hdr->threads[i].cpu < CPU_SETSIZE &&
+		    CPU_ISSET(hdr->threads[i].cpu, &f->cpus))
+			CPU_SET(i, &f->threads);
+	}
+}
+
+/* Runs the plugin of the format on the samples in dir */
+static int export_samples(const char *dir, const char *format,
+			  struct sample_filter *filter)
+{
+	struct jd_samples_header *hdr = NULL;
+	struct jd_samples_reader *input;
+	struct jd_samples_ops *plugin;
+	struct jd_samples_info info;
+	struct sample_filter f = *filter;
+	uint64_t last_ts = 0;
+
+	plugin = find_plugin(format);
+	if (!plugin)
+		return -EINVAL;
+
+	info.dir = dir;
+
+	if (f.from_arg.type != TIME_MONOTONIC ||
+	    f.to_arg.type != TIME_MONOTONIC || !f.all_cpus)
+		hdr = load_header(dir, &last_ts);
+	f.from = resolve_time(&f.from_arg, hdr, last_ts, dir);
+	f.to = resolve_time(&f.to_arg, hdr, last_ts, dir);
+	thread_filter(&f, hdr, dir);
+	free(hdr);
+	if (f.from > f.to)
+		err_abort("--from is after --to\n");
+
+	input = reader_open(info.dir, &f);
+	info.cpus_online = jd_samples_threads(input);
+	if (!info.cpus_online)
+		read_online_cpus(&info);
+
+	plugin->output(&info, input);
+	reader_close(input);
+
+	return 0;
+}
+
+static void export_sender(const char *dir, void *arg)
+{
+	struct export_args *e = arg;
+
+	export_samples(dir, e->format, e->filter);
+}
+
+static int stop_listen;
+
+static void sig_handler(int sig)
+{
+	WRITE_ONCE(stop_listen, 1);
+}
+
+static void collect_samples(const char *port, const char *dir,
+			    unsigned int threads, unsigned int senders,
+			    struct export_args *e)
+{
+	struct sigaction sa;
+
+	sa.sa_flags = 0;
+	sa.sa_handler = sig_handler;
+	sigemptyset(&sa.sa_mask);
+
+	if (sigaction(SIGINT, &sa, NULL) < 0)
+		err_handler(errno, "sigaction()");
+	if (sigaction(SIGTERM, &sa, NULL) < 0)
+		err_handler(errno, "sigaction()");
+
+	jd_collect(port, dir, threads, senders, &stop_listen,
+		   export_sender, e);
+}
+
 int main(int argc, char *argv[])
 {
-	FILE *input;
-	int c, long_idx;
+	int c, long_idx, err;
+	long val;
 	char *format = "csv";
 	char *port = NULL;
-	struct jd_samples_info info;
-	struct jd_slist *list;
+	unsigned int listen_threads = 1, senders = 0;
+	struct sample_filter filter = {
+		.to_arg = { TIME_MONOTONIC, UINT64_MAX },
+		.all_cpus = 1,
+	};
+	struct export_args e;
+	double percentiles[MAX_PERCENTILES] = { 50, 90, 99, 99.9, 99.99 };
+	struct jd_merge_params merge = {
+		.top = MERGE_TOP,
+		.percentiles = percentiles,
+		.num_percentiles = 5,
+	};
+	int opt_merge = 0;
+	char *opt_compare = NULL;
+	struct jd_compare_params compare;
+	struct jd_dists baseline, run;
+	char *end;
+
+	val = sysconf(_SC_NPROCESSORS_ONLN);
+	merge.jobs = val > 0 ? val : 1;
+	jd_compare_init(&compare);
 
 	while (1) {
-		c = getopt_long(argc, argv, "hf:l:", long_options, &long_idx);
+		c = getopt_long(argc, argv, "hf:l:t:mj:", long_options, &long_idx);
 		if (c < 0)
 			break;
 
@@ -151,6 +1064,93 @@ int main(int argc, char *argv[])
 				printf("jittersamples %s\n",
 					JD_VERSION);
 				exit(0);
+			} else if (!strcmp(long_options[long_idx].name, "from")) {
+				if (parse_time_arg(optarg, &filter.from_arg))
+					err_abort("Invalid value for from. "
+						  "Expected SEC[.FRAC], "
+						  "@SEC[.FRAC], "
+						  "YYYY-MM-DDTHH:MM[:SS] or "
+						  "HH:MM[:SS]\n");
+			} else if (!strcmp(long_options[long_idx].name, "to")) {
+				if (parse_time_arg(optarg, &filter.to_arg))
+					err_abort("Invalid value for to. "
+						  "Expected SEC[.FRAC], "
+						  "@SEC[.FRAC], "
+						  "YYYY-MM-DDTHH:MM[:SS] or "
+						  "HH:MM[:SS]\n");
+			} else if (!strcmp(long_options[long_idx].name, "cpu")) {
+				if (cpuset_parse(&filter.cpus, optarg) < 0)
+					err_abort("Invalid value for cpu. "
+						  "Valid range is [0..]\n");
+				filter.all_cpus = 0;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "listen-threads")) {
+				val = parse_dec(optarg);
+				if (val < 1 || val > 1024)
+					err_abort("Invalid value for listen-threads. "
+						  "Valid range is [1..1024]\n");
+				listen_threads = val;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "senders")) {
+				val = parse_dec(optarg);
+				if (val < 0)
+					err_abort("Invalid value for senders. "
+						  "Valid range is [0..]\n");
+				senders = val;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "merge-output")) {
+				merge.output = optarg;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "top")) {
+				val = parse_dec(optarg);
+				if (val < 0)
+					err_abort("Invalid value for top. "
+						  "Valid range is [0..]\n");
+				merge.top = val;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "percentiles")) {
+				val = parse_percentiles(optarg, percentiles,
+							MAX_PERCENTILES);
+				if (val < 1)
+					err_abort("Invalid value for percentiles. "
+						  "Expected 1 to %u ascending "
+						  "values in (0..100]\n",
+						  MAX_PERCENTILES);
+				merge.num_percentiles = val;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "compare")) {
+				opt_compare = optarg;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "regression")) {
+				if (jd_compare_parse_limits(&compare, optarg))
+					err_abort("Invalid value for regression. "
+						  "Expected at most %u P:PCT "
+						  "with ascending P\n",
+						  JD_COMPARE_MAX);
+			} else if (!strcmp(long_options[long_idx].name,
+					   "regression-slack")) {
+				val = parse_dec(optarg);
+				if (val < 0)
+					err_abort("Invalid value for regression-slack. "
+						  "Valid range is [0..]\n");
+				compare.slack = val;
+			} else if (!strcmp(long_options[long_idx].name,
+					   "ks-alpha")) {
+				compare.ks_alpha = strtod(optarg, &end);
+				if (*end || !(compare.ks_alpha >= 0 &&
+					      compare.ks_alpha < 1))
+					err_abort("Invalid value for ks-alpha. "
+						  "Valid range is [0..1)\n");
+			} else if (!strcmp(long_options[long_idx].name,
+					   "ks-min-d")) {
+				compare.ks_min_d = strtod(optarg, &end);
+				if (*end || !(compare.ks_min_d >= 0 &&
+					      compare.ks_min_d <= 1))
+					err_abort("Invalid value for ks-min-d. "
+						  "Valid range is [0..1]\n");
+			} else if (!strcmp(long_options[long_idx].name,
+					   "allow-missing")) {
+				compare.allow_missing = 1;
 			}
 			break;
 		case 'h':
@@ -161,13 +1161,59 @@ int main(int argc, char *argv[])
 		case 'l':
 			port = optarg;
 			break;
+		case 'm':
+			opt_merge = 1;
+			break;
+		case 'j':
+			val = parse_dec(optarg);
+			if (val < 1 || val > 1024)
+				err_abort("Invalid value for jobs. "
+					  "Valid range is [1..1024]\n");
+			merge.jobs = val;
+			break;
+		case 't':
+			val = parse_dec(optarg);
+			if (val < 0)
+				err_abort("Invalid value for threshold. "
+					  "Valid range is [0..]\n");
+			filter.threshold = val;
+			break;
 		default:
 			printf("unknown option\n");
 			usage(1);
 		}
 	}
 
-	if (port) {
+	if (opt_merge) {
+		if (optind == argc) {
+			fprintf(stderr, "Missing input DIR\n");
+			usage(1);
+		}
+		err = jd_merge(&argv[optind], argc - optind, &merge);
+		exit(err ? 1 : 0);
+	}
+
+	if (opt_compare) {
+		if (optind != argc - 1) {
+			fprintf(stderr, "Expected one input DIR or FILE\n");
+			usage(1);
+		}
+		err = jd_dists_load(&baseline, opt_compare);
+		if (err)
+			err_abort("Couldn't read baseline '%s': %s\n",
+				  opt_compare, strerror(-err));
+		err = jd_dists_load(&run, argv[optind]);
+		if (err)
+			err_abort("Couldn't read '%s': %s\n", argv[optind],
+				  strerror(-err));
+
+		err = jd_compare(&baseline, &run, &compare);
+		jd_dists_free(&baseline);
+		jd_dists_free(&run);
+		exit(err ? 2 : 0);
+	}
+
+	if (port && optind == argc) {
 		dump_samples(port);
 		exit(0);
 	}
@@ -176,31 +1222,24 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Missing input DIR\n");
 		usage(1);
 	}
-	info.dir = argv[optind];
-
-	read_online_cpus(&info);
 
 	__jd_plugin_init();
 
-	input = jd_fopen(info.dir, "samples.raw", "r");
-	if (!input)
-		err_handler(errno, "Could not open '%s/samples.raw' for reading", info.dir);
-
-	for (list = jd_samples_plugins.next; list; list = list->next) {
-		struct jd_samples_ops *plugin = list->data;
-
-		if (strcmp(plugin->format, format))
-			continue;
-
-		plugin->output(&info, input);
-		break;
+	if (port && !find_plugin(format)) {
+		err = -EINVAL;
+	} else if (port) {
+		e.format = format;
+		e.filter = &filter;
+		collect_samples(port, argv[optind], listen_threads, senders,
+				&e);
+		err = 0;
+	} else {
+		err = export_samples(argv[optind], format, &filter);
 	}
 
-	fclose(input);
-
 	__jd_plugin_cleanup();
 
-	if (!list) {
+	if (err) {
 		fprintf(stderr, "Unsupported file format \"%s\"\n", format);
 		exit(1);
 	}
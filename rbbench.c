@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "jitterdebugger.h"
+
+/*
+ * Measures the cost of ringbuffer_write() for the worker. The main
+ * thread writes samples back to back while a consumer thread drains
+ * the ring the same way the I/O thread of jitterdebugger does: it
+ * reads in batches and sleeps on the doorbell in between.
+ */
+
+#define RB_SIZE			(1024 * 1024)
+#define RB_WATERMARK_DIV	8
+#define RB_SAMPLES		(50 * 1000 * 1000)
+#define RB_BATCH		256
+#define RB_TIMEOUT_MS		100
+
+#define NSEC_PER_SEC		1000000000ULL
+
+struct rbbench {
+	struct ringbuffer *rb;
+	uint32_t doorbell;
+	int done;
+	uint64_t read;
+	int cpu;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void pin_cpu(pthread_t tid, int cpu)
+{
+	cpu_set_t set;
+	int err;
+
+	if (cpu < 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	err = pthread_setaffinity_np(tid, sizeof(set), &set);
+	if (err)
+		err_handler(err, "pthread_setaffinity_np()");
+}
+
+static void *consumer(void *arg)
+{
+	struct timespec timeout = { 0, RB_TIMEOUT_MS * 1000000 };
+	struct rbbench *b = arg;
+	uint64_t ts[RB_BATCH], val[RB_BATCH];
+	unsigned int n;
+	int done;
+
+	pin_cpu(pthread_self(), b->cpu);
+
+	do {
+		done = READ_ONCE(b->done);
+
+		do {
+			n = ringbuffer_read_batch(b->rb, ts, val, RB_BATCH);
+			b->read += n;
+		} while (n == RB_BATCH);
+
+		if (!done)
+			jd_futex_wait(&b->doorbell, &timeout);
+	} while (!done);
+
+	return NULL;
+}
+
+static void __attribute__((noreturn)) usage(int status)
+{
+	printf("rbbench [options]\n");
+	printf("\n");
+	printf("Usage:\n");
+	printf("  -h, --help		Print this help\n");
+	printf("  -n, --samples N	Write N samples. Default: %u\n",
+	       RB_SAMPLES);
+	printf("  -s, --size N		Ring size in slots, power of 2. Default: %u\n",
+	       RB_SIZE);
+	printf("  -p, --producer CPU	Pin the producer to CPU\n");
+	printf("  -c, --consumer CPU	Pin the consumer to CPU\n");
+
+	exit(status);
+}
+
+static struct option long_options[] = {
+	{ "help",	no_argument,		0,	'h' },
+	{ "samples",	required_argument,	0,	'n' },
+	{ "size",	required_argument,	0,	's' },
+	{ "producer",	required_argument,	0,	'p' },
+	{ "consumer",	required_argument,	0,	'c' },
+	{ 0, },
+};
+
+int main(int argc, char *argv[])
+{
+	struct rbbench b = { .cpu = -1 };
+	unsigned long samples = RB_SAMPLES, i;
+	unsigned int size = RB_SIZE;
+	uint64_t start, end, ts;
+	pthread_t tid;
+	long val;
+	int c, err, cpu = -1;
+
+	while (1) {
+		c = getopt_long(argc, argv, "hn:s:p:c:", long_options, NULL);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage(0);
+		case 'n':
+			val = parse_dec(optarg);
+			if (val <= 0)
+				err_abort("Invalid value for samples. "
+					  "Valid range is [1..]\n");
+			samples = val;
+			break;
+		case 's':
+			val = parse_dec(optarg);
+			if (val <= 0 || val > UINT32_MAX / 2 || (val & (val - 1)))
+				err_abort("Invalid value for size. "
+					  "Needs to be a power of 2\n");
+			size = val;
+			break;
+		case 'p':
+			cpu = parse_dec(optarg);
+			if (cpu < 0)
+				err_abort("Invalid value for producer CPU\n");
+			break;
+		case 'c':
+			b.cpu = parse_dec(optarg);
+			if (b.cpu < 0)
+				err_abort("Invalid value for consumer CPU\n");
+			break;
+		default:
+			usage(1);
+		}
+	}
+
+	if (optind != argc)
+		usage(1);
+
+	pin_cpu(pthread_self(), cpu);
+
+	b.rb = ringbuffer_create(size);
+	if (!b.rb)
+		err_handler(ENOMEM, "ringbuffer_create()");
+	ringbuffer_set_doorbell(b.rb, &b.doorbell, size / RB_WATERMARK_DIV);
+
+	err = pthread_create(&tid, NULL, consumer, &b);
+	if (err)
+		err_handler(err, "pthread_create()");
+
+	/* A sample every µs with a small latency, the common case */
+	ts = now_ns();
+	start = now_ns();
+	for (i = 0; i < samples; i++) {
+		ts += 1000;
+		ringbuffer_write(b.rb, ts, i & 0xffff);
+	}
+	end = now_ns();
+
+	WRITE_ONCE(b.done, 1);
+	jd_futex_wake(&b.doorbell);
+	err = pthread_join(tid, NULL);
+	if (err)
+		err_handler(err, "pthread_join()");
+
+	printf("samples:   %lu\n", samples);
+	printf("read:      %" PRIu64 "\n", b.read);
+	printf("dropped:   %u\n", ringbuffer_overflow(b.rb));
+	printf("ns/sample: %.2f\n", (double)(end - start) / samples);
+
+	ringbuffer_free(b.rb);
+
+	return 0;
+}